@@ -0,0 +1,354 @@
+/*
+ * snd-sdio bus throughput benchmark
+ *
+ * Plays noise on an snd-sdio card with alsa-lib and reports what crossed the
+ * transport during the run, from /proc/asound/cardN/sdio: bus throughput,
+ * transfers and their latency, DAC FIFO underflows and CPU. Load the module
+ * with emulate=1 to run it without a board.
+ *
+ * build: make bench
+ * usage: sdio_bench -C 1 -r 48000 -f S32_LE -c 2 -p 4096 -t 5
+ *
+ * Exit status: 0 ok, 1 xruns, underflows, dropped bytes or transfer errors,
+ * 2 configuration not supported by the card.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUFFER_BYTES_MAX	(2 * 1024 * 1024)	/* sdio_pcm_hw.buffer_bytes_max */
+
+/* the counters of sdio_proc_read() */
+static const char *const stat_names[] = {
+    "bytes_out", "bytes_in", "transfers", "errors", "busy_ns", "lat_max_ns",
+    "underflows", "stall_ns", "tx_dropped", "fifo_irqs",
+};
+#define NR_STATS	(sizeof(stat_names) / sizeof(stat_names[0]))
+
+enum { BYTES_OUT, BYTES_IN, TRANSFERS, ERRORS, BUSY_NS, LAT_MAX_NS,
+       UNDERFLOWS, STALL_NS, TX_DROPPED, FIFO_IRQS };
+
+struct sdio_stats {
+    char transport[32];
+    char pacing[32];
+    unsigned int block_size;
+    unsigned int max_transfer;
+    unsigned int tx_depth, tx_queue_max;
+    uint64_t v[NR_STATS];
+};
+
+struct cpu_times {
+    uint64_t busy, total;
+};
+
+static int card = -1;
+static unsigned int rate = 48000;
+static snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
+static unsigned int channels = 2;
+static unsigned int period_bytes = 4096;
+static double duration = 5.0;
+static int csv;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// =================================== STATS ==========================================
+static int read_stats(struct sdio_stats *st)
+{
+    char path[64], key[32], val[32];
+    unsigned long long v;
+    FILE *f;
+    unsigned int i;
+
+    snprintf(path, sizeof(path), "/proc/asound/card%d/sdio", card);
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    memset(st, 0, sizeof(*st));
+    while (fscanf(f, "%31s %31s", key, val) == 2) {
+        if (!strcmp(key, "transport"))
+            strcpy(st->transport, val);
+        if (!strcmp(key, "pacing"))
+            strcpy(st->pacing, val);
+        v = strtoull(val, NULL, 10);
+        if (!strcmp(key, "block_size"))
+            st->block_size = v;
+        if (!strcmp(key, "max_transfer"))
+            st->max_transfer = v;
+        if (!strcmp(key, "tx_depth"))
+            st->tx_depth = v;
+        if (!strcmp(key, "tx_queue_max"))
+            st->tx_queue_max = v;
+        for (i = 0; i < NR_STATS; i++)
+            if (!strcmp(key, stat_names[i]))
+                st->v[i] = v;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* the transfers run in the card tx thread, so the system is measured */
+static void read_cpu(struct cpu_times *t)
+{
+    unsigned long long user, nice, sys, idle, iowait, irq, softirq;
+    FILE *f = fopen("/proc/stat", "r");
+
+    memset(t, 0, sizeof(*t));
+    if (!f)
+        return;
+    if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu",
+               &user, &nice, &sys, &idle, &iowait, &irq, &softirq) == 7) {
+        t->busy = user + nice + sys + irq + softirq;
+        t->total = t->busy + idle + iowait;
+    }
+    fclose(f);
+}
+
+static double process_cpu(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// =================================== PLAY ===========================================
+static snd_pcm_t *setup_pcm(snd_pcm_uframes_t *period_frames, unsigned int *frame_bytes)
+{
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_sw_params_t *sw;
+    snd_pcm_uframes_t period, buffer;
+    unsigned int periods;
+    snd_pcm_t *pcm;
+    char name[32];
+    int ret;
+
+    snprintf(name, sizeof(name), "hw:%d,0", card);
+    ret = snd_pcm_open(&pcm, name, SND_PCM_STREAM_PLAYBACK, 0);
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", name, snd_strerror(ret));
+        return NULL;
+    }
+
+    *frame_bytes = snd_pcm_format_physical_width(format) / 8 * channels;
+    period = period_bytes / *frame_bytes;
+    periods = BUFFER_BYTES_MAX / period_bytes;
+    if (periods > 4)
+        periods = 4;
+    if (periods < 2)
+        periods = 2;
+    buffer = period * periods;
+
+    snd_pcm_hw_params_alloca(&hw);
+    snd_pcm_hw_params_any(pcm, hw);
+    if (!period ||
+        snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED) < 0 ||
+        snd_pcm_hw_params_set_format(pcm, hw, format) < 0 ||
+        snd_pcm_hw_params_set_channels(pcm, hw, channels) < 0 ||
+        snd_pcm_hw_params_set_rate(pcm, hw, rate, 0) < 0 ||
+        snd_pcm_hw_params_set_period_size(pcm, hw, period, 0) < 0 ||
+        snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer) < 0 ||
+        snd_pcm_hw_params(pcm, hw) < 0) {
+        snd_pcm_close(pcm);
+        return NULL;
+    }
+    snd_pcm_hw_params_get_period_size(hw, period_frames, NULL);
+    snd_pcm_hw_params_get_buffer_size(hw, &buffer);
+
+    snd_pcm_sw_params_alloca(&sw);
+    snd_pcm_sw_params_current(pcm, sw);
+    snd_pcm_sw_params_set_start_threshold(pcm, sw, buffer);
+    snd_pcm_sw_params_set_avail_min(pcm, sw, *period_frames);
+    snd_pcm_sw_params(pcm, sw);
+    return pcm;
+}
+
+static int play(snd_pcm_t *pcm, snd_pcm_uframes_t period_frames,
+                unsigned int frame_bytes, unsigned int *xruns)
+{
+    uint64_t end = now_ns() + (uint64_t)(duration * 1e9);
+    size_t bytes = period_frames * frame_bytes, i;
+    uint32_t noise = 0x9e3779b9u;
+    char *buf = malloc(bytes);
+    int err = 0;
+
+    if (!buf)
+        return -ENOMEM;
+
+    while (!err && now_ns() < end) {
+        snd_pcm_sframes_t done = 0, ret;
+
+        for (i = 0; i + 4 <= bytes; i += 4) {
+            noise ^= noise << 13;
+            noise ^= noise >> 17;
+            noise ^= noise << 5;
+            memcpy(buf + i, &noise, 4);
+        }
+        while (done < (snd_pcm_sframes_t)period_frames) {
+            ret = snd_pcm_writei(pcm, buf + done * frame_bytes, period_frames - done);
+            if (ret == -EPIPE) {
+                (*xruns)++;
+                ret = snd_pcm_recover(pcm, ret, 1);
+            }
+            if (ret < 0) {
+                fprintf(stderr, "write: %s\n", snd_strerror(ret));
+                err = ret;
+                break;
+            }
+            done += ret;
+        }
+    }
+    /* what is left in the buffer still goes over the bus */
+    if (!err)
+        snd_pcm_drain(pcm);
+    free(buf);
+    return err;
+}
+
+// ================================== REPORT ==========================================
+static void report(const struct sdio_stats *a, const struct sdio_stats *b,
+                   double wall, double sys_cpu, double proc_cpu, unsigned int xruns)
+{
+    uint64_t d[NR_STATS];
+    double expected = (double)rate * channels * snd_pcm_format_width(format) / 8;
+    double avg_us, avg_bytes;
+    unsigned int i;
+
+    for (i = 0; i < NR_STATS; i++)
+        d[i] = b->v[i] - a->v[i];
+    avg_us = d[TRANSFERS] ? d[BUSY_NS] / 1e3 / d[TRANSFERS] : 0;
+    avg_bytes = d[TRANSFERS] ? (double)d[BYTES_OUT] / d[TRANSFERS] : 0;
+
+    if (csv) {
+        printf("%s,%s,%u,%u,%u,%u,%u,%s,%u,%u,%.3f,%.3f,%.0f,%.0f,%.1f,%.1f,%.2f,%llu,%llu,%u,%.2f,%.2f\n",
+               b->transport, b->pacing, b->block_size, b->max_transfer, b->tx_depth,
+               b->tx_queue_max, rate, snd_pcm_format_name(format), channels, period_bytes,
+               d[BYTES_OUT] / wall / 1e6, expected / 1e6,
+               d[TRANSFERS] / wall, avg_bytes, avg_us, b->v[LAT_MAX_NS] / 1e3,
+               d[BUSY_NS] / wall / 1e7, (unsigned long long)d[UNDERFLOWS],
+               (unsigned long long)d[TX_DROPPED], xruns, sys_cpu, proc_cpu);
+        return;
+    }
+    printf("transport=%s pacing=%s block_size=%u max_transfer=%u tx_depth=%u rate=%u "
+           "format=%s channels=%u period_bytes=%u\n",
+           b->transport, b->pacing, b->block_size, b->max_transfer, b->tx_depth, rate,
+           snd_pcm_format_name(format), channels, period_bytes);
+    printf("bus_MBps=%.3f expected_MBps=%.3f bytes_out=%llu transfers=%llu "
+           "transfers_per_s=%.0f bytes_per_xfer=%.0f errors=%llu\n",
+           d[BYTES_OUT] / wall / 1e6, expected / 1e6,
+           (unsigned long long)d[BYTES_OUT], (unsigned long long)d[TRANSFERS],
+           d[TRANSFERS] / wall, avg_bytes, (unsigned long long)d[ERRORS]);
+    printf("xfer_avg_us=%.1f xfer_max_us=%.1f bus_busy_pct=%.2f tx_queue_max=%u "
+           "stall_ms=%.1f underflows=%llu tx_dropped=%llu fifo_irqs=%llu xruns=%u\n",
+           avg_us, b->v[LAT_MAX_NS] / 1e3, d[BUSY_NS] / wall / 1e7, b->tx_queue_max,
+           d[STALL_NS] / 1e6,
+           (unsigned long long)d[UNDERFLOWS], (unsigned long long)d[TX_DROPPED],
+           (unsigned long long)d[FIFO_IRQS], xruns);
+    printf("cpu_system_pct=%.2f cpu_process_pct=%.2f\n", sys_cpu, proc_cpu);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -C card [options]\n"
+            "  -C n        ALSA card number of the snd-sdio card\n"
+            "  -r rate     sample rate (default %u)\n"
+            "  -f format   sample format name (default %s)\n"
+            "  -c count    channels (default %u)\n"
+            "  -p bytes    period size in bytes (default %u)\n"
+            "  -t seconds  duration (default %.1f)\n"
+            "  -H          print the CSV header and exit\n"
+            "  -o csv      one CSV line for the run\n",
+            prog, rate, snd_pcm_format_name(format), channels, period_bytes, duration);
+}
+
+int main(int argc, char **argv)
+{
+    struct sdio_stats before, after;
+    struct cpu_times c0, c1;
+    snd_pcm_uframes_t period_frames;
+    unsigned int frame_bytes, xruns = 0;
+    snd_pcm_t *pcm;
+    uint64_t start;
+    double wall, cpu0, sys_cpu;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "C:r:f:c:p:t:Ho:h")) != -1) {
+        switch (opt) {
+            case 'C': card = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 'f':
+                format = snd_pcm_format_value(optarg);
+                if (format == SND_PCM_FORMAT_UNKNOWN) {
+                    fprintf(stderr, "unknown format %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'c': channels = atoi(optarg); break;
+            case 'p': period_bytes = atoi(optarg); break;
+            case 't': duration = atof(optarg); break;
+            case 'H':
+                printf("transport,pacing,block_size,max_transfer,tx_depth,tx_queue_max,rate,format,"
+                       "channels,period_bytes,"
+                       "bus_MBps,expected_MBps,transfers_per_s,bytes_per_xfer,xfer_avg_us,xfer_max_us,"
+                       "bus_busy_pct,underflows,tx_dropped,xruns,cpu_system_pct,"
+                       "cpu_process_pct\n");
+                return 0;
+            case 'o': csv = !strcmp(optarg, "csv"); break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (card < 0 || !channels) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    pcm = setup_pcm(&period_frames, &frame_bytes);
+    if (!pcm)
+        return 2;
+    if (read_stats(&before))
+        return 1;
+
+    read_cpu(&c0);
+    cpu0 = process_cpu();
+    start = now_ns();
+    ret = play(pcm, period_frames, frame_bytes, &xruns);
+    wall = (now_ns() - start) / 1e9;
+    read_cpu(&c1);
+    sys_cpu = c1.total > c0.total ?
+              100.0 * (c1.busy - c0.busy) / (c1.total - c0.total) : 0;
+
+    /* the tx thread may still be sending the last period */
+    usleep(100000);
+    if (read_stats(&after))
+        return 1;
+    report(&before, &after, wall, sys_cpu, (process_cpu() - cpu0) / wall * 100, xruns);
+
+    snd_pcm_close(pcm);
+    if (ret || xruns || after.v[ERRORS] != before.v[ERRORS] ||
+        after.v[UNDERFLOWS] != before.v[UNDERFLOWS] ||
+        after.v[TX_DROPPED] != before.v[TX_DROPPED])
+        return 1;
+    return 0;
+}
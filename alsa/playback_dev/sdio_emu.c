@@ -0,0 +1,337 @@
+/*
+ * Basic SDIO FPGA soundcard - emulated endpoint
+ *
+ * Copyright (c) by Giuliano Gambacorta <ggambacora88@gmail.com>
+ *
+ * Stands in for the FPGA behind an SDIO function, so that the data path can
+ * be measured on any machine: a transfer takes the time the bus would take,
+ * a command overhead per CMD53 plus the bytes at the bus bandwidth, and
+ * lands in a DAC FIFO that empties at the stream rate. A write that does not
+ * fit in the FIFO is held back until the DAC has made room, as the FPGA
+ * would do by keeping the bus busy. The FIFO interrupt is raised from an
+ * hrtimer set for the moment the level crosses low-water.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/errno.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+
+#include "sdio_playback.h"
+
+#define SDIO_BYTE_MODE_MAX	512	/* bytes per CMD53 in byte mode */
+
+static unsigned int emu_fifo_bytes = SDIO_FIFO_BYTES;
+static unsigned int emu_lowwater = SDIO_FIFO_LOWWATER;
+static unsigned int emu_blksize = SDIO_BLOCK_SIZE;
+static unsigned int emu_bus_kBps = 20000;	/* 4 bit bus at 50 MHz, less the CRCs */
+static unsigned int emu_cmd_ns = 15000;
+
+module_param(emu_fifo_bytes, uint, 0444);
+MODULE_PARM_DESC(emu_fifo_bytes, "DAC FIFO depth of the emulated FPGA.");
+module_param(emu_lowwater, uint, 0444);
+MODULE_PARM_DESC(emu_lowwater, "FIFO level at which the emulated FPGA interrupts.");
+module_param(emu_blksize, uint, 0444);
+MODULE_PARM_DESC(emu_blksize, "SDIO block size of the emulated FPGA.");
+module_param(emu_bus_kBps, uint, 0644);
+MODULE_PARM_DESC(emu_bus_kBps, "Emulated SDIO bus bandwidth, in kB/s.");
+module_param(emu_cmd_ns, uint, 0644);
+MODULE_PARM_DESC(emu_cmd_ns, "Emulated overhead of a CMD53, in ns.");
+
+struct sdio_emu
+{
+    struct sdio_xport *xp;
+    spinlock_t lock;
+    unsigned int bps;		/* DAC rate, 0 when stopped */
+    unsigned int playing :1;	/* the DAC starts with the first write */
+    unsigned int starved :1;
+    unsigned int irq_on :1;
+    unsigned int irq_fired :1;	/* at or below low-water, waiting for a refill */
+    u64 level;			/* bytes in the FIFO at level_ns */
+    u64 level_ns;
+    struct hrtimer irq_timer;
+};
+
+/*
+ * Take out what the DAC played since level_ns. Called with emu->lock held,
+ * from a transfer, so under sdio_xport.lock too.
+ */
+static void sdio_emu_drain(struct sdio_xport *xp, struct sdio_emu *emu, u64 now)
+{
+    u64 used;
+
+    if (emu->playing) {
+        used = mul_u64_u32_div(now - emu->level_ns, emu->bps, NSEC_PER_SEC);
+        if (used > emu->level) {
+            if (!emu->starved)
+                atomic64_inc(&xp->stats.underflows);
+            emu->starved = 1;
+            emu->level = 0;
+        } else {
+            emu->level -= used;
+        }
+    }
+    emu->level_ns = now;
+}
+
+/* CMD53s of a transfer: whole blocks in block mode, the tail in byte mode */
+static u64 sdio_emu_bus_ns(struct sdio_xport *xp, unsigned int bytes)
+{
+    unsigned int blocks = bytes / xp->blksize;
+    unsigned int tail = bytes % xp->blksize;
+    unsigned int cmds = DIV_ROUND_UP(blocks, SDIO_MAX_BLOCKS) +
+                        DIV_ROUND_UP(tail, SDIO_BYTE_MODE_MAX);
+
+    return (u64)cmds * emu_cmd_ns +
+           div_u64((u64)bytes * NSEC_PER_SEC, max(emu_bus_kBps, 1U) * 1000);
+}
+
+/*
+ * Set the interrupt for when the level reaches low-water, or raise it now if
+ * it is already there. Called with emu->lock held.
+ */
+static void sdio_emu_irq_arm(struct sdio_xport *xp, struct sdio_emu *emu, u64 now)
+{
+    u64 at;
+
+    if (!emu->irq_on || !emu->bps)
+        return;
+    if (emu->level > xp->low_water) {
+        emu->irq_fired = 0;
+        at = now + mul_u64_u32_div(emu->level - xp->low_water, NSEC_PER_SEC, emu->bps);
+    } else if (!emu->irq_fired) {
+        at = now;
+    } else {
+        return;
+    }
+    hrtimer_start(&emu->irq_timer, ns_to_ktime(at), HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart sdio_emu_irq_timer(struct hrtimer *t)
+{
+    struct sdio_emu *emu = container_of(t, struct sdio_emu, irq_timer);
+    struct sdio_xport *xp = emu->xp;
+    unsigned long flags;
+    bool fire = false;
+
+    spin_lock_irqsave(&emu->lock, flags);
+    if (emu->irq_on && emu->bps && !emu->irq_fired) {
+        u64 now = ktime_get_ns();
+
+        sdio_emu_drain(xp, emu, now);
+        if (emu->level <= xp->low_water) {
+            emu->irq_fired = 1;
+            fire = true;
+        } else {
+            // a write got in first
+            sdio_emu_irq_arm(xp, emu, now);
+        }
+    }
+    spin_unlock_irqrestore(&emu->lock, flags);
+
+    // outside the lock, the handler may start a transfer
+    if (fire && xp->irq_handler)
+        xp->irq_handler(xp->irq_data);
+    return HRTIMER_NORESTART;
+}
+
+static void sdio_emu_wait(u64 until)
+{
+    ktime_t t = ns_to_ktime(until);
+
+    set_current_state(TASK_UNINTERRUPTIBLE);
+    schedule_hrtimeout(&t, HRTIMER_MODE_ABS);
+}
+
+static int sdio_emu_write(struct sdio_xport *xp, const void *buf, unsigned int bytes)
+{
+    struct sdio_emu *emu = xp->priv;
+    u64 now = ktime_get_ns(), held = 0;
+    unsigned long flags;
+
+    spin_lock_irqsave(&emu->lock, flags);
+    sdio_emu_drain(xp, emu, now);
+    if (emu->playing && emu->level + bytes > xp->fifo_bytes)
+        held = mul_u64_u32_div(emu->level + bytes - xp->fifo_bytes,
+                               NSEC_PER_SEC, emu->bps);
+    spin_unlock_irqrestore(&emu->lock, flags);
+
+    xp->stats.stall_ns += held;
+    sdio_emu_wait(now + held + sdio_emu_bus_ns(xp, bytes));
+
+    spin_lock_irqsave(&emu->lock, flags);
+    /* outside a stream the FIFO is only a sink */
+    if (emu->bps) {
+        now = ktime_get_ns();
+        sdio_emu_drain(xp, emu, now);
+        emu->level = min_t(u64, emu->level + bytes, xp->fifo_bytes);
+        emu->playing = 1;
+        emu->starved = 0;
+        sdio_emu_irq_arm(xp, emu, now);
+    }
+    spin_unlock_irqrestore(&emu->lock, flags);
+    return 0;
+}
+
+/* no ADC behind the emulated FIFOs, reads return silence */
+static int sdio_emu_read(struct sdio_xport *xp, void *buf, unsigned int bytes)
+{
+    sdio_emu_wait(ktime_get_ns() + sdio_emu_bus_ns(xp, bytes));
+    memset(buf, 0, bytes);
+    return 0;
+}
+
+static int sdio_emu_rw_sg(struct sdio_xport *xp, bool write, struct scatterlist *sg,
+                          unsigned int nents, unsigned int bytes)
+{
+    if (write)
+        return sdio_emu_write(xp, NULL, bytes);
+    sdio_emu_wait(ktime_get_ns() + sdio_emu_bus_ns(xp, bytes));
+    sg_zero_buffer(sg, nents, bytes, 0);
+    return 0;
+}
+
+static int sdio_emu_duplex(struct sdio_xport *xp, const void *out, unsigned int out_bytes,
+                           void *in, unsigned int in_bytes)
+{
+    int ret = 0;
+
+    if (out_bytes)
+        ret = sdio_emu_write(xp, out, out_bytes);
+    if (!ret && in_bytes)
+        ret = sdio_emu_read(xp, in, in_bytes);
+    return ret;
+}
+
+static int sdio_emu_set_blksize(struct sdio_xport *xp, unsigned int blksize)
+{
+    xp->blksize = blksize;
+    xp->max_bytes = blksize * SDIO_MAX_BLOCKS;
+    // whole blocks, and at least one of them above low-water
+    xp->fifo_bytes = max(rounddown(emu_fifo_bytes, blksize), 2 * blksize);
+    xp->low_water = min(rounddown(emu_lowwater, blksize), xp->fifo_bytes - blksize);
+    return 0;
+}
+
+static void sdio_emu_start(struct sdio_xport *xp, unsigned int bps)
+{
+    struct sdio_emu *emu = xp->priv;
+    unsigned long flags;
+
+    spin_lock_irqsave(&emu->lock, flags);
+    emu->bps = bps;
+    emu->playing = 0;
+    emu->starved = 0;
+    emu->level = 0;
+    emu->level_ns = ktime_get_ns();
+    // empty, the driver sends the first fill without being asked
+    emu->irq_fired = 1;
+    spin_unlock_irqrestore(&emu->lock, flags);
+}
+
+static void sdio_emu_stop(struct sdio_xport *xp)
+{
+    struct sdio_emu *emu = xp->priv;
+    unsigned long flags;
+
+    spin_lock_irqsave(&emu->lock, flags);
+    emu->bps = 0;
+    emu->playing = 0;
+    emu->level = 0;
+    spin_unlock_irqrestore(&emu->lock, flags);
+    // from the trigger, the handler may be waiting for the same lock
+    hrtimer_try_to_cancel(&emu->irq_timer);
+}
+
+static int sdio_emu_irq_enable(struct sdio_xport *xp)
+{
+    struct sdio_emu *emu = xp->priv;
+    unsigned long flags;
+
+    spin_lock_irqsave(&emu->lock, flags);
+    emu->irq_on = 1;
+    spin_unlock_irqrestore(&emu->lock, flags);
+    return 0;
+}
+
+static void sdio_emu_irq_disable(struct sdio_xport *xp)
+{
+    struct sdio_emu *emu = xp->priv;
+    unsigned long flags;
+
+    spin_lock_irqsave(&emu->lock, flags);
+    emu->irq_on = 0;
+    spin_unlock_irqrestore(&emu->lock, flags);
+    hrtimer_cancel(&emu->irq_timer);
+}
+
+static void sdio_emu_release(struct sdio_xport *xp)
+{
+    struct sdio_emu *emu = xp->priv;
+
+    hrtimer_cancel(&emu->irq_timer);
+    kfree(emu);
+}
+
+static const struct sdio_xport_ops sdio_emu_ops =
+{
+    .name        = "emulated",
+    .start       = sdio_emu_start,
+    .stop        = sdio_emu_stop,
+    .write       = sdio_emu_write,
+    .read        = sdio_emu_read,
+    .rw_sg       = sdio_emu_rw_sg,
+    .duplex      = sdio_emu_duplex,
+    .set_blksize = sdio_emu_set_blksize,
+    .irq_enable  = sdio_emu_irq_enable,
+    .irq_disable = sdio_emu_irq_disable,
+    .release     = sdio_emu_release,
+};
+
+struct sdio_xport *sdio_emu_xport_new(void)
+{
+    struct sdio_xport *xp = kzalloc(sizeof(*xp), GFP_KERNEL);
+    struct sdio_emu *emu = kzalloc(sizeof(*emu), GFP_KERNEL);
+
+    if (!xp || !emu) {
+        kfree(xp);
+        kfree(emu);
+        return ERR_PTR(-ENOMEM);
+    }
+    spin_lock_init(&emu->lock);
+    hrtimer_init(&emu->irq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    emu->irq_timer.function = sdio_emu_irq_timer;
+    emu->xp = xp;
+    xp->ops = &sdio_emu_ops;
+    sdio_emu_set_blksize(xp, clamp(emu_blksize ?: SDIO_BLOCK_SIZE, 1U,
+                                   (unsigned int)SDIO_MAX_BLKSIZE));
+    xp->max_segs = 128;
+    xp->max_seg_size = 64 * 1024;
+    // a byte sink, any width will do
+    xp->caps = SDIO_CAP_PACKED24 | SDIO_CAP_TDM;
+    xp->priv = emu;
+    mutex_init(&xp->lock);
+    return xp;
+}
@@ -0,0 +1,48 @@
+#ifndef SDIO_IOCTL_H_
+#define SDIO_IOCTL_H_
+/*
+ * ioctls of the SDIO FPGA soundcard char device, major SDIO_MAJOR + the
+ * card's slot. Shared with userspace.
+ */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define SDIO_OP_READB		1	/* val = register at addr */
+#define SDIO_OP_WRITEB		2	/* register at addr = val */
+#define SDIO_OP_READSB		3	/* len bytes from the FIFO at addr into buf */
+#define SDIO_OP_WRITESB		4	/* len bytes of buf into the FIFO at addr */
+#define SDIO_OP_POLLB		5	/* read addr until (val & mask) == want, up to len us */
+
+#define SDIO_BATCH_MAX		64	/* commands per call */
+#define SDIO_BATCH_BYTES	(256 * 1024)	/* FIFO bytes per call, all commands */
+#define SDIO_POLL_MAX_US	2000	/* POLLB time per call, all commands: the bus is held */
+
+#define SDIO_BATCH_STOP		0x01	/* skip what follows a failed command */
+
+/* one command; result is 0 or a negative errno, -ECANCELED if skipped */
+struct sdio_cmd
+{
+    __u32 op;
+    __u32 addr;		/* function 1 address */
+    __u32 val;		/* written, or read back */
+    __u32 mask;		/* SDIO_OP_POLLB */
+    __u32 want;		/* SDIO_OP_POLLB */
+    __u32 len;		/* bytes, or us for SDIO_OP_POLLB */
+    __u64 buf;		/* user pointer */
+    __s32 result;
+    __u32 pad;
+};
+
+struct sdio_batch
+{
+    __u64 cmds;		/* user pointer to count struct sdio_cmd */
+    __u32 count;
+    __u32 flags;	/* SDIO_BATCH_* */
+    __u32 done;		/* commands run, set by the driver */
+    __u32 pad;
+};
+
+/* all the commands under one claim of the host, in order */
+#define SDIO_IOC_BATCH		_IOWR('s', 1, struct sdio_batch)
+
+#endif //SDIO_IOCTL_H_
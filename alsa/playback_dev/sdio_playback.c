@@ -29,16 +29,33 @@
 #include <linux/netdevice.h>
 #include <linux/delay.h>
 #include <linux/kthread.h>
+#include <linux/lcm.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/ioctl.h>
 #include <linux/io.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/miscdevice.h>
 #include <linux/slab.h>
+#include <linux/platform_device.h>
+#include <linux/scatterlist.h>
+#include <linux/seq_file.h>
+#include <linux/sched/signal.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+#include <asm/unaligned.h>
 
 #include <sound/core.h>
 #include <sound/control.h>
+#include <sound/info.h>
 #include <sound/pcm.h>
+#include <sound/pcm_params.h>
 #include <sound/initval.h>
 
 #include <linux/mmc/sdio_func.h>
@@ -58,16 +75,21 @@ MODULE_SUPPORTED_DEVICE("{{ALSA, SDIO FPGA}}");
 
 #define MAX_BUFFER (32 * 48) // depending on period_bytes* and periods_max
 #define SND_SDIO_DRIVER	"snd_sdio"
+#define SND_SDIO_EMU_DRIVER	"snd_sdio_emu"
 #define MAX_PCM_SUBSTREAMS	2
-#define byte_pos(x)	((x) / HZ)
-#define frac_pos(x)	((x) * HZ)
+#define SDIO_TX_DEPTH_MAX	8
+#define SDIO_SG_ALIGN		4	/* user buffers the host can DMA to in place */
+#define SDIO_XFER_MAX		(256 * 1024)	/* pipeline buffers are kmalloc'ed */
+// 24 bit samples go over the bus in 3 bytes, if the bitstream unpacks them
+#define SDIO_FMTBIT_S24		(SNDRV_PCM_FMTBIT_S24_LE | SNDRV_PCM_FMTBIT_S24_3LE)
+// positions in bytes * HZ, 64 bit: at 768 kHz a second late is over 2^32
+#define byte_pos(x)	div_u64((x), HZ)
+#define frac_pos(x)	((u64)(x) * HZ)
 
 // ============================ SDIO func declaration =================================
 static int sdio_open(struct inode *inode, struct file *file);
-static ssize_t sdio_write(struct file *file, const char __user *buf, size_t count,
-        loff_t *pos);
-static ssize_t sdio_read(struct file *file, char __user *buf, size_t count,
-        loff_t *pos);
+static ssize_t sdio_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t sdio_read_iter(struct kiocb *iocb, struct iov_iter *to);
 static long sdio_snd_ioctl(	struct file *file,
                            unsigned int cmd,  	// cmd is command
                            unsigned long arg);
@@ -76,25 +98,74 @@ static int __probe(struct sdio_func *func);
 static int sdio_probe(struct sdio_func *func, const struct sdio_device_id *id);
 static void __remove(struct sdio_func *func);
 static void sdio_remove(struct sdio_func *func);
+static int sdio_emu_probe(struct platform_device *pdev);
+static int sdio_emu_remove(struct platform_device *pdev);
+static void sdio_fw_loaded(const struct firmware *fw, void *context);
 
 static const struct sdio_device_id sdio_ids[] = {
         { SDIO_DEVICE(0x0213, 0x1002) },
         { },
 };
 
+/*
+ * One FPGA board. Nothing is shared between cards but the slot they take at
+ * probe: each has its own transport, sound card, threads and char device.
+ */
 struct sdio_card {
     struct sdio_func	*func;
+    struct sdio_xport	*xport;
+    struct snd_card		*snd;
 
-    struct list_head 	list;
+    unsigned int 		slot;		/* index[] and id[], SDIO_MAJOR + slot */
     unsigned int 		major;
 
     unsigned long 		ioport;
     struct cdev 		cdev;
     dev_t 				devid;
+
+    // char device bounce buffer
+    u8					*kbuf;		/* MAX_SDIO_BYTES */
+    struct mutex		kbuf_lock;
+
+    // bring-up: the bitstream load, if any, then the card
+    struct completion	fw_done;	/* the card is set up, or failed to */
+    unsigned int		ready :1;	/* sdio_card_setup() went through */
+    u64					probe_ns;
+    u64					fw_ns;		/* the load alone */
+    size_t				fw_bytes;
 };
 // =========================== ALSA func declaration ==================================
 static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;	/* Index 0-MAX */
 static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;	/* ID for this card */
+static unsigned int emulate;
+static unsigned int batch_blocks;
+static unsigned int tx_depth = 2;
+static bool irq_pacing;
+static bool autotune;
+static unsigned int blksize;
+static unsigned int autotune_lat_us = 2000;
+static char *firmware;
+
+module_param_array(index, int, NULL, 0444);
+MODULE_PARM_DESC(index, "Index value for SDIO soundcard.");
+module_param_array(id, charp, NULL, 0444);
+MODULE_PARM_DESC(id, "ID string for SDIO soundcard.");
+module_param(emulate, uint, 0444);
+MODULE_PARM_DESC(emulate, "Number of cards backed by an emulated FPGA.");
+module_param(batch_blocks, uint, 0444);
+MODULE_PARM_DESC(batch_blocks, "Most blocks per transfer, 0 for as many as the host takes or the tuned number.");
+module_param(tx_depth, uint, 0444);
+MODULE_PARM_DESC(tx_depth, "Transfers staged ahead of the bus, 1-8.");
+module_param(irq_pacing, bool, 0444);
+MODULE_PARM_DESC(irq_pacing, "Pace the stream with the FPGA FIFO interrupt instead of a timer.");
+module_param(autotune, bool, 0444);
+MODULE_PARM_DESC(autotune, "Measure block sizes and batches at probe and take the fastest.");
+module_param(blksize, uint, 0444);
+MODULE_PARM_DESC(blksize, "SDIO block size, 0 for 512 or the tuned one.");
+module_param(autotune_lat_us, uint, 0444);
+MODULE_PARM_DESC(autotune_lat_us, "Longest transfer the autotuner may pick, in us.");
+module_param(firmware, charp, 0444);
+MODULE_PARM_DESC(firmware, "FPGA bitstream loaded at probe, none if configured otherwise.");
 
 static int sdio_hw_params(struct snd_pcm_substream *ss,
                           struct snd_pcm_hw_params *hw_params);
@@ -104,30 +175,76 @@ static int sdio_pcm_close(struct snd_pcm_substream *ss);
 static int sdio_pcm_prepare(struct snd_pcm_substream *ss);
 static int sdio_pcm_trigger(struct snd_pcm_substream *substream, int cmd);
 static snd_pcm_uframes_t sdio_pcm_pointer(struct snd_pcm_substream *ss);
+static int sdio_pcm_get_time_info(struct snd_pcm_substream *ss,
+                                  struct timespec *system_ts, struct timespec *audio_ts,
+                                  struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+                                  struct snd_pcm_audio_tstamp_report *audio_tstamp_report);
 static int sdio_pcm_dev_free(struct snd_device *device);
+static void sdio_timer_function(struct timer_list *t);
+static int sdio_stage_thread(void *data);
+static int sdio_tx_thread(void *data);
+static void sdio_fifo_irq(void *data);
+static int sdio_rule_format(struct snd_pcm_hw_params *params,
+                            struct snd_pcm_hw_rule *rule);
+static int sdio_rule_interval(struct snd_pcm_hw_params *params,
+                              struct snd_pcm_hw_rule *rule);
+static void sdio_proc_read(struct snd_info_entry *entry,
+                           struct snd_info_buffer *buffer);
+static ssize_t calibration_show(struct device *dev, struct device_attribute *attr,
+                                char *buf);
+static ssize_t blksize_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t blksize_store(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count);
+static ssize_t batch_blocks_show(struct device *dev, struct device_attribute *attr,
+                                 char *buf);
+static ssize_t batch_blocks_store(struct device *dev, struct device_attribute *attr,
+                                  const char *buf, size_t count);
+static ssize_t tdm_slots_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t tdm_slots_store(struct device *dev, struct device_attribute *attr,
+                               const char *buf, size_t count);
+static ssize_t slot_map_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t slot_map_store(struct device *dev, struct device_attribute *attr,
+                              const char *buf, size_t count);
+struct sdio_device;
+static void sdio_debugfs_add(struct sdio_device *chip);
 
-static int 	major = SDIO_MAJOR;
-static int  BlockAddress, isExit, isResume;
-u8			*kbuf;//[MAX_SDIO_BYTES];		// kmalloc works, u8 not working
-static int SampleRate, SampleBits;
-static struct task_struct *tsk;
-static LIST_HEAD(sdio_card_list);
+static DECLARE_BITMAP(sdio_card_slots, SNDRV_CARDS);
+static DEFINE_MUTEX(sdio_card_lock);	/* sdio_card_slots, only at probe and remove */
+static struct platform_device *emu_devices[SNDRV_CARDS];
+static struct dentry *sdio_debugfs_root;	/* snd-sdio, a cardN directory in it per card */
 // =========================== REQUIRED ALSA STRUCTS ==================================
-// TODO reach 762000 as max rate, possibly more
+// the FPGA DAC clocks, the 705.6 and 768 kHz ones have no SNDRV_PCM_RATE_ bit
+static const unsigned int sdio_rates[] = {
+    8000, 11025, 16000, 22050, 32000, 44100, 48000, 64000, 88200, 96000,
+    176400, 192000, 352800, 384000, 705600, 768000,
+};
+
+static const struct snd_pcm_hw_constraint_list sdio_rate_list =
+{
+    .count = ARRAY_SIZE(sdio_rates),
+    .list  = sdio_rates,
+};
+
+// DSD goes out as is, 8, 16 or 32 one bit samples per channel and frame.
+// S24_LE is packed to 3 bytes on the wire, S24_3LE already is.
 static struct snd_pcm_hardware sdio_pcm_hw =
 {
     .info = (SNDRV_PCM_INFO_MMAP |
              SNDRV_PCM_INFO_INTERLEAVED |
              SNDRV_PCM_INFO_BLOCK_TRANSFER |
-             SNDRV_PCM_INFO_MMAP_VALID),
-    .formats = (SNDRV_PCM_FMTBIT_S16_LE | SNDRV_PCM_FMTBIT_S16_BE |
+             SNDRV_PCM_INFO_MMAP_VALID |
+             SNDRV_PCM_INFO_HAS_LINK_ATIME),
+    .formats = (SNDRV_PCM_FMTBIT_S16_LE | SNDRV_PCM_FMTBIT_S16_BE | SDIO_FMTBIT_S24 |
                 SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_S32_BE |
-                SNDRV_PCM_FMTBIT_FLOAT_LE | SNDRV_PCM_FMTBIT_FLOAT_BE),
-    .rates            = SNDRV_PCM_RATE_CONTINUOUS | SNDRV_PCM_RATE_8000_192000,
+                SNDRV_PCM_FMTBIT_FLOAT_LE | SNDRV_PCM_FMTBIT_FLOAT_BE |
+                SNDRV_PCM_FMTBIT_DSD_U8 |
+                SNDRV_PCM_FMTBIT_DSD_U16_LE | SNDRV_PCM_FMTBIT_DSD_U16_BE |
+                SNDRV_PCM_FMTBIT_DSD_U32_LE | SNDRV_PCM_FMTBIT_DSD_U32_BE),
+    .rates            = SNDRV_PCM_RATE_KNOT,
     .rate_min         = 8000,
-    .rate_max         = 192000,
+    .rate_max         = 768000,
     .channels_min     = 1,
-    .channels_max     = 2,
+    .channels_max     = SDIO_TDM_SLOTS,
     .buffer_bytes_max = 2 * 1024 * 1024, //(32 * 48) = 1536,
     .period_bytes_min = 64,
     .period_bytes_max = 2 * 1024 * 1024,
@@ -145,129 +262,1386 @@ static struct snd_pcm_ops sdio_pcm_ops =
     .prepare   = sdio_pcm_prepare,
     .trigger   = sdio_pcm_trigger,
     .pointer   = sdio_pcm_pointer,
+    .get_time_info = sdio_pcm_get_time_info,
 };
 
 // ================================ SDIO structs ======================================
+// /sys/class/sound/cardN/sdio_tune
+static DEVICE_ATTR_RO(calibration);
+static DEVICE_ATTR_RW(blksize);
+static DEVICE_ATTR_RW(batch_blocks);
+
+static struct attribute *sdio_tune_attrs[] = {
+        &dev_attr_calibration.attr,
+        &dev_attr_blksize.attr,
+        &dev_attr_batch_blocks.attr,
+        NULL,
+};
+
+static const struct attribute_group sdio_tune_group = {
+        .name			= "sdio_tune",
+        .attrs			= sdio_tune_attrs,
+};
+
+static DEVICE_ATTR_RW(tdm_slots);
+static DEVICE_ATTR_RW(slot_map);
+
+static struct attribute *sdio_tdm_attrs[] = {
+        &dev_attr_tdm_slots.attr,
+        &dev_attr_slot_map.attr,
+        NULL,
+};
+
+static const struct attribute_group sdio_tdm_group = {
+        .name			= "sdio_tdm",
+        .attrs			= sdio_tdm_attrs,
+};
+
 static const struct file_operations fops_test = {
         .open			= sdio_open,
-        .read			= sdio_read,
-        .write			= sdio_write,
-#ifndef CONFIG_COMPAT	// this for 64bit kernel 32bit rootfs
-        .unlocked_ioctl = sdio_snd_ioctl
+        .read_iter		= sdio_read_iter,
+        .write_iter		= sdio_write_iter,
+        .unlocked_ioctl = sdio_snd_ioctl,
+#ifdef CONFIG_COMPAT	// this for 64bit kernel 32bit rootfs, the layout is the same
+        .compat_ioctl	= sdio_snd_ioctl,
+#endif
+};
+
+static struct sdio_driver sdio_driver =
+{
+    .name = MODULE_NAME,
+    .probe	= sdio_probe,
+    .id_table = sdio_ids,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,8,0)
+    .remove	= __devexit_p(sdio_remove),
 #else
-        .compat_ioctl	= sdio_snd_ioctl
+    .remove	= sdio_remove,
 #endif
 };
 
-static struct sdio_driver sdio_driver =
+static struct platform_driver sdio_emu_driver =
+{
+    .probe  = sdio_emu_probe,
+    .remove = sdio_emu_remove,
+    .driver = {
+        .name = SND_SDIO_EMU_DRIVER,
+    },
+};
+// ================================ ALSA structs ======================================
+struct sdio_pcm;
+
+/*
+ * Playback and capture share the cable clock: one timer, or the FIFO
+ * interrupt while playback runs with irq_mode, so that the ADC is read as far
+ * as the DAC has played and both directions stay sample-aligned.
+ */
+struct sdio_cable
+{
+    struct sdio_device *fifo;
+    struct sdio_pcm *streams[2];
+
+    struct snd_pcm_hardware hw;
+    unsigned int pcm_period_size;
+    unsigned int pcm_bps;
+
+    // flags
+    unsigned int valid;
+    unsigned int period_update_pending :1;
+    unsigned int running;
+
+    //timer
+    spinlock_t lock;		/* positions and flags, taken from the timer */
+    u64 irq_pos;
+    u64 period_size_frac;
+    unsigned long last_jiffies;
+    struct timer_list timer;
+};
+
+/*
+ * How a run goes over the bus, the same for both directions. Samples are
+ * packed to wire_width, and with tdm each channel goes into its slot of a
+ * frame that may be wider than the run; the other slots are silence.
+ */
+struct sdio_wire
+{
+    unsigned int packed :1;	/* S24_LE in 3 bytes */
+    unsigned int tdm :1;
+    unsigned int channels;
+    unsigned int width;		/* bytes of a sample in the DMA area */
+    unsigned int wire_width;	/* and on the bus */
+    unsigned int dma_frame;
+    unsigned int frame;		/* on the bus */
+    u8 map[SDIO_TDM_SLOTS];	/* slot of each channel */
+};
+
+/* one staged transfer */
+struct sdio_tx_slot
+{
+    char *buf;			/* max_bytes */
+    unsigned int bytes;		/* on the wire */
+    unsigned int span;		/* of the DMA area */
+    unsigned int gen;		/* run_gen when staged */
+};
+
+struct sdio_device
+{
+    struct sdio_cable *cable[MAX_PCM_SUBSTREAMS];
+    struct mutex cable_lock;
+
+    // transport
+    struct sdio_xport *xport;
+    // transmit pipeline: the stage thread fills slots, the tx thread sends them
+    struct task_struct *stage_thread;
+    struct task_struct *tx_thread;
+    wait_queue_head_t stage_wait;
+    wait_queue_head_t tx_wait;
+    struct mutex stage_lock;	/* held while the DMA area is read */
+    struct sdio_tx_slot tx_slot[SDIO_TX_DEPTH_MAX];
+    unsigned int tx_depth;
+    unsigned int tx_head;	/* slots staged, under cable->lock */
+    unsigned int tx_tail;	/* slots sent, under cable->lock */
+    unsigned int tx_queue_max;	/* most slots waiting for the bus */
+    unsigned int tx_queued;	/* bytes in slots of this run not yet on the FPGA */
+    u64 tx_dropped;		/* played bytes overwritten before they were staged */
+    unsigned int run_gen;	/* bumped by prepare, under cable->lock */
+    unsigned int batch_blocks;	/* most blocks per transfer, 0 for max_bytes */
+    unsigned int buf_bytes;	/* slots and rx_buf, the longest transfer from now on */
+
+    // wire format, set by the first direction prepared, under cable->lock
+    struct sdio_wire wire;
+    unsigned int wire_bps;
+    unsigned int xfer_unit;	/* DMA area bytes of the shortest whole-block transfer */
+    unsigned int wire_rem;	/* bytes the FIFO took past the last whole frame */
+
+    // TDM layout asked for through sysfs, under cable_lock, taken up by prepare
+    unsigned int tdm_slots;	/* 0: as many as the run has channels */
+    u8 tdm_map[SDIO_TDM_SLOTS];
+
+    // what the autotuner measured at probe
+    struct sdio_tune_point tune[SDIO_TUNE_POINTS];
+    unsigned int tune_count;
+    unsigned int tune_best;
+
+    // capture, read by the tx thread in the same claim as the playback slot
+    char *rx_buf;		/* max_bytes */
+    unsigned int rx_gen;	/* bumped by capture prepare, hw_free and close */
+    u64 rx_dropped;		/* sampled while the ADC FIFO was full, silence instead */
+
+    // pacing by the FIFO interrupt: the device asks, the pointer follows what it took
+    unsigned int irq_mode :1;
+    u64 irq_count;
+
+    // bitstream loaded at probe
+    size_t fw_bytes;
+    u64 fw_ns;
+
+    struct dentry *debugfs;
+
+    // DAC FIFO level after the last write or interrupt, drained by the clock since
+    unsigned int fifo_level;
+    u64 fifo_level_ns;
+
+    // bus utilization of the current, or last, run
+    u64 run_start_ns;
+    u64 run_busy_ns;
+    u64 run_stop_ns;
+
+    // alsa structs
+    struct snd_card *card;
+    struct snd_pcm *pcm;
+};
+
+struct sdio_pcm
+{
+    struct sdio_device *fifo;
+    struct sdio_cable *cable;
+
+    struct snd_pcm_substream *substream;
+    unsigned int pcm_buffer_size;
+    unsigned int buf_pos;
+    unsigned int silent_size;
+
+    // bytes played by the timer, or asked by the device, and staged since prepare
+    u64 tx_played;
+    u64 tx_staged;
+    unsigned int period_pos;	/* bytes accepted into the current period */
+
+    // bytes the clock says the ADC sampled, and read into the DMA area, since prepare
+    u64 rx_due;
+    u64 rx_done;
+
+    // link position: bytes over the bus when the last transfer completed
+    u64 link_bytes;
+    u64 link_ns;
+    u32 link_xfer_ns;		/* how long that transfer took */
+};
+
+static struct snd_device_ops dev_ops =
+{
+    .dev_free = sdio_pcm_dev_free,
+};
+// =========================== SDIO function definition ===============================
+static int sdio_open(struct inode *inode, struct file *file)
+{
+    file->private_data = container_of(inode->i_cdev, struct sdio_card, cdev);
+    return 0;
+}
+
+/*
+ * Raw access to the FIFO. Whole blocks of a user buffer go to the host as a
+ * scatterlist over its own pages; a tail under a block, a buffer the host
+ * cannot DMA to, or a transport without rw_sg bounce through the card's kbuf.
+ */
+static ssize_t sdio_rw_pinned(struct sdio_xport *xp, struct iov_iter *iter, bool write,
+                              struct page **pages, unsigned int npages)
+{
+    struct sg_table sgt;
+    unsigned int n, i;
+    size_t offs, len;
+    ssize_t got;
+    int ret = 0;
+
+    if (!iter_is_iovec(iter) && !iov_iter_is_bvec(iter))
+        return 0;
+    got = iov_iter_get_pages(iter, pages, xp->max_bytes, npages, &offs);
+    if (got <= 0)
+        return got;
+    n = DIV_ROUND_UP(offs + got, PAGE_SIZE);
+
+    len = rounddown(got, xp->blksize);
+    if (!len || offs % SDIO_SG_ALIGN)
+        goto __put;
+    ret = __sg_alloc_table_from_pages(&sgt, pages, DIV_ROUND_UP(offs + len, PAGE_SIZE),
+                                      offs, len, xp->max_seg_size, GFP_KERNEL);
+    if (ret)
+        goto __put;
+    // more pieces than the host takes in one request, bounce this one
+    if (sgt.nents <= xp->max_segs) {
+        ret = sdio_xport_rw_sg(xp, write, sgt.sgl, sgt.nents, len);
+        if (!ret) {
+            iov_iter_advance(iter, len);
+            ret = len;
+        }
+    }
+    sg_free_table(&sgt);
+
+__put:
+    for (i = 0; i < n; i++) {
+        if (!write && ret > 0)
+            set_page_dirty_lock(pages[i]);
+        put_page(pages[i]);
+    }
+    return ret;
+}
+
+static ssize_t sdio_rw_bounce(struct sdio_card *card, struct iov_iter *iter, bool write)
+{
+    struct sdio_xport *xp = card->xport;
+    size_t n = iov_iter_count(iter);
+    int ret = 0;
+
+    if (n >= xp->blksize)
+        n = rounddown(min_t(size_t, n, MAX_SDIO_BYTES), xp->blksize);
+
+    mutex_lock(&card->kbuf_lock);
+    if (write) {
+        if (copy_from_iter(card->kbuf, n, iter) != n)
+            ret = -EFAULT;
+        else
+            ret = sdio_xport_write(xp, card->kbuf, n);
+    } else {
+        ret = sdio_xport_read(xp, card->kbuf, n);
+        if (!ret && copy_to_iter(card->kbuf, n, iter) != n)
+            ret = -EFAULT;
+    }
+    mutex_unlock(&card->kbuf_lock);
+    return ret ? ret : n;
+}
+
+static ssize_t sdio_rw_iter(struct sdio_card *card, struct iov_iter *iter, bool write)
+{
+    struct sdio_xport *xp = card->xport;
+    unsigned int npages = DIV_ROUND_UP(xp->max_bytes, PAGE_SIZE) + 1;
+    struct page **pages = NULL;
+    size_t done = 0;
+    ssize_t ret = 0;
+
+    // no pinning if the host takes no whole page in a segment
+    if (xp->ops->rw_sg && xp->max_seg_size)
+        pages = kmalloc_array(npages, sizeof(*pages), GFP_KERNEL);
+    while (iov_iter_count(iter)) {
+        ret = 0;
+        if (pages)
+            ret = sdio_rw_pinned(xp, iter, write, pages, npages);
+        if (!ret)
+            ret = sdio_rw_bounce(card, iter, write);
+        if (ret < 0)
+            break;
+        done += ret;
+        if (fatal_signal_pending(current))
+            break;
+    }
+    kfree(pages);
+    return done ? done : ret;
+}
+
+static ssize_t sdio_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    ssize_t ret = sdio_rw_iter(iocb->ki_filp->private_data, from, true);
+
+    if (ret > 0)
+        iocb->ki_pos += ret;
+    return ret;
+}
+
+static ssize_t sdio_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    ssize_t ret = sdio_rw_iter(iocb->ki_filp->private_data, to, false);
+
+    if (ret > 0)
+        iocb->ki_pos += ret;
+    return ret;
+}
+
+/*
+ * SDIO_IOC_BATCH: the commands are copied in, FIFO data included, run under
+ * one claim of the host, and copied back out with their results.
+ */
+static long sdio_ioctl_batch(struct sdio_card *card, struct sdio_batch __user *ub)
+{
+    struct sdio_batch b;
+    struct sdio_cmd *uc = NULL;
+    struct sdio_xport_cmd *kc = NULL;
+    unsigned int i, total = 0, poll_us = 0;
+    long ret;
+    int done;
+
+    if (copy_from_user(&b, ub, sizeof(b)))
+        return -EFAULT;
+    if (!b.count || b.count > SDIO_BATCH_MAX || (b.flags & ~SDIO_BATCH_STOP))
+        return -EINVAL;
+
+    uc = kmalloc_array(b.count, sizeof(*uc), GFP_KERNEL);
+    kc = kcalloc(b.count, sizeof(*kc), GFP_KERNEL);
+    if (!uc || !kc) {
+        ret = -ENOMEM;
+        goto __free;
+    }
+    if (copy_from_user(uc, u64_to_user_ptr(b.cmds), b.count * sizeof(*uc))) {
+        ret = -EFAULT;
+        goto __free;
+    }
+
+    ret = -EINVAL;
+    for (i = 0; i < b.count; i++) {
+        kc[i].op = uc[i].op;
+        kc[i].addr = uc[i].addr;
+        kc[i].val = uc[i].val;
+        kc[i].mask = uc[i].mask;
+        kc[i].want = uc[i].want;
+        kc[i].len = uc[i].len;
+        kc[i].result = -ECANCELED;
+        switch (uc[i].op) {
+        case SDIO_OP_READB:
+        case SDIO_OP_WRITEB:
+            break;
+        case SDIO_OP_POLLB:
+            // streams underrun while the bus is held, keep it short
+            if (uc[i].len > SDIO_POLL_MAX_US - poll_us)
+                goto __free;
+            poll_us += uc[i].len;
+            break;
+        case SDIO_OP_READSB:
+        case SDIO_OP_WRITESB:
+            if (!uc[i].len || uc[i].len > SDIO_BATCH_BYTES - total)
+                goto __free;
+            total += uc[i].len;
+            // the host may DMA from it
+            kc[i].buf = kmalloc(uc[i].len, GFP_KERNEL);
+            if (!kc[i].buf) {
+                ret = -ENOMEM;
+                goto __free;
+            }
+            if (uc[i].op == SDIO_OP_WRITESB &&
+                copy_from_user(kc[i].buf, u64_to_user_ptr(uc[i].buf), uc[i].len)) {
+                ret = -EFAULT;
+                goto __free;
+            }
+            break;
+        default:
+            goto __free;
+        }
+    }
+
+    done = sdio_xport_batch(card->xport, kc, b.count, b.flags & SDIO_BATCH_STOP);
+    if (done < 0) {
+        ret = done;
+        goto __free;
+    }
+
+    ret = 0;
+    for (i = 0; i < b.count; i++) {
+        uc[i].val = kc[i].val;
+        uc[i].result = i < done ? kc[i].result : -ECANCELED;
+        if (i < done && !kc[i].result && uc[i].op == SDIO_OP_READSB &&
+            copy_to_user(u64_to_user_ptr(uc[i].buf), kc[i].buf, uc[i].len))
+            ret = -EFAULT;
+    }
+    b.done = done;
+    if (copy_to_user(u64_to_user_ptr(b.cmds), uc, b.count * sizeof(*uc)) ||
+        copy_to_user(ub, &b, sizeof(b)))
+        ret = -EFAULT;
+
+__free:
+    if (kc)
+        for (i = 0; i < b.count; i++)
+            kfree(kc[i].buf);
+    kfree(kc);
+    kfree(uc);
+    return ret;
+}
+
+static long sdio_snd_ioctl(	struct file *file,
+                           unsigned int cmd,  	// cmd is command
+                           unsigned long arg)
+{
+    struct sdio_card *card = file->private_data;
+
+    switch (cmd) {
+    case SDIO_IOC_BATCH:
+        return sdio_ioctl_batch(card, (struct sdio_batch __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * Block size and batch: the module parameters where set, what the autotuner
+ * found fastest for the rest, the defaults otherwise.
+ */
+static void sdio_card_tune(struct sdio_device *chip)
+{
+    struct sdio_xport *xp = chip->xport;
+    struct sdio_tune_point *best;
+    int ret;
+
+    chip->batch_blocks = batch_blocks;
+    if (autotune) {
+        ret = sdio_xport_calibrate(xp, chip->tune, &chip->tune_count, blksize,
+                                   batch_blocks, autotune_lat_us);
+        if (ret >= 0) {
+            chip->tune_best = ret;
+            best = &chip->tune[ret];
+            chip->batch_blocks = best->blocks;
+            printk(KERN_NOTICE "SDIO: tuned to %u blocks of %u bytes, %u kB/s, %u us\n",
+                   best->blocks, best->blksize, best->kBps, best->lat_us);
+        } else {
+            printk(KERN_WARNING "SDIO: autotune failed: %d\n", ret);
+        }
+    } else if (blksize) {
+        ret = sdio_xport_set_blksize(xp, blksize, 0);
+        if (ret)
+            printk(KERN_WARNING "SDIO: block size %u refused: %d\n", blksize, ret);
+    }
+
+    if (xp->max_bytes > SDIO_XFER_MAX)
+        sdio_xport_set_blksize(xp, xp->blksize, SDIO_XFER_MAX);
+    chip->buf_bytes = xp->max_bytes;
+}
+
+static int sdio_snd_new(struct sdio_card *card, struct device *parent, int idx)
+{
+    struct snd_card *snd;
+    struct snd_pcm *pcm;
+    struct snd_info_entry *entry;
+    struct sdio_device *chip;
+    struct sdio_cable *cable;
+    int i, ret;
+
+    ret = snd_card_new(parent, index[idx], id[idx], THIS_MODULE,
+                       sizeof(struct sdio_device), &snd);
+    if (ret < 0)
+        return ret;
+
+    chip = snd->private_data;
+    chip->card = snd;
+    chip->xport = card->xport;
+    chip->fw_bytes = card->fw_bytes;
+    chip->fw_ns = card->fw_ns;
+    mutex_init(&chip->cable_lock);
+    mutex_init(&chip->stage_lock);
+    init_waitqueue_head(&chip->stage_wait);
+    init_waitqueue_head(&chip->tx_wait);
+    chip->tx_depth = clamp(tx_depth, 1U, (unsigned int)SDIO_TX_DEPTH_MAX);
+    sdio_card_tune(chip);
+    // bytes as they are until the first prepare says otherwise
+    chip->wire.dma_frame = 1;
+    chip->wire.frame = 1;
+    chip->xfer_unit = chip->xport->blksize;
+    for (i = 0; i < SDIO_TDM_SLOTS; i++)
+        chip->tdm_map[i] = i;
+
+    // from here on .dev_free releases what was set up
+    ret = snd_device_new(snd, SNDRV_DEV_LOWLEVEL, chip, &dev_ops);
+    if (ret < 0)
+        goto __nodev;
+
+    cable = kzalloc(sizeof(struct sdio_cable), GFP_KERNEL);
+    if (!cable) {
+        ret = -ENOMEM;
+        goto __nodev;
+    }
+    spin_lock_init(&cable->lock);
+    timer_setup(&cable->timer, sdio_timer_function, 0);
+    cable->fifo = chip;
+    cable->hw = sdio_pcm_hw;
+    chip->cable[0] = cable;
+
+    chip->rx_buf = kmalloc(chip->buf_bytes, GFP_KERNEL);
+    if (!chip->rx_buf) {
+        ret = -ENOMEM;
+        goto __nodev;
+    }
+
+    for (i = 0; i < chip->tx_depth; i++) {
+        chip->tx_slot[i].buf = kmalloc(chip->buf_bytes, GFP_KERNEL);
+        if (!chip->tx_slot[i].buf) {
+            ret = -ENOMEM;
+            goto __nodev;
+        }
+    }
+
+    chip->tx_thread = kthread_run(sdio_tx_thread, chip, "snd-sdio-tx/%d", snd->number);
+    if (IS_ERR(chip->tx_thread)) {
+        ret = PTR_ERR(chip->tx_thread);
+        chip->tx_thread = NULL;
+        goto __nodev;
+    }
+    chip->stage_thread = kthread_run(sdio_stage_thread, chip, "snd-sdio-stage/%d",
+                                     snd->number);
+    if (IS_ERR(chip->stage_thread)) {
+        ret = PTR_ERR(chip->stage_thread);
+        chip->stage_thread = NULL;
+        goto __nodev;
+    }
+
+    if (irq_pacing) {
+        ret = sdio_xport_request_irq(chip->xport, sdio_fifo_irq, chip);
+        if (ret)
+            printk(KERN_WARNING "SDIO: no FIFO interrupt (%d), paced by a timer\n", ret);
+        else
+            chip->irq_mode = 1;
+    }
+
+    strcpy(snd->driver, SND_SDIO_DRIVER);
+    sprintf(snd->shortname, "%s", SND_SDIO_DRIVER);
+    sprintf(snd->longname, "SDIO FPGA (%s) at %s", card->xport->ops->name,
+            dev_name(parent));
+
+    ret = snd_pcm_new(snd, snd->driver, 0, 1, 1, &pcm);
+    if (ret < 0)
+        goto __nodev;
+
+    snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &sdio_pcm_ops);
+    snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &sdio_pcm_ops);
+    pcm->private_data = chip;
+    pcm->info_flags = 0;
+    strcpy(pcm->name, SND_SDIO_DRIVER);
+    chip->pcm = pcm;
+
+    snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_CONTINUOUS,
+                                          snd_dma_continuous_data(GFP_KERNEL),
+                                          64 * 1024, sdio_pcm_hw.buffer_bytes_max);
+
+    // transport counters, read by the benchmark
+    if (!snd_card_proc_new(snd, "sdio", &entry))
+        snd_info_set_text_ops(entry, chip, sdio_proc_read);
+
+    ret = snd_card_register(snd);
+    if (ret == 0) {
+        card->snd = snd;
+        // goes with the card device
+        if (sysfs_create_group(&snd->card_dev.kobj, &sdio_tune_group))
+            printk(KERN_WARNING "SDIO: no sdio_tune in sysfs\n");
+        if ((chip->xport->caps & SDIO_CAP_TDM) &&
+            sysfs_create_group(&snd->card_dev.kobj, &sdio_tdm_group))
+            printk(KERN_WARNING "SDIO: no sdio_tdm in sysfs\n");
+        sdio_debugfs_add(chip);
+        return 0;
+    }
+
+__nodev:
+    snd_card_free(snd); // this will autocall .dev_free (= sdio_pcm_dev_free)
+    return ret;
+}
+
+/* common to the SDIO function and the emulated cards, card->xport is set */
+static int sdio_card_setup(struct sdio_card *card, struct device *parent)
+{
+    int res;
+
+    mutex_lock(&sdio_card_lock);
+    card->slot = find_first_zero_bit(sdio_card_slots, SNDRV_CARDS);
+    if (card->slot >= SNDRV_CARDS) {
+        mutex_unlock(&sdio_card_lock);
+        return -ENODEV;
+    }
+    set_bit(card->slot, sdio_card_slots);
+    mutex_unlock(&sdio_card_lock);
+
+    mutex_init(&card->kbuf_lock);
+    card->kbuf = kmalloc(MAX_SDIO_BYTES, GFP_KERNEL);
+    if (!card->kbuf) {
+        res = -ENOMEM;
+        goto __noslot;
+    }
+
+    card->major = SDIO_MAJOR + card->slot;
+    card->devid = MKDEV(card->major, 0);
+    res = register_chrdev_region(card->devid, 1, MODULE_NAME);
+    if (res < 0) {
+        printk(KERN_WARNING "SDIO: can't register character device %d: %d\n",
+               card->major, res);
+        goto __nobuf;
+    }
+    cdev_init(&card->cdev, &fops_test);
+    card->cdev.owner = THIS_MODULE;
+    res = cdev_add(&card->cdev, card->devid, 1);
+    if (res < 0)
+        goto __noregion;
+
+    res = sdio_snd_new(card, parent, card->slot);
+    if (res < 0) {
+        printk(KERN_WARNING "SDIO: can't create sound card: %d\n", res);
+        goto __nocdev;
+    }
+    return 0;
+
+__nocdev:
+    cdev_del(&card->cdev);
+__noregion:
+    unregister_chrdev_region(card->devid, 1);
+__nobuf:
+    kfree(card->kbuf);
+__noslot:
+    mutex_lock(&sdio_card_lock);
+    clear_bit(card->slot, sdio_card_slots);
+    mutex_unlock(&sdio_card_lock);
+    return res;
+}
+
+static void sdio_card_teardown(struct sdio_card *card)
+{
+    // the sound card goes first, it still sends through the transport
+    if (card->snd)
+        snd_card_free(card->snd);
+
+    cdev_del(&card->cdev);
+    unregister_chrdev_region(card->devid, 1);
+    kfree(card->kbuf);
+
+    mutex_lock(&sdio_card_lock);
+    clear_bit(card->slot, sdio_card_slots);
+    mutex_unlock(&sdio_card_lock);
+
+    sdio_xport_free(card->xport);
+}
+
+static int __probe(struct sdio_func *func)
+{
+    struct sdio_card *card;
+    int ret;
+
+    card = kzalloc(sizeof(struct sdio_card), GFP_KERNEL);
+    if (card == NULL)
+        return -ENOMEM;
+
+    func->max_blksize = SDIO_MAX_BLKSIZE;
+    func->enable_timeout = 20000;
+    card->func = func;
+
+    sdio_claim_host(func);
+    ret = sdio_enable_func(func);
+    if (ret) {
+        printk(" couldn't enable function %d\n", ret);
+        goto release;
+    }
+    sdio_set_block_size(func, SDIO_BLOCK_SIZE);
+    sdio_release_host(func);
+
+    card->xport = sdio_func_xport_new(func);
+    if (IS_ERR(card->xport)) {
+        ret = PTR_ERR(card->xport);
+        goto disable;
+    }
+
+    card->xport->owner = card;
+    init_completion(&card->fw_done);
+    card->probe_ns = ktime_get_ns();
+    if (firmware && *firmware) {
+        // the card comes up once the FPGA is configured, boot goes on meanwhile
+        ret = request_firmware_nowait(THIS_MODULE, FW_ACTION_HOTPLUG, firmware, &func->dev,
+                                      GFP_KERNEL, card, sdio_fw_loaded);
+        if (ret)
+            goto free_xport;
+        printk("SDIO data module probe: loading %s\n", firmware);
+        return 0;
+    }
+
+    ret = sdio_card_setup(card, &func->dev);
+    if (ret)
+        goto free_xport;
+    card->ready = 1;
+    complete(&card->fw_done);
+
+    printk("SDIO data module probe:%d .\n", card->major);
+    return 0;
+
+    free_xport:
+    sdio_set_drvdata(func, NULL);
+    sdio_xport_free(card->xport);
+    disable:
+    sdio_claim_host(func);
+    sdio_disable_func(func);
+    release:
+    sdio_release_host(func);
+    kfree(card);
+    return ret;
+}
+
+/*
+ * request_firmware_nowait() lands here, in a worker: the bitstream goes to
+ * the FPGA and the card is set up on it. Missing or refused, the card comes
+ * up all the same, on whatever the FPGA was configured with.
+ */
+static void sdio_fw_loaded(const struct firmware *fw, void *context)
+{
+    struct sdio_card *card = context;
+    u64 t0;
+    int ret;
+
+    if (fw) {
+        t0 = ktime_get_ns();
+        ret = sdio_xport_load(card->xport, fw->data, fw->size);
+        card->fw_ns = ktime_get_ns() - t0;
+        card->fw_bytes = fw->size;
+        if (ret)
+            printk(KERN_WARNING "SDIO: loading %s failed: %d\n", firmware, ret);
+        else
+            printk(KERN_NOTICE "SDIO: %s, %zu bytes in %llu us, %llu kB/s\n",
+                   firmware, fw->size, div_u64(card->fw_ns, NSEC_PER_USEC),
+                   div64_u64((u64)fw->size * USEC_PER_SEC, max_t(u64, card->fw_ns, 1)));
+        release_firmware(fw);
+    } else {
+        printk(KERN_WARNING "SDIO: no %s, the FPGA stays as it is\n", firmware);
+    }
+
+    ret = sdio_card_setup(card, &card->func->dev);
+    if (ret) {
+        printk(KERN_WARNING "SDIO: card setup failed: %d\n", ret);
+    } else {
+        card->ready = 1;
+        printk(KERN_NOTICE "SDIO data module probe:%d, up %llu ms after probe\n",
+               card->major, div_u64(ktime_get_ns() - card->probe_ns, NSEC_PER_MSEC));
+    }
+    complete(&card->fw_done);
+}
+
+static int sdio_probe(struct sdio_func *func, const struct sdio_device_id *id)
+{
+    pr_err("SDIO driver probe ...\n");
+    return __probe(func);
+}
+
+static void __remove(struct sdio_func *func)
+{
+    struct sdio_xport *xp = sdio_get_drvdata(func);
+    struct sdio_card *card = xp ? xp->owner : NULL;
+
+    if (!card)
+        return;
+    // a load still going sets the card up, or fails to, first
+    wait_for_completion(&card->fw_done);
+    pr_err("card->major   %d  \n", card->major);
+    if (card->ready)
+        sdio_card_teardown(card);
+    else
+        sdio_xport_free(card->xport);
+
+    sdio_claim_host(func);
+    sdio_disable_func(func);
+    sdio_set_drvdata(func, NULL);
+    sdio_release_host(func);
+    kfree(card);
+    pr_err("SDIO data module removed\n");
+}
+
+static void sdio_remove(struct sdio_func *func)
+{
+    pr_err("SDIO driver exit ...\n");
+    __remove(func);
+}
+
+// the same card with the FPGA emulated, see sdio_emu.c
+static int sdio_emu_probe(struct platform_device *pdev)
+{
+    struct sdio_card *card;
+    int ret;
+
+    card = kzalloc(sizeof(struct sdio_card), GFP_KERNEL);
+    if (card == NULL)
+        return -ENOMEM;
+
+    card->xport = sdio_emu_xport_new();
+    if (IS_ERR(card->xport)) {
+        ret = PTR_ERR(card->xport);
+        kfree(card);
+        return ret;
+    }
+
+    ret = sdio_card_setup(card, &pdev->dev);
+    if (ret) {
+        sdio_xport_free(card->xport);
+        kfree(card);
+        return ret;
+    }
+    platform_set_drvdata(pdev, card);
+    printk(KERN_NOTICE "SDIO emulated card probe:%d .\n", card->major);
+    return 0;
+}
+
+static int sdio_emu_remove(struct platform_device *pdev)
+{
+    struct sdio_card *card = platform_get_drvdata(pdev);
+
+    sdio_card_teardown(card);
+    platform_set_drvdata(pdev, NULL);
+    kfree(card);
+    return 0;
+}
+
+// ============================== ALSA func definition ================================
+/*
+ * The timer only accounts what the DAC has played; the bytes stay in the DMA
+ * area until the stage thread has copied them. Called with cable->lock held.
+ */
+static void copy_play_buf(struct sdio_pcm *play, unsigned int bytes)
+{
+    play->tx_played += bytes;
+    wake_up(&play->fifo->stage_wait);
+}
+
+/*
+ * DMA area bytes to bus bytes and back; whole frames on both sides, so the
+ * packing never splits a sample. Called with cable->lock held.
+ */
+static unsigned int sdio_to_wire(struct sdio_device *chip, unsigned int bytes)
+{
+    return bytes / chip->wire.dma_frame * chip->wire.frame;
+}
+
+static u64 sdio_from_wire(struct sdio_device *chip, u64 bytes)
+{
+    return div_u64(bytes, chip->wire.frame) * chip->wire.dma_frame;
+}
+
+/* up to a whole frame of the DMA area */
+static u64 sdio_frames_up(struct sdio_device *chip, u64 bytes)
+{
+    u32 rem;
+
+    div_u64_rem(bytes, chip->wire.dma_frame, &rem);
+    return rem ? bytes + chip->wire.dma_frame - rem : bytes;
+}
+
+/*
+ * S24_LE to the 3 byte samples of the wire, four samples into three words at
+ * a time: the copy stays word sized and the bus carries a quarter less.
+ * Returns the bytes written.
+ */
+static unsigned int sdio_pack24(char *dst, const char *src, unsigned int bytes)
+{
+    unsigned int out = bytes / 4 * 3;
+    u32 a, b, c, d;
+
+    for (; bytes >= 16; bytes -= 16, src += 16, dst += 12) {
+        a = get_unaligned_le32(src) & 0xffffff;
+        b = get_unaligned_le32(src + 4) & 0xffffff;
+        c = get_unaligned_le32(src + 8) & 0xffffff;
+        d = get_unaligned_le32(src + 12) & 0xffffff;
+        put_unaligned_le32(a | b << 24, dst);
+        put_unaligned_le32(b >> 8 | c << 16, dst + 4);
+        put_unaligned_le32(c >> 16 | d << 8, dst + 8);
+    }
+    // little endian, the sample is the low three bytes
+    for (; bytes >= 4; bytes -= 4, src += 4, dst += 3)
+        memcpy(dst, src, 3);
+    return out;
+}
+
+/* and back for capture, sign extended; bytes are those of the DMA area */
+static void sdio_unpack24(char *dst, const char *src, unsigned int bytes)
+{
+    u32 a, b, c;
+
+    for (; bytes >= 16; bytes -= 16, src += 12, dst += 16) {
+        a = get_unaligned_le32(src);
+        b = get_unaligned_le32(src + 4);
+        c = get_unaligned_le32(src + 8);
+        put_unaligned_le32(sign_extend32(a, 23), dst);
+        put_unaligned_le32(sign_extend32(a >> 24 | b << 8, 23), dst + 4);
+        put_unaligned_le32(sign_extend32(b >> 16 | c << 16, 23), dst + 8);
+        put_unaligned_le32(sign_extend32(c >> 8, 23), dst + 12);
+    }
+    for (; bytes >= 4; bytes -= 4, src += 3, dst += 4)
+        put_unaligned_le32(sign_extend32(get_unaligned_le16(src) | (u8)src[2] << 16, 23),
+                           dst);
+}
+
+/*
+ * Whole frames into the TDM layout: each channel to its slot, packed or not,
+ * the slots no channel has zeroed. Returns the bytes written.
+ */
+static unsigned int sdio_tdm_pack(char *dst, const char *src, unsigned int bytes,
+                                  const struct sdio_wire *w)
+{
+    unsigned int frames = bytes / w->dma_frame, c;
+
+    for (; frames; frames--, src += w->dma_frame, dst += w->frame) {
+        memset(dst, 0, w->frame);
+        // little endian, a packed sample is the low bytes of its container
+        for (c = 0; c < w->channels; c++)
+            memcpy(dst + w->map[c] * w->wire_width, src + c * w->width, w->wire_width);
+    }
+    return bytes / w->dma_frame * w->frame;
+}
+
+/* and the channels back out of their slots, for capture */
+static void sdio_tdm_unpack(char *dst, const char *src, unsigned int bytes,
+                            const struct sdio_wire *w)
+{
+    unsigned int frames = bytes / w->dma_frame, c;
+    const char *s;
+
+    for (; frames; frames--, src += w->frame, dst += w->dma_frame) {
+        for (c = 0; c < w->channels; c++) {
+            s = src + w->map[c] * w->wire_width;
+            if (w->packed)
+                put_unaligned_le32(sign_extend32(get_unaligned_le16(s) | (u8)s[2] << 16, 23),
+                                   dst + c * 4);
+            else
+                memcpy(dst + c * w->width, s, w->width);
+        }
+    }
+}
+
+/* a run of the DMA area into a slot as it goes on the wire, returns the bytes written */
+static unsigned int sdio_wire_copy(char *dst, const char *src, unsigned int bytes,
+                                   const struct sdio_wire *w)
+{
+    if (w->tdm)
+        return sdio_tdm_pack(dst, src, bytes, w);
+    if (w->packed)
+        return sdio_pack24(dst, src, bytes);
+    memcpy(dst, src, bytes);
+    return bytes;
+}
+
+/*
+ * DMA area bytes of the next transfer. While the stream runs only whole
+ * blocks go on the wire, so that every CMD53 is in block mode, and as many
+ * as one transfer takes; the tail waits for the next period. Once stopped,
+ * the tail goes too, in whole frames. If staging fell more than a buffer
+ * behind, the application has already written over the oldest bytes: those
+ * are skipped and counted.
+ * Called with cable->lock held.
+ */
+static unsigned int sdio_tx_batch(struct sdio_device *chip, struct sdio_pcm *dpcm)
+{
+    struct sdio_xport *xp = chip->xport;
+    unsigned int max = xp->max_bytes, batch = READ_ONCE(chip->batch_blocks), n;
+    u64 pending = dpcm->tx_played - dpcm->tx_staged, drop;
+
+    if (pending > dpcm->pcm_buffer_size) {
+        drop = sdio_frames_up(chip, pending - dpcm->pcm_buffer_size);
+        chip->tx_dropped += drop;
+        dpcm->tx_staged += drop;
+        pending -= drop;
+    }
+    if (batch && batch * xp->blksize < max)
+        max = batch * xp->blksize;
+    // never under a unit, prepare made sure it fits
+    max = max_t(u64, sdio_from_wire(chip, max), chip->xfer_unit);
+    n = min_t(u64, pending, max);
+    if (dpcm->cable->running & (1 << SNDRV_PCM_STREAM_PLAYBACK))
+        n -= n % chip->xfer_unit;
+    else
+        n -= n % chip->wire.dma_frame;
+    return n;
+}
+
+/*
+ * DMA area bytes of the next read from the ADC FIFO: whole blocks on the
+ * wire, as many as one transfer and the DMA area take. The FPGA keeps no
+ * more than its FIFO, what the clock says was sampled beyond that is gone;
+ * *lost says how much, it goes into the DMA area as silence so that capture
+ * stays aligned.
+ * Called with cable->lock held.
+ */
+static unsigned int sdio_rx_batch(struct sdio_device *chip, struct sdio_pcm *dpcm, u64 *lost)
+{
+    struct sdio_xport *xp = chip->xport;
+    unsigned int max = xp->max_bytes, batch = READ_ONCE(chip->batch_blocks), n;
+    u64 pending = dpcm->rx_due - dpcm->rx_done;
+    u64 fifo = sdio_from_wire(chip, xp->fifo_bytes);
+
+    *lost = 0;
+    if (!(dpcm->cable->running & (1 << SNDRV_PCM_STREAM_CAPTURE)))
+        return 0;
+    if (pending > fifo) {
+        *lost = min(sdio_frames_up(chip, pending - fifo), pending);
+        pending -= *lost;
+    }
+    if (batch && batch * xp->blksize < max)
+        max = batch * xp->blksize;
+    max = min_t(u64, max_t(u64, sdio_from_wire(chip, max), chip->xfer_unit),
+                dpcm->pcm_buffer_size);
+    n = min_t(u64, pending, max);
+    return n - n % chip->xfer_unit;
+}
+
+static bool sdio_stage_ready(struct sdio_device *chip)
+{
+    struct sdio_cable *cable = chip->cable[0];
+    unsigned long flags;
+    bool ready;
+
+    spin_lock_irqsave(&cable->lock, flags);
+    ready = cable->streams[SNDRV_PCM_STREAM_PLAYBACK] &&
+            chip->tx_head - chip->tx_tail < chip->tx_depth &&
+            sdio_tx_batch(chip, cable->streams[SNDRV_PCM_STREAM_PLAYBACK]);
+    spin_unlock_irqrestore(&cable->lock, flags);
+    return ready;
+}
+
+static bool sdio_tx_ready(struct sdio_device *chip)
+{
+    struct sdio_cable *cable = chip->cable[0];
+    struct sdio_pcm *cap;
+    unsigned long flags;
+    bool ready;
+    u64 lost;
+
+    spin_lock_irqsave(&cable->lock, flags);
+    cap = cable->streams[SNDRV_PCM_STREAM_CAPTURE];
+    ready = chip->tx_head != chip->tx_tail || (cap && sdio_rx_batch(chip, cap, &lost));
+    spin_unlock_irqrestore(&cable->lock, flags);
+    return ready;
+}
+
+/*
+ * Copies the next batch out of the DMA area into a free slot, while the tx
+ * thread has the previous ones on the bus. The copy does not sleep but the
+ * positions are only looked at under the lock; stage_lock keeps prepare and
+ * hw_free from pulling the DMA area from under it.
+ */
+static int sdio_stage_thread(void *data)
+{
+    struct sdio_device *chip = data;
+    struct sdio_cable *cable = chip->cable[0];
+    struct sdio_tx_slot *slot;
+    struct sdio_pcm *dpcm;
+    unsigned int pos, n, size, w;
+    struct sdio_wire wire;
+    char *src;
+    u64 staged;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(chip->stage_wait,
+                                 sdio_stage_ready(chip) || kthread_should_stop());
+
+        mutex_lock(&chip->stage_lock);
+        spin_lock_irq(&cable->lock);
+        dpcm = cable->streams[SNDRV_PCM_STREAM_PLAYBACK];
+        n = dpcm && chip->tx_head - chip->tx_tail < chip->tx_depth ?
+            sdio_tx_batch(chip, dpcm) : 0;
+        if (!n) {
+            spin_unlock_irq(&cable->lock);
+            mutex_unlock(&chip->stage_lock);
+            continue;
+        }
+        staged = dpcm->tx_staged;
+        pos = do_div(staged, dpcm->pcm_buffer_size);
+        size = dpcm->pcm_buffer_size;
+        src = dpcm->substream->runtime->dma_area;
+        slot = &chip->tx_slot[chip->tx_head % chip->tx_depth];
+        slot->gen = chip->run_gen;
+        wire = chip->wire;
+        spin_unlock_irq(&cable->lock);
+
+        if (pos + n > size) {
+            w = sdio_wire_copy(slot->buf, src + pos, size - pos, &wire);
+            w += sdio_wire_copy(slot->buf + w, src, n - (size - pos), &wire);
+        } else {
+            w = sdio_wire_copy(slot->buf, src + pos, n, &wire);
+        }
+        slot->bytes = w;
+        slot->span = n;
+
+        spin_lock_irq(&cable->lock);
+        dpcm->tx_staged += n;
+        chip->tx_queued += n;
+        chip->tx_head++;
+        chip->tx_queue_max = max(chip->tx_queue_max, chip->tx_head - chip->tx_tail);
+        spin_unlock_irq(&cable->lock);
+        mutex_unlock(&chip->stage_lock);
+        wake_up(&chip->tx_wait);
+    }
+    return 0;
+}
+
+/*
+ * Moves the hardware pointer by what went over the bus: for playback in
+ * irq_mode what the device took, for capture what was read into the DMA
+ * area. Returns the substream if a period went by.
+ * Called with cable->lock held.
+ */
+static struct snd_pcm_substream *sdio_pos_accepted(struct sdio_cable *cable,
+                                                   struct sdio_pcm *dpcm,
+                                                   unsigned int bytes)
+{
+    dpcm->buf_pos = (dpcm->buf_pos + bytes) % dpcm->pcm_buffer_size;
+    dpcm->period_pos += bytes;
+    if (!(cable->running & (1 << dpcm->substream->stream)) ||
+        dpcm->period_pos < cable->pcm_period_size)
+        return NULL;
+    dpcm->period_pos %= cable->pcm_period_size;
+    return dpcm->substream;
+}
+
+/*
+ * The FIFO went down to low-water: let the stage thread send as much as now
+ * fits, and read what the ADC sampled meanwhile. May be called in atomic
+ * context.
+ */
+static void sdio_fifo_irq(void *data)
+{
+    struct sdio_device *chip = data;
+    struct sdio_cable *cable = chip->cable[0];
+    struct sdio_xport *xp = chip->xport;
+    unsigned int played;
+    unsigned long flags;
+
+    spin_lock_irqsave(&cable->lock, flags);
+    chip->irq_count++;
+    // packed or slotted, the FIFO does not go by whole frames of the DMA area
+    played = xp->fifo_bytes - xp->low_water + chip->wire_rem;
+    chip->wire_rem = played % chip->wire.frame;
+    played = sdio_from_wire(chip, played);
+    // the one moment the level is known
+    chip->fifo_level = xp->low_water;
+    chip->fifo_level_ns = ktime_get_ns();
+    if ((cable->running & (1 << SNDRV_PCM_STREAM_PLAYBACK)) &&
+        cable->streams[SNDRV_PCM_STREAM_PLAYBACK]) {
+        cable->streams[SNDRV_PCM_STREAM_PLAYBACK]->tx_played += played;
+        wake_up(&chip->stage_wait);
+    }
+    if ((cable->running & (1 << SNDRV_PCM_STREAM_CAPTURE)) &&
+        cable->streams[SNDRV_PCM_STREAM_CAPTURE]) {
+        cable->streams[SNDRV_PCM_STREAM_CAPTURE]->rx_due += played;
+        wake_up(&chip->tx_wait);
+    }
+    spin_unlock_irqrestore(&cable->lock, flags);
+}
+
+/* bytes of silence when src is NULL, else the wire bytes that make them */
+static void sdio_rx_fill(struct snd_pcm_runtime *runtime, unsigned int size,
+                         unsigned int pos, const char *src, unsigned int n,
+                         const struct sdio_wire *w)
 {
-    .name = MODULE_NAME,
-    .probe	= sdio_probe,
-    .id_table = sdio_ids,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,8,0)
-    .remove	= __devexit_p(sdio_remove),
-#else
-    .remove	= sdio_remove,
-#endif
-};
-// ================================ ALSA structs ======================================
-struct sdio_pcm;
+    unsigned int part;
 
-struct sdio_cable
+    while (n) {
+        part = min(n, size - pos);
+        if (src && w->tdm) {
+            sdio_tdm_unpack(runtime->dma_area + pos, src, part, w);
+            src += part / w->dma_frame * w->frame;
+        } else if (src && w->packed) {
+            sdio_unpack24(runtime->dma_area + pos, src, part);
+            src += part / 4 * 3;
+        } else if (src) {
+            memcpy(runtime->dma_area + pos, src, part);
+            src += part;
+        } else {
+            snd_pcm_format_set_silence(runtime->format, runtime->dma_area + pos,
+                                       bytes_to_samples(runtime, part));
+        }
+        pos = (pos + part) % size;
+        n -= part;
+    }
+}
+
+/*
+ * Puts what was read into the capture DMA area, after silence for what the
+ * FIFO lost, and moves the pointer. stage_lock keeps prepare and hw_free from
+ * pulling the area from under the copy; one since the read bumped rx_gen and
+ * the bytes are dropped.
+ */
+static struct snd_pcm_substream *sdio_rx_deliver(struct sdio_device *chip, unsigned int gen,
+                                                 unsigned int rx, u64 lost, u64 t0, u64 t1)
 {
-    struct sdio_pcm *stream;
+    struct sdio_cable *cable = chip->cable[0];
+    struct snd_pcm_substream *elapsed = NULL;
+    struct sdio_pcm *cap;
+    unsigned int pos, size, fill;
+    struct sdio_wire wire;
 
-    struct snd_pcm_hardware hw;
-    unsigned int pcm_period_size;
-    unsigned int pcm_bps;
+    mutex_lock(&chip->stage_lock);
+    spin_lock_irq(&cable->lock);
+    cap = cable->streams[SNDRV_PCM_STREAM_CAPTURE];
+    if (!cap || gen != chip->rx_gen) {
+        spin_unlock_irq(&cable->lock);
+        mutex_unlock(&chip->stage_lock);
+        return NULL;
+    }
+    // only this thread moves the capture pointer
+    pos = cap->buf_pos;
+    size = cap->pcm_buffer_size;
+    wire = chip->wire;
+    spin_unlock_irq(&cable->lock);
 
-    // flags
-    unsigned int valid;
-    unsigned int period_update_pending :1;
-    unsigned int running;
+    // more than a buffer lost is an overrun anyway
+    fill = min_t(u64, lost, size);
+    sdio_rx_fill(cap->substream->runtime, size, pos, NULL, fill, &wire);
+    sdio_rx_fill(cap->substream->runtime, size, (pos + fill) % size, chip->rx_buf, rx,
+                 &wire);
 
-    //timer
-    unsigned int irq_pos;
-    unsigned int period_size_frac;
-    unsigned long last_jiffies;
-    struct timer_list timer;
-};
+    spin_lock_irq(&cable->lock);
+    if (gen == chip->rx_gen) {
+        cap->rx_done += lost + rx;
+        chip->rx_dropped += lost;
+        cap->link_bytes = cap->rx_done;
+        cap->link_ns = t1;
+        cap->link_xfer_ns = t1 - t0;
+        elapsed = sdio_pos_accepted(cable, cap, fill + rx);
+    }
+    spin_unlock_irq(&cable->lock);
+    mutex_unlock(&chip->stage_lock);
+    return elapsed;
+}
 
-struct sdio_device
+/*
+ * What the DAC still has of what was written, by the stream clock.
+ * Called with cable->lock held.
+ */
+static unsigned int sdio_fifo_level(struct sdio_device *chip, u64 now)
 {
-    struct sdio_cable *cable[MAX_PCM_SUBSTREAMS];
-    struct mutex cable_lock;
+    u64 played;
 
-    // alsa structs
-    struct snd_card *card;
-    struct snd_pcm *pcm;
-};
+    if (!chip->fifo_level || now <= chip->fifo_level_ns)
+        return chip->fifo_level;
+    played = mul_u64_u32_div(now - chip->fifo_level_ns, chip->wire_bps, NSEC_PER_SEC);
+    return played >= chip->fifo_level ? 0 : chip->fifo_level - played;
+}
 
-struct sdio_pcm
+/* a slot of this run is on the FPGA. Called with cable->lock held. */
+static void sdio_tx_landed(struct sdio_device *chip, struct sdio_pcm *play,
+                           struct sdio_tx_slot *slot, u64 t0, u64 t1)
 {
-    struct sdio_device *fifo;
-    struct sdio_cable *cable;
-
-    struct snd_pcm_substream *substream;
-    unsigned int pcm_buffer_size;
-    unsigned int buf_pos;
-    unsigned int silent_size;
-};
+    chip->tx_queued -= slot->span;
+    chip->fifo_level = min(sdio_fifo_level(chip, t1) + slot->bytes,
+                           chip->xport->fifo_bytes);
+    chip->fifo_level_ns = t1;
+    play->link_bytes += slot->span;
+    play->link_ns = t1;
+    play->link_xfer_ns = t1 - t0;
+}
 
-static struct snd_device_ops dev_ops =
+/*
+ * Keeps the bus busy with whatever is staged, oldest first, and reads what
+ * the ADC sampled in the same claim, so that one arbitration serves both
+ * directions.
+ */
+static int sdio_tx_thread(void *data)
 {
-    .dev_free = sdio_pcm_dev_free,
-};
-// =========================== SDIO function definition ===============================
+    struct sdio_device *chip = data;
+    struct sdio_cable *cable = chip->cable[0];
+    struct snd_pcm_substream *elapsed, *rx_elapsed;
+    struct sdio_tx_slot *slot;
+    struct sdio_pcm *cap, *play;
+    unsigned int rx, rx_wire, rx_gen;
+    u64 lost, t0, t1;
 
-// ============================== ALSA func definition ================================
-static void copy_play_buf(struct sdio_pcm *play,
-                          struct sdio_pcm *capt,
-                          unsigned int bytes)
-{
-    char *src = play->substream->runtime->dma_area;
-    char *dst = capt->substream->runtime->dma_area;
-    unsigned int src_off = play->buf_pos;
-    unsigned int dst_off = capt->buf_pos;
-    for (;;) {
-        unsigned int size = bytes;
-        if (src_off + size > play->pcm_buffer_size)
-            size = play->pcm_buffer_size - src_off;
-        if (dst_off + size > capt->pcm_buffer_size)
-            size = capt->pcm_buffer_size - dst_off;
-        memcpy(dst + dst_off, src + src_off, size);
-        if (size < capt->silent_size)
-            capt->silent_size -= size;
-        else
-            capt->silent_size = 0;
-        bytes -= size;
-        if (!bytes)
-            break;
-        src_off = (src_off + size) % play->pcm_buffer_size;
-        dst_off = (dst_off + size) % capt->pcm_buffer_size;
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(chip->tx_wait,
+                                 sdio_tx_ready(chip) || kthread_should_stop());
+
+        spin_lock_irq(&cable->lock);
+        // only this thread moves the tail, the slot stays put until then
+        slot = chip->tx_head != chip->tx_tail ?
+               &chip->tx_slot[chip->tx_tail % chip->tx_depth] : NULL;
+        cap = cable->streams[SNDRV_PCM_STREAM_CAPTURE];
+        lost = 0;
+        rx = cap ? sdio_rx_batch(chip, cap, &lost) : 0;
+        rx_wire = sdio_to_wire(chip, rx);
+        rx_gen = chip->rx_gen;
+        spin_unlock_irq(&cable->lock);
+        if (!slot && !rx)
+            continue;
+
+        // errors are counted in the transport stats, the data is gone either way
+        t0 = ktime_get_ns();
+        if (sdio_xport_duplex(chip->xport, slot ? slot->buf : NULL,
+                              slot ? slot->bytes : 0, chip->rx_buf, rx_wire)) {
+            lost += rx;
+            rx = 0;
+        }
+        t1 = ktime_get_ns();
+
+        elapsed = NULL;
+        if (slot) {
+            spin_lock_irq(&cable->lock);
+            chip->tx_tail++;
+            play = cable->streams[SNDRV_PCM_STREAM_PLAYBACK];
+            if (slot->gen == chip->run_gen && play) {
+                sdio_tx_landed(chip, play, slot, t0, t1);
+                if (chip->irq_mode)
+                    elapsed = sdio_pos_accepted(cable, play, slot->span);
+            }
+            spin_unlock_irq(&cable->lock);
+            wake_up(&chip->stage_wait);
+        }
+        rx_elapsed = rx || lost ? sdio_rx_deliver(chip, rx_gen, rx, lost, t0, t1) : NULL;
+
+        if (elapsed)
+            snd_pcm_period_elapsed(elapsed);
+        if (rx_elapsed)
+            snd_pcm_period_elapsed(rx_elapsed);
     }
+    return 0;
 }
 
 static void sdio_xfer_buf(struct sdio_cable *dev, unsigned int count)
 {
-    int i;
+    if (dev->running & (1 << SNDRV_PCM_STREAM_PLAYBACK)) {
+        struct sdio_pcm *pcm = dev->streams[SNDRV_PCM_STREAM_PLAYBACK];
 
-    copy_play_buf(dev->stream,
-                  dev->stream,
-                  count);
-    for (i = 0; i < 2; i++) {
-        if (dev->running & (1 << i)) {
-            struct sdio_pcm *pcm = dev->stream;
-            pcm->buf_pos += count;
-            pcm->buf_pos %= pcm->pcm_buffer_size;
-        }
+        copy_play_buf(pcm, count);
+        pcm->buf_pos += count;
+        pcm->buf_pos %= pcm->pcm_buffer_size;
+    }
+    // the pointer moves once the bytes are read
+    if (dev->running & (1 << SNDRV_PCM_STREAM_CAPTURE)) {
+        dev->streams[SNDRV_PCM_STREAM_CAPTURE]->rx_due += count;
+        wake_up(&dev->fifo->tx_wait);
     }
 }
 
 static void sdio_pos_update(struct sdio_cable *cable)
 {
-    unsigned int last_pos, count;
+    unsigned int count;
     unsigned long delta;
+    u64 last_pos;
     if (!cable->running)
         return;
     delta = jiffies - cable->last_jiffies;
@@ -275,24 +1649,30 @@ static void sdio_pos_update(struct sdio_cable *cable)
         return;
     cable->last_jiffies += delta;
     last_pos = byte_pos(cable->irq_pos);
-    cable->irq_pos += delta * cable->pcm_bps;
+    cable->irq_pos += (u64)delta * cable->pcm_bps;
     count = byte_pos(cable->irq_pos) - last_pos;
     if (!count)
         return;
     sdio_xfer_buf(cable, count);
     if (cable->irq_pos >= cable->period_size_frac) {
-        cable->irq_pos %= cable->period_size_frac;
+        div64_u64_rem(cable->irq_pos, cable->period_size_frac, &cable->irq_pos);
         cable->period_update_pending = 1;
     }
 }
 
+/* the timer paces what the FIFO interrupt does not: all of it, or capture alone */
+static bool sdio_timer_paced(struct sdio_cable *cable)
+{
+    return !cable->fifo->irq_mode ||
+           !(cable->running & (1 << SNDRV_PCM_STREAM_PLAYBACK));
+}
+
 static void sdio_timer_start(struct sdio_cable *cable)
 {
     unsigned long tick;
-    tick = cable->period_size_frac - cable->irq_pos;
-    tick = (tick + cable->pcm_bps - 1) / cable->pcm_bps;
-    cable->timer.expires = jiffies + tick;
-    add_timer(&cable->timer);
+    tick = div_u64(cable->period_size_frac - cable->irq_pos + cable->pcm_bps - 1,
+                   cable->pcm_bps);
+    mod_timer(&cable->timer, jiffies + tick);
 }
 
 static void sdio_timer_stop(struct sdio_cable *dev)
@@ -300,8 +1680,47 @@ static void sdio_timer_stop(struct sdio_cable *dev)
     del_timer(&dev->timer);
 }
 
+static void sdio_timer_function(struct timer_list *t)
+{
+    struct sdio_cable *cable = from_timer(cable, t, timer);
+    struct snd_pcm_substream *ss = NULL;
+    unsigned long flags;
+
+    spin_lock_irqsave(&cable->lock, flags);
+    if (cable->running && sdio_timer_paced(cable)) {
+        sdio_pos_update(cable);
+        sdio_timer_start(cable);
+        if (cable->period_update_pending) {
+            cable->period_update_pending = 0;
+            // capture periods go by as the reads land
+            if (cable->running & (1 << SNDRV_PCM_STREAM_PLAYBACK))
+                ss = cable->streams[SNDRV_PCM_STREAM_PLAYBACK]->substream;
+        }
+    }
+    spin_unlock_irqrestore(&cable->lock, flags);
+    if (ss)
+        snd_pcm_period_elapsed(ss);
+}
+
 static int sdio_pcm_free(struct sdio_device *chip)
 {
+    int i;
+
+    debugfs_remove_recursive(chip->debugfs);
+    if (chip->irq_mode)
+        sdio_xport_free_irq(chip->xport);
+    if (chip->stage_thread)
+        kthread_stop(chip->stage_thread);
+    if (chip->tx_thread)
+        kthread_stop(chip->tx_thread);
+    for (i = 0; i < MAX_PCM_SUBSTREAMS; i++) {
+        if (chip->cable[i])
+            del_timer_sync(&chip->cable[i]->timer);
+        kfree(chip->cable[i]);
+    }
+    for (i = 0; i < SDIO_TX_DEPTH_MAX; i++)
+        kfree(chip->tx_slot[i].buf);
+    kfree(chip->rx_buf);
     return 0;
 }
 
@@ -319,36 +1738,122 @@ static int sdio_hw_params(struct snd_pcm_substream *ss,
 
 static int sdio_hw_free(struct snd_pcm_substream *ss)
 {
+    struct sdio_pcm *dpcm = ss->runtime->private_data;
+    struct sdio_cable *cable = dpcm->cable;
+    bool shared;
+
+    // the other direction may run on the timer, or start on it; stopped, this one
+    // is left alone by it, as sdio_xfer_buf() goes by cable->running under the lock
+    spin_lock_irq(&cable->lock);
+    shared = cable->running || (cable->valid & ~(1 << ss->stream));
+    spin_unlock_irq(&cable->lock);
+    if (!shared)
+        del_timer_sync(&cable->timer);
+
+    // nothing left to stage from, or read into, the area being freed
+    mutex_lock(&dpcm->fifo->stage_lock);
+    spin_lock_irq(&dpcm->cable->lock);
+    dpcm->tx_staged = dpcm->tx_played;
+    dpcm->rx_done = dpcm->rx_due;
+    if (ss->stream == SNDRV_PCM_STREAM_CAPTURE)
+        dpcm->fifo->rx_gen++;
+    spin_unlock_irq(&dpcm->cable->lock);
+    mutex_unlock(&dpcm->fifo->stage_lock);
     return snd_pcm_lib_free_pages(ss);
 }
 
+static void sdio_runtime_free(struct snd_pcm_runtime *runtime)
+{
+    kfree(runtime->private_data);
+}
+
 static int sdio_pcm_open(struct snd_pcm_substream *ss)
 {
     struct sdio_pcm *dpcm;
     struct sdio_device *mydev = ss->private_data;
+    struct sdio_cable *cable = mydev->cable[0];
+    int ret;
     printk(KERN_WARNING "opening this beautiful useless device");
 
+    dpcm = kzalloc(sizeof(*dpcm), GFP_KERNEL);
+    if (!dpcm)
+        return -ENOMEM;
+
     mutex_lock(&mydev->cable_lock);
 
     ss->runtime->hw = sdio_pcm_hw;
+    if (!(mydev->xport->caps & SDIO_CAP_PACKED24))
+        ss->runtime->hw.formats &= ~SDIO_FMTBIT_S24;
+    // more than a pair needs a bitstream with TDM, and no more than its frame
+    if (!(mydev->xport->caps & SDIO_CAP_TDM))
+        ss->runtime->hw.channels_max = 2;
+    else if (mydev->tdm_slots)
+        ss->runtime->hw.channels_max = mydev->tdm_slots;
+    snd_pcm_hw_constraint_list(ss->runtime, 0, SNDRV_PCM_HW_PARAM_RATE, &sdio_rate_list);
+    // room for whole blocks, the thread sends nothing shorter while running,
+    // and with the FIFO interrupt for what the device asks at once
+    snd_pcm_hw_constraint_minmax(ss->runtime, SNDRV_PCM_HW_PARAM_BUFFER_BYTES,
+                                 mydev->irq_mode ? max(2 * mydev->xport->blksize,
+                                                       mydev->xport->fifo_bytes) :
+                                                   2 * mydev->xport->blksize,
+                                 UINT_MAX);
 
+    dpcm->fifo = mydev;
+    dpcm->cable = cable;
     dpcm->substream = ss;
 
-    ss->runtime->private_data = mydev;
+    // once one direction is prepared the other runs on its clock
+    ret = snd_pcm_hw_rule_add(ss->runtime, 0, SNDRV_PCM_HW_PARAM_FORMAT,
+                              sdio_rule_format, dpcm, SNDRV_PCM_HW_PARAM_FORMAT, -1);
+    if (ret < 0)
+        goto __unlock;
+    ret = snd_pcm_hw_rule_add(ss->runtime, 0, SNDRV_PCM_HW_PARAM_RATE,
+                              sdio_rule_interval, dpcm, SNDRV_PCM_HW_PARAM_RATE, -1);
+    if (ret < 0)
+        goto __unlock;
+    ret = snd_pcm_hw_rule_add(ss->runtime, 0, SNDRV_PCM_HW_PARAM_CHANNELS,
+                              sdio_rule_interval, dpcm, SNDRV_PCM_HW_PARAM_CHANNELS, -1);
+    if (ret < 0)
+        goto __unlock;
+    ret = snd_pcm_hw_rule_add(ss->runtime, 0, SNDRV_PCM_HW_PARAM_PERIOD_BYTES,
+                              sdio_rule_interval, dpcm, SNDRV_PCM_HW_PARAM_PERIOD_BYTES, -1);
+    if (ret < 0)
+        goto __unlock;
 
-    mutex_unlock(&mydev->cable_lock);
+    spin_lock_irq(&cable->lock);
+    cable->streams[ss->stream] = dpcm;
+    spin_unlock_irq(&cable->lock);
 
-    return 0;
+    ss->runtime->private_data = dpcm;
+    ss->runtime->private_free = sdio_runtime_free;
+
+__unlock:
+    mutex_unlock(&mydev->cable_lock);
+    if (ret < 0)
+        kfree(dpcm);
+    return ret;
 }
 
 static int sdio_pcm_close(struct snd_pcm_substream *ss)
 {
     struct sdio_device *mydev = ss->private_data;
+    struct sdio_pcm *dpcm = ss->runtime->private_data;
+    struct sdio_cable *cable = dpcm->cable;
     printk(KERN_WARNING "closing this beautiful useless device");
 
     mutex_lock(&mydev->cable_lock);
 
-    ss->private_data = NULL;
+    spin_lock_irq(&cable->lock);
+    cable->streams[ss->stream] = NULL;
+    if (ss->stream == SNDRV_PCM_STREAM_CAPTURE)
+        mydev->rx_gen++;
+    cable->valid &= ~(1 << ss->stream);
+    spin_unlock_irq(&cable->lock);
+    // nothing left to follow, nor to pace: hw_free left the timer to the other one
+    if (!cable->valid) {
+        cable->hw = sdio_pcm_hw;
+        del_timer_sync(&cable->timer);
+    }
 
     mutex_unlock(&mydev->cable_lock);
 
@@ -358,22 +1863,51 @@ static int sdio_pcm_close(struct snd_pcm_substream *ss)
 static int sdio_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
     struct snd_pcm_runtime *runtime = substream->runtime;
-    //struct loopback_pcm *dpcm = runtime->private_data;
-    struct sdio_cable *dev = runtime->private_data; // dpcm->cable;
+    struct sdio_pcm *dpcm = runtime->private_data;
+    struct sdio_cable *dev = dpcm->cable;
+    bool play = substream->stream == SNDRV_PCM_STREAM_PLAYBACK;
     switch (cmd)
     {
         case SNDRV_PCM_TRIGGER_START:
+            spin_lock(&dev->lock);
             if (!dev->running)
             {
+                sdio_xport_start(dpcm->fifo->xport, dpcm->fifo->wire_bps);
+                dpcm->fifo->run_start_ns = ktime_get_ns();
+                dpcm->fifo->run_busy_ns = dpcm->fifo->xport->stats.busy_ns;
+                dpcm->fifo->run_stop_ns = 0;
+                dpcm->fifo->fifo_level = 0;
+                dpcm->fifo->wire_rem = 0;
                 dev->last_jiffies = jiffies;
-                sdio_timer_start(dev);
             }
             dev->running |= (1 << substream->stream);
+            if (dpcm->fifo->irq_mode && play) {
+                // the DAC clocks both directions from here on
+                sdio_timer_stop(dev);
+                // the FIFO is empty, fill it; the interrupt asks for the rest
+                dpcm->tx_played += sdio_from_wire(dpcm->fifo, dpcm->fifo->xport->fifo_bytes);
+                wake_up(&dpcm->fifo->stage_wait);
+            } else if (sdio_timer_paced(dev)) {
+                sdio_timer_start(dev);
+            }
+            spin_unlock(&dev->lock);
             break;
         case SNDRV_PCM_TRIGGER_STOP:
+            spin_lock(&dev->lock);
             dev->running &= ~(1 << substream->stream);
             if (!dev->running)
+            {
                 sdio_timer_stop(dev);
+                sdio_xport_stop(dpcm->fifo->xport);
+                dpcm->fifo->run_stop_ns = ktime_get_ns();
+            } else if (dpcm->fifo->irq_mode && play) {
+                // capture goes on, on the timer
+                dev->last_jiffies = jiffies;
+                sdio_timer_start(dev);
+            }
+            // the tail shorter than a block goes now
+            wake_up(&dpcm->fifo->stage_wait);
+            spin_unlock(&dev->lock);
             break;
         default:
             return -EINVAL;
@@ -381,20 +1915,91 @@ static int sdio_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
     return 0;
 }
 
+/*
+ * The wire format of the run, for both directions: S24_LE goes packed, the
+ * rest as in the DMA area; the channels go into the slots of tdm_map, out of
+ * tdm_slots, and the FPGA is told both. A transfer is whole blocks and whole
+ * frames on the wire. Called with cable_lock held.
+ */
+static int sdio_wire_setup(struct sdio_device *chip, struct snd_pcm_runtime *runtime)
+{
+    struct sdio_cable *cable = chip->cable[0];
+    struct sdio_xport *xp = chip->xport;
+    struct sdio_wire w = {};
+    unsigned int slots = chip->tdm_slots ?: runtime->channels;
+    unsigned long used = 0;
+    unsigned int c, unit;
+    int ret;
+
+    w.packed = runtime->format == SNDRV_PCM_FORMAT_S24_LE;
+    w.channels = runtime->channels;
+    w.width = snd_pcm_format_physical_width(runtime->format) / 8;
+    w.wire_width = w.packed ? 3 : w.width;
+    w.dma_frame = frames_to_bytes(runtime, 1);
+    if (w.channels > slots)
+        return -EINVAL;
+    for (c = 0; c < w.channels; c++) {
+        w.map[c] = chip->tdm_map[c];
+        if (w.map[c] >= slots || (used & (1UL << w.map[c])))
+            return -EINVAL;
+        used |= 1UL << w.map[c];
+        w.tdm |= w.map[c] != c;
+    }
+    w.tdm |= slots != w.channels;
+    w.frame = slots * w.wire_width;
+
+    unit = lcm(xp->blksize, w.frame);
+    if (unit > xp->max_bytes) {
+        printk(KERN_WARNING "SDIO: %u byte frames do not fit %u byte transfers\n",
+               w.frame, xp->max_bytes);
+        return -EINVAL;
+    }
+    ret = sdio_xport_set_wire(xp, w.wire_width, slots);
+    if (ret < 0)
+        return ret;
+
+    spin_lock_irq(&cable->lock);
+    chip->wire = w;
+    chip->wire_bps = runtime->rate * w.frame;
+    chip->xfer_unit = unit / w.frame * w.dma_frame;
+    spin_unlock_irq(&cable->lock);
+    return 0;
+}
+
 static int sdio_pcm_prepare(struct snd_pcm_substream *substream)
 {
     struct snd_pcm_runtime *runtime = substream->runtime;
-    //struct loopback_pcm *dpcm = runtime->private_data;
-    struct sdio_pcm *dev = runtime->private_data; // dpcm->cable;
+    struct sdio_pcm *dev = runtime->private_data;
     struct sdio_cable *cable = dev->cable;
     unsigned int bps;
+    int ret;
+    // what the pointer moves by, S24_LE takes 4 bytes in the DMA area
     bps = runtime->rate * runtime->channels;
-    bps *= snd_pcm_format_width(runtime->format);
+    bps *= snd_pcm_format_physical_width(runtime->format);
     bps /= 8;
     if (bps <= 0)
         return -EINVAL;
+
+    // what is still queued belongs to the previous run
+    mutex_lock(&dev->fifo->stage_lock);
+    spin_lock_irq(&cable->lock);
     dev->buf_pos = 0;
+    dev->tx_played = 0;
+    dev->tx_staged = 0;
+    dev->rx_due = 0;
+    dev->rx_done = 0;
+    dev->link_bytes = 0;
+    dev->link_ns = 0;
+    dev->period_pos = 0;
+    // slots still queued, or reads on the bus, from the last run no longer move the pointer
+    if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+        dev->fifo->run_gen++;
+        dev->fifo->tx_queued = 0;
+    } else
+        dev->fifo->rx_gen++;
     dev->pcm_buffer_size = frames_to_bytes(runtime, runtime->buffer_size);
+    spin_unlock_irq(&cable->lock);
+    mutex_unlock(&dev->fifo->stage_lock);
     if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
         /* clear capture buffer */
         dev->silent_size = dev->pcm_buffer_size;
@@ -406,6 +2011,11 @@ static int sdio_pcm_prepare(struct snd_pcm_substream *substream)
     }
     mutex_lock(&dev->fifo->cable_lock);
     if (!(cable->valid & ~(1 << substream->stream))) {
+        ret = sdio_wire_setup(dev->fifo, runtime);
+        if (ret < 0) {
+            mutex_unlock(&dev->fifo->cable_lock);
+            return ret;
+        }
         cable->pcm_bps = bps;
         cable->pcm_period_size =
                 frames_to_bytes(runtime, runtime->period_size);
@@ -417,42 +2027,505 @@ static int sdio_pcm_prepare(struct snd_pcm_substream *substream)
         cable->hw.channels_max = runtime->channels;
         cable->hw.period_bytes_min = cable->pcm_period_size;
         cable->hw.period_bytes_max = cable->pcm_period_size;
+    } else if (cable->pcm_bps != bps ||
+               cable->pcm_period_size != frames_to_bytes(runtime, runtime->period_size)) {
+        // both set up before either was prepared, the rules could not match them
+        mutex_unlock(&dev->fifo->cable_lock);
+        return -EINVAL;
+    }
+    if (dev->pcm_buffer_size < dev->fifo->xfer_unit) {
+        // less than one whole-block transfer would never go
+        mutex_unlock(&dev->fifo->cable_lock);
+        return -EINVAL;
     }
     cable->valid |= 1 << substream->stream;
     mutex_unlock(&dev->fifo->cable_lock);
     return 0;
 }
 
+/*
+ * Bytes between the pointer and the converter. For playback what the FPGA
+ * still has, and by the clock also what the pointer passed but is not over
+ * the bus yet; for capture what was sampled and is not in the DMA area yet.
+ * Called with cable->lock held.
+ */
+static u64 sdio_pcm_delay(struct sdio_pcm *dpcm)
+{
+    struct sdio_device *chip = dpcm->fifo;
+    u64 delay;
+
+    if (dpcm->substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+        return dpcm->rx_due - dpcm->rx_done;
+    delay = sdio_from_wire(chip, sdio_fifo_level(chip, ktime_get_ns()));
+    if (!chip->irq_mode)
+        delay += min_t(u64, dpcm->tx_played - dpcm->tx_staged, dpcm->pcm_buffer_size) +
+                 chip->tx_queued;
+    return delay;
+}
+
 static snd_pcm_uframes_t sdio_pcm_pointer(struct snd_pcm_substream *substream)
 {
     struct snd_pcm_runtime *runtime = substream->runtime;
     struct sdio_pcm *dpcm = runtime->private_data;
-    sdio_pos_update(dpcm->cable);
-    return bytes_to_frames(runtime, dpcm->buf_pos);
+    unsigned long flags;
+    unsigned int pos;
+    u64 delay;
+
+    spin_lock_irqsave(&dpcm->cable->lock, flags);
+    if (sdio_timer_paced(dpcm->cable))
+        sdio_pos_update(dpcm->cable);
+    pos = dpcm->buf_pos;
+    delay = sdio_pcm_delay(dpcm);
+    spin_unlock_irqrestore(&dpcm->cable->lock, flags);
+    runtime->delay = bytes_to_frames(runtime, min_t(u64, delay, INT_MAX));
+    return bytes_to_frames(runtime, pos);
+}
+
+/*
+ * Link timestamps: the audio time is what went over the bus up to the end of
+ * the last transfer, the system time when it ended, as accurate as that
+ * transfer was long. Anything else is left to the core.
+ */
+static int sdio_pcm_get_time_info(struct snd_pcm_substream *substream,
+                                  struct timespec *system_ts, struct timespec *audio_ts,
+                                  struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+                                  struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    struct sdio_pcm *dpcm = runtime->private_data;
+    unsigned long flags;
+    u64 bytes, ns;
+    u32 xfer_ns;
+
+    spin_lock_irqsave(&dpcm->cable->lock, flags);
+    bytes = dpcm->link_bytes;
+    ns = dpcm->link_ns;
+    xfer_ns = dpcm->link_xfer_ns;
+    spin_unlock_irqrestore(&dpcm->cable->lock, flags);
+
+    // link_ns is CLOCK_MONOTONIC
+    if (audio_tstamp_config->type_requested != SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK ||
+        runtime->tstamp_type != SNDRV_PCM_TSTAMP_TYPE_MONOTONIC || !ns) {
+        audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+        return 0;
+    }
+
+    *system_ts = ns_to_timespec(ns);
+    *audio_ts = ns_to_timespec(div_u64((u64)bytes_to_frames(runtime, bytes) * NSEC_PER_SEC,
+                                       runtime->rate));
+    audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK;
+    audio_tstamp_report->accuracy_report = 1;
+    audio_tstamp_report->accuracy = xfer_ns;
+    return 0;
+}
+
+/* the first direction prepared sets the cable, see sdio_pcm_prepare() */
+static int sdio_rule_format(struct snd_pcm_hw_params *params,
+                            struct snd_pcm_hw_rule *rule)
+{
+    struct sdio_pcm *dpcm = rule->private;
+    struct snd_mask m;
+
+    snd_mask_none(&m);
+    mutex_lock(&dpcm->fifo->cable_lock);
+    m.bits[0] = (u32)dpcm->cable->hw.formats;
+    m.bits[1] = (u32)(dpcm->cable->hw.formats >> 32);
+    mutex_unlock(&dpcm->fifo->cable_lock);
+    return snd_mask_refine(hw_param_mask(params, rule->var), &m);
+}
+
+static int sdio_rule_interval(struct snd_pcm_hw_params *params,
+                              struct snd_pcm_hw_rule *rule)
+{
+    struct sdio_pcm *dpcm = rule->private;
+    struct snd_pcm_hardware *hw = &dpcm->cable->hw;
+    struct snd_interval t = {};
+
+    mutex_lock(&dpcm->fifo->cable_lock);
+    switch (rule->var) {
+    case SNDRV_PCM_HW_PARAM_RATE:
+        t.min = hw->rate_min;
+        t.max = hw->rate_max;
+        break;
+    case SNDRV_PCM_HW_PARAM_CHANNELS:
+        t.min = hw->channels_min;
+        t.max = hw->channels_max;
+        break;
+    default:
+        t.min = hw->period_bytes_min;
+        t.max = hw->period_bytes_max;
+        break;
+    }
+    mutex_unlock(&dpcm->fifo->cable_lock);
+    return snd_interval_refine(hw_param_interval(params, rule->var), &t);
+}
+
+/* /proc/asound/cardN/sdio, one "key value" per line */
+static void sdio_proc_read(struct snd_info_entry *entry,
+                           struct snd_info_buffer *buffer)
+{
+    struct sdio_device *chip = entry->private_data;
+    struct sdio_xport *xp = chip->xport;
+    u64 end = chip->run_stop_ns ? chip->run_stop_ns : ktime_get_ns();
+    u64 util = 0;
+
+    // permille of the run the bus spent in transfers
+    if (chip->run_start_ns && end > chip->run_start_ns)
+        util = div64_u64((xp->stats.busy_ns - chip->run_busy_ns) * 1000,
+                         end - chip->run_start_ns);
+
+    snd_iprintf(buffer, "transport %s\n", xp->ops->name);
+    snd_iprintf(buffer, "fw_bytes %zu\n", chip->fw_bytes);
+    snd_iprintf(buffer, "fw_load_us %llu\n", div_u64(chip->fw_ns, NSEC_PER_USEC));
+    snd_iprintf(buffer, "block_size %u\n", xp->blksize);
+    snd_iprintf(buffer, "max_transfer %u\n", xp->max_bytes);
+    snd_iprintf(buffer, "batch_blocks %u\n", chip->batch_blocks);
+    snd_iprintf(buffer, "bytes_out %llu\n", xp->stats.bytes_out);
+    snd_iprintf(buffer, "bytes_in %llu\n", xp->stats.bytes_in);
+    snd_iprintf(buffer, "transfers %llu\n", xp->stats.transfers);
+    snd_iprintf(buffer, "errors %llu\n", (u64)atomic64_read(&xp->stats.errors));
+    snd_iprintf(buffer, "busy_ns %llu\n", xp->stats.busy_ns);
+    snd_iprintf(buffer, "lat_max_ns %llu\n", xp->stats.lat_max_ns);
+    snd_iprintf(buffer, "underflows %llu\n", (u64)atomic64_read(&xp->stats.underflows));
+    snd_iprintf(buffer, "stall_ns %llu\n", xp->stats.stall_ns);
+    snd_iprintf(buffer, "sg_bytes %llu\n", xp->stats.sg_bytes);
+    snd_iprintf(buffer, "tx_dropped %llu\n", chip->tx_dropped);
+    snd_iprintf(buffer, "rx_dropped %llu\n", chip->rx_dropped);
+    snd_iprintf(buffer, "tx_depth %u\n", chip->tx_depth);
+    snd_iprintf(buffer, "tx_queue_max %u\n", chip->tx_queue_max);
+    snd_iprintf(buffer, "tx_queued %u\n", chip->tx_queued);
+    snd_iprintf(buffer, "fifo_level %u\n", chip->fifo_level);
+    snd_iprintf(buffer, "wire_caps 0x%x\n", xp->caps);
+    snd_iprintf(buffer, "wire_frame %u/%u\n", chip->wire.frame, chip->wire.dma_frame);
+    snd_iprintf(buffer, "wire_tdm %u\n", chip->wire.tdm);
+    snd_iprintf(buffer, "bus_util_pct %llu.%llu\n", util / 10, util % 10);
+    snd_iprintf(buffer, "pacing %s\n", chip->irq_mode ? "irq" : "timer");
+    snd_iprintf(buffer, "fifo_irqs %llu\n", chip->irq_count);
+}
+// ===================================== SYSFS ========================================
+static struct sdio_device *sdio_dev_chip(struct device *dev)
+{
+    return container_of(dev, struct snd_card, card_dev)->private_data;
+}
+
+/* one line per point, the one in use marked */
+static ssize_t calibration_show(struct device *dev, struct device_attribute *attr,
+                                char *buf)
+{
+    struct sdio_device *chip = sdio_dev_chip(dev);
+    struct sdio_tune_point *t;
+    ssize_t len;
+    unsigned int i;
+
+    len = scnprintf(buf, PAGE_SIZE, "blksize blocks kBps lat_us\n");
+    for (i = 0; i < chip->tune_count; i++) {
+        t = &chip->tune[i];
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%u %u %u %u%s\n",
+                         t->blksize, t->blocks, t->kBps, t->lat_us,
+                         i == chip->tune_best ? " *" : "");
+    }
+    return len;
+}
+
+static ssize_t blksize_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", sdio_dev_chip(dev)->xport->blksize);
+}
+
+/* the pipeline follows the transfer size, so only between streams */
+static ssize_t blksize_store(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+    struct sdio_device *chip = sdio_dev_chip(dev);
+    struct sdio_cable *cable = chip->cable[0];
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret)
+        return ret;
+    mutex_lock(&chip->cable_lock);
+    if (cable->streams[SNDRV_PCM_STREAM_PLAYBACK] || cable->streams[SNDRV_PCM_STREAM_CAPTURE])
+        ret = -EBUSY;
+    else
+        ret = sdio_xport_set_blksize(chip->xport, val, chip->buf_bytes);
+    mutex_unlock(&chip->cable_lock);
+    return ret ? ret : count;
+}
+
+static ssize_t batch_blocks_show(struct device *dev, struct device_attribute *attr,
+                                 char *buf)
+{
+    return sprintf(buf, "%u\n", sdio_dev_chip(dev)->batch_blocks);
+}
+
+/* taken up by the next transfer */
+static ssize_t batch_blocks_store(struct device *dev, struct device_attribute *attr,
+                                  const char *buf, size_t count)
+{
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret)
+        return ret;
+    WRITE_ONCE(sdio_dev_chip(dev)->batch_blocks, val);
+    return count;
+}
+
+static ssize_t tdm_slots_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", sdio_dev_chip(dev)->tdm_slots);
+}
+
+/* the frame on the wire, 0 for as many slots as channels; between streams */
+static ssize_t tdm_slots_store(struct device *dev, struct device_attribute *attr,
+                               const char *buf, size_t count)
+{
+    struct sdio_device *chip = sdio_dev_chip(dev);
+    struct sdio_cable *cable = chip->cable[0];
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret)
+        return ret;
+    if (val > SDIO_TDM_SLOTS)
+        return -EINVAL;
+    mutex_lock(&chip->cable_lock);
+    if (cable->streams[SNDRV_PCM_STREAM_PLAYBACK] || cable->streams[SNDRV_PCM_STREAM_CAPTURE])
+        ret = -EBUSY;
+    else
+        chip->tdm_slots = val;
+    mutex_unlock(&chip->cable_lock);
+    return ret ? ret : count;
+}
+
+/* the slot of each channel in turn */
+static ssize_t slot_map_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct sdio_device *chip = sdio_dev_chip(dev);
+    ssize_t len = 0;
+    unsigned int c;
+
+    for (c = 0; c < SDIO_TDM_SLOTS; c++)
+        len += sprintf(buf + len, "%u%c", chip->tdm_map[c],
+                       c == SDIO_TDM_SLOTS - 1 ? '\n' : ' ');
+    return len;
+}
+
+/*
+ * Slots of the first channels, space or comma separated; the rest keep
+ * theirs. Prepare refuses a map that puts two channels of the run in one
+ * slot or any beyond the frame.
+ */
+static ssize_t slot_map_store(struct device *dev, struct device_attribute *attr,
+                              const char *buf, size_t count)
+{
+    struct sdio_device *chip = sdio_dev_chip(dev);
+    struct sdio_cable *cable = chip->cable[0];
+    u8 map[SDIO_TDM_SLOTS];
+    unsigned int c = 0, val;
+    char *s, *tok, *p;
+    int ret = 0;
+
+    p = s = kstrndup(buf, count, GFP_KERNEL);
+    if (!s)
+        return -ENOMEM;
+    while ((tok = strsep(&p, " ,\n")) != NULL) {
+        if (!*tok)
+            continue;
+        if (c == SDIO_TDM_SLOTS)
+            ret = -EINVAL;
+        else
+            ret = kstrtouint(tok, 0, &val);
+        if (!ret && val >= SDIO_TDM_SLOTS)
+            ret = -EINVAL;
+        if (ret)
+            break;
+        map[c++] = val;
+    }
+    kfree(s);
+    if (ret)
+        return ret;
+
+    mutex_lock(&chip->cable_lock);
+    if (cable->streams[SNDRV_PCM_STREAM_PLAYBACK] || cable->streams[SNDRV_PCM_STREAM_CAPTURE])
+        ret = -EBUSY;
+    else
+        memcpy(chip->tdm_map, map, c);
+    mutex_unlock(&chip->cable_lock);
+    return ret ? ret : count;
+}
+
+// ==================================== DEBUGFS =======================================
+/*
+ * Where a stall comes from: the bus (lat_*, busy), the host controller
+ * (claim_*, err_*), or our own pacing (lock_ns, the pipeline, the FIFO).
+ */
+static int sdio_dbg_stats_show(struct seq_file *m, void *unused)
+{
+    struct sdio_device *chip = m->private;
+    struct sdio_xport_stats *st = &chip->xport->stats;
+    struct sdio_cable *cable = chip->cable[0];
+    unsigned int queued, queued_bytes, level;
+
+    spin_lock_irq(&cable->lock);
+    queued = chip->tx_head - chip->tx_tail;
+    queued_bytes = chip->tx_queued;
+    level = chip->fifo_level;
+    spin_unlock_irq(&cable->lock);
+
+    seq_printf(m, "bytes_out %llu\n", st->bytes_out);
+    seq_printf(m, "bytes_in %llu\n", st->bytes_in);
+    seq_printf(m, "xfers_out %llu\n", st->xfers_out);
+    seq_printf(m, "xfers_in %llu\n", st->xfers_in);
+    seq_printf(m, "transfers %llu\n", st->transfers);
+    seq_printf(m, "errors %llu\n", (u64)atomic64_read(&st->errors));
+    seq_printf(m, "err_crc %llu\n", st->err_crc);
+    seq_printf(m, "err_timeout %llu\n", st->err_timeout);
+    seq_printf(m, "busy_ns %llu\n", st->busy_ns);
+    seq_printf(m, "lat_max_ns %llu\n", st->lat_max_ns);
+    seq_printf(m, "lock_ns %llu\n", st->lock_ns);
+    seq_printf(m, "claim_ns %llu\n", st->claim_ns);
+    seq_printf(m, "claim_max_ns %llu\n", st->claim_max_ns);
+    seq_printf(m, "underflows %llu\n", (u64)atomic64_read(&st->underflows));
+    seq_printf(m, "stall_ns %llu\n", st->stall_ns);
+    seq_printf(m, "tx_depth %u\n", chip->tx_depth);
+    seq_printf(m, "tx_queue %u\n", queued);
+    seq_printf(m, "tx_queue_max %u\n", chip->tx_queue_max);
+    seq_printf(m, "tx_queued_bytes %u\n", queued_bytes);
+    seq_printf(m, "tx_dropped %llu\n", chip->tx_dropped);
+    seq_printf(m, "rx_dropped %llu\n", chip->rx_dropped);
+    seq_printf(m, "fifo_level %u\n", level);
+    seq_printf(m, "fifo_irqs %llu\n", chip->irq_count);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sdio_dbg_stats);
+
+/* "low high count" per bucket that has any, high exclusive */
+static void sdio_dbg_hist(struct seq_file *m, const u64 *hist)
+{
+    unsigned int i;
+
+    for (i = 0; i < SDIO_HIST_BUCKETS; i++) {
+        if (!hist[i])
+            continue;
+        if (i == SDIO_HIST_BUCKETS - 1)
+            seq_printf(m, "%llu - %llu\n", 1ULL << (i - 1), hist[i]);
+        else
+            seq_printf(m, "%llu %llu %llu\n", i ? 1ULL << (i - 1) : 0, 1ULL << i, hist[i]);
+    }
+}
+
+static int sdio_dbg_size_hist_show(struct seq_file *m, void *unused)
+{
+    struct sdio_device *chip = m->private;
+
+    sdio_dbg_hist(m, chip->xport->stats.size_hist);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sdio_dbg_size_hist);
+
+static int sdio_dbg_lat_hist_show(struct seq_file *m, void *unused)
+{
+    struct sdio_device *chip = m->private;
+
+    sdio_dbg_hist(m, chip->xport->stats.lat_hist);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sdio_dbg_lat_hist);
+
+/* any write starts the counters, the histograms and the pipeline maximum over */
+static ssize_t sdio_dbg_clear_write(struct file *file, const char __user *buf,
+                                    size_t count, loff_t *ppos)
+{
+    struct sdio_device *chip = file->private_data;
+
+    sdio_xport_clear_stats(chip->xport);
+    spin_lock_irq(&chip->cable[0]->lock);
+    chip->tx_queue_max = 0;
+    spin_unlock_irq(&chip->cable[0]->lock);
+    return count;
+}
+
+static const struct file_operations sdio_dbg_clear_fops = {
+        .open			= simple_open,
+        .write			= sdio_dbg_clear_write,
+        .llseek			= noop_llseek,
+};
+
+/* nothing depends on it, a card without it only cannot be looked at */
+static void sdio_debugfs_add(struct sdio_device *chip)
+{
+    char name[16];
+
+    if (IS_ERR_OR_NULL(sdio_debugfs_root))
+        return;
+    snprintf(name, sizeof(name), "card%d", chip->card->number);
+    chip->debugfs = debugfs_create_dir(name, sdio_debugfs_root);
+    if (IS_ERR_OR_NULL(chip->debugfs))
+        return;
+    debugfs_create_file("stats", 0444, chip->debugfs, chip, &sdio_dbg_stats_fops);
+    debugfs_create_file("size_hist", 0444, chip->debugfs, chip, &sdio_dbg_size_hist_fops);
+    debugfs_create_file("lat_hist", 0444, chip->debugfs, chip, &sdio_dbg_lat_hist_fops);
+    debugfs_create_file("clear", 0200, chip->debugfs, chip, &sdio_dbg_clear_fops);
 }
+
 // ====================================================================================
-// TODO add alsa stuff
+static void sdio_emu_unregister_all(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(emu_devices); i++)
+        platform_device_unregister(emu_devices[i]);
+    platform_driver_unregister(&sdio_emu_driver);
+}
+
 static int __init sdio_alsa_init_module(void)
 {
-    int ret = 0;
+    int i, ret = 0;
 
     printk(KERN_NOTICE "SDIO init module ...\n");
-    tsk = NULL;
-    kbuf = NULL;
+    sdio_debugfs_root = debugfs_create_dir(MODULE_NAME, NULL);
     ret = sdio_register_driver(&sdio_driver);
-    return ret;
+    if (ret) {
+        debugfs_remove_recursive(sdio_debugfs_root);
+        return ret;
+    }
+    if (!emulate)
+        return 0;
+
+    ret = platform_driver_register(&sdio_emu_driver);
+    if (ret < 0) {
+        sdio_unregister_driver(&sdio_driver);
+        debugfs_remove_recursive(sdio_debugfs_root);
+        return ret;
+    }
+    for (i = 0; i < emulate && i < SNDRV_CARDS; i++)
+    {
+        struct platform_device *device;
+
+        device = platform_device_register_simple(SND_SDIO_EMU_DRIVER, i, NULL, 0);
+        if (IS_ERR(device))
+            continue;
+        if (!platform_get_drvdata(device))
+        {
+            platform_device_unregister(device);
+            continue;
+        }
+        emu_devices[i] = device;
+    }
+    return 0;
 }
 
 static void __exit sdio_alsa_exit_module(void)
 {
     printk(KERN_NOTICE "SDIO exit module ...\n");
-    if (tsk && !IS_ERR(tsk))
-    {
-        pr_err("SDIO : Stop kthread ...\n");
-        kthread_stop(tsk);
-        tsk = NULL;
-    }
+    if (emulate)
+        sdio_emu_unregister_all();
     sdio_unregister_driver(&sdio_driver);
+    debugfs_remove_recursive(sdio_debugfs_root);
 }
 
 module_init(sdio_alsa_init_module);
@@ -0,0 +1,176 @@
+#ifndef SDIO_PLAYBACK_H_
+#define SDIO_PLAYBACK_H_
+/*
+ * Shared by the SDIO FPGA soundcard and its transports
+ */
+#include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+
+#include "sdio_ioctl.h"
+
+#define MODULE_NAME		"snd-sdio"
+#define SDIO_MAJOR		240	/* char device of the first card, +1 for the next ones */
+#define MAX_SDIO_BYTES		(64 * 1024)	/* char device bounce buffer */
+
+#define SDIO_FIFO_ADDR		0x00	/* DAC FIFO in the function 1 address space */
+#define SDIO_IRQ_ACK_ADDR	0x04	/* write 1 to acknowledge the FIFO interrupt */
+#define SDIO_ADC_FIFO_ADDR	0x08	/* ADC FIFO, clocked with the DAC */
+#define SDIO_CAPS_ADDR		0x0c	/* SDIO_CAP_* of the bitstream, read only */
+#define SDIO_WIRE_ADDR		0x10	/* bytes per sample on the wire, before start */
+#define SDIO_TDM_ADDR		0x14	/* slots in a TDM frame, before start */
+#define SDIO_UFLOW_ADDR		0x20	/* DAC underflows since the last read, clears on read */
+#define SDIO_CFG_CTRL_ADDR	0x18	/* write SDIO_CFG_START, read SDIO_CFG_DONE */
+#define SDIO_CFG_FIFO_ADDR	0x1c	/* the bitstream, while configuring */
+#define SDIO_CFG_START		0x01
+#define SDIO_CFG_DONE		0x02
+#define SDIO_CFG_CHUNK		(64 * 1024)	/* bitstream bytes per bounce */
+#define SDIO_CFG_TIMEOUT_MS	500	/* from the last byte to SDIO_CFG_DONE */
+#define SDIO_CAP_PACKED24	0x01	/* takes SDIO_WIRE_ADDR, unpacks 3 byte samples */
+#define SDIO_CAP_TDM		0x02	/* takes SDIO_TDM_ADDR, drives up to SDIO_TDM_SLOTS */
+#define SDIO_CAP_UFLOW		0x04	/* counts underflows at SDIO_UFLOW_ADDR */
+#define SDIO_FIFO_BYTES		16384	/* DAC FIFO depth of the FPGA */
+#define SDIO_FIFO_LOWWATER	8192	/* level at which the FPGA interrupts */
+#define SDIO_BLOCK_SIZE		512
+#define SDIO_MAX_BLOCKS		511	/* per CMD53 in block mode */
+#define SDIO_MAX_BLKSIZE	2048	/* largest block of an SDIO function */
+#define SDIO_TUNE_POINTS	64	/* block sizes times batch lengths measured */
+#define SDIO_TDM_SLOTS		16	/* DAC channels of the widest bitstream */
+#define SDIO_HIST_BUCKETS	24	/* log2, bucket n counts [2^(n-1), 2^n) */
+
+struct scatterlist;
+struct sdio_func;
+struct sdio_xport;
+struct sdio_xport_cmd;
+
+/*
+ * How the driver reaches the FPGA: a real SDIO function, or the emulated
+ * endpoint. start() and stop() are called from the PCM trigger and must not
+ * sleep, write() and read() may. rw_sg() moves whole blocks between the FIFO
+ * and a scatterlist, within max_bytes, max_segs and max_seg_size. duplex()
+ * writes the DAC FIFO and reads the ADC FIFO in one claim of the bus, either
+ * side may be empty; the ADC FIFO is as deep as the DAC one. set_blksize()
+ * changes the block size, and with it max_bytes, while nothing streams.
+ * set_wire() tells the FPGA how wide the samples of the next run are and how
+ * many slots a frame has, only called if caps has SDIO_CAP_PACKED24 or
+ * SDIO_CAP_TDM; older bitstreams know no such thing. load() configures the
+ * FPGA with a bitstream, caps may change with it. batch() runs commands
+ * in one claim of the bus and returns how many ran.
+ *
+ * The FIFO interrupt fires once each time the level falls to low_water while
+ * playing; the first fill after start is up to the driver. The handler may
+ * be called in atomic context.
+ */
+struct sdio_xport_ops
+{
+    const char *name;
+    void (*start)(struct sdio_xport *xp, unsigned int bps);
+    void (*stop)(struct sdio_xport *xp);
+    int (*write)(struct sdio_xport *xp, const void *buf, unsigned int bytes);
+    int (*read)(struct sdio_xport *xp, void *buf, unsigned int bytes);
+    int (*rw_sg)(struct sdio_xport *xp, bool write, struct scatterlist *sg,
+                 unsigned int nents, unsigned int bytes);
+    int (*duplex)(struct sdio_xport *xp, const void *out, unsigned int out_bytes,
+                  void *in, unsigned int in_bytes);
+    int (*set_blksize)(struct sdio_xport *xp, unsigned int blksize);
+    int (*set_wire)(struct sdio_xport *xp, unsigned int width, unsigned int slots);
+    int (*load)(struct sdio_xport *xp, const u8 *data, size_t size);
+    int (*batch)(struct sdio_xport *xp, struct sdio_xport_cmd *cmd, unsigned int count,
+                 bool stop);
+    int (*irq_enable)(struct sdio_xport *xp);
+    void (*irq_disable)(struct sdio_xport *xp);
+    void (*release)(struct sdio_xport *xp);
+};
+
+/* updated under sdio_xport.lock, read without it */
+struct sdio_xport_stats
+{
+    u64 bytes_out;
+    u64 bytes_in;
+    u64 transfers;
+    u64 busy_ns;		/* sum of the transfer times */
+    u64 lat_max_ns;		/* longest transfer */
+    u64 stall_ns;		/* writes held back by a full FIFO */
+    u64 sg_bytes;		/* moved without a bounce copy */
+    u64 xfers_out;		/* transfers that wrote */
+    u64 xfers_in;		/* and that read, a duplex one counts in both */
+    u64 err_crc;		/* -EILSEQ from the host */
+    u64 err_timeout;		/* -ETIMEDOUT */
+    u64 lock_ns;		/* waited for the transport lock, our own queue */
+    u64 claim_ns;		/* waited for the host, other functions or the controller */
+    u64 claim_max_ns;
+    u64 size_hist[SDIO_HIST_BUCKETS];	/* bytes per transfer */
+    u64 lat_hist[SDIO_HIST_BUCKETS];	/* us per transfer */
+    /* last, atomic: the FIFO interrupt counts them too, with the host but not the lock */
+    atomic64_t errors;
+    atomic64_t underflows;		/* DAC FIFO ran empty while playing */
+};
+
+struct sdio_xport
+{
+    const struct sdio_xport_ops *ops;
+    struct sdio_func *func;	/* NULL when emulated */
+    unsigned int blksize;
+    unsigned int max_bytes;	/* longest transfer, whole blocks */
+    unsigned int max_segs;	/* scatterlist limits of the host */
+    unsigned int max_seg_size;	/* whole pages, 0 if the host takes none: bounce */
+    unsigned int fifo_bytes;	/* DAC FIFO, whole blocks */
+    unsigned int low_water;
+    unsigned int caps;		/* SDIO_CAP_* */
+    struct mutex lock;		/* one transfer at a time */
+    struct sdio_xport_stats stats;
+    void (*irq_handler)(void *data);
+    void *irq_data;
+    void *owner;		/* the card on the transport */
+    void *priv;
+};
+
+/* a struct sdio_cmd with the data in the kernel */
+struct sdio_xport_cmd
+{
+    unsigned int op;		/* SDIO_OP_* */
+    unsigned int addr;
+    unsigned int val;
+    unsigned int mask;
+    unsigned int want;
+    unsigned int len;
+    void *buf;			/* kmalloc'ed, len */
+    int result;
+};
+
+/* one configuration measured by sdio_xport_calibrate() */
+struct sdio_tune_point
+{
+    unsigned int blksize;
+    unsigned int blocks;	/* per transfer */
+    unsigned int kBps;
+    unsigned int lat_us;	/* mean transfer time */
+};
+
+struct sdio_xport *sdio_func_xport_new(struct sdio_func *func);
+struct sdio_xport *sdio_emu_xport_new(void);
+void sdio_xport_free(struct sdio_xport *xp);
+void sdio_xport_clear_stats(struct sdio_xport *xp);
+
+void sdio_xport_start(struct sdio_xport *xp, unsigned int bps);
+void sdio_xport_stop(struct sdio_xport *xp);
+int sdio_xport_write(struct sdio_xport *xp, const void *buf, unsigned int bytes);
+int sdio_xport_read(struct sdio_xport *xp, void *buf, unsigned int bytes);
+int sdio_xport_rw_sg(struct sdio_xport *xp, bool write, struct scatterlist *sg,
+                     unsigned int nents, unsigned int bytes);
+int sdio_xport_duplex(struct sdio_xport *xp, const void *out, unsigned int out_bytes,
+                      void *in, unsigned int in_bytes);
+int sdio_xport_request_irq(struct sdio_xport *xp, void (*handler)(void *data),
+                           void *data);
+void sdio_xport_free_irq(struct sdio_xport *xp);
+int sdio_xport_set_blksize(struct sdio_xport *xp, unsigned int blksize,
+                           unsigned int max_bytes);
+int sdio_xport_set_wire(struct sdio_xport *xp, unsigned int width, unsigned int slots);
+int sdio_xport_load(struct sdio_xport *xp, const u8 *data, size_t size);
+int sdio_xport_batch(struct sdio_xport *xp, struct sdio_xport_cmd *cmd, unsigned int count,
+                     bool stop);
+int sdio_xport_calibrate(struct sdio_xport *xp, struct sdio_tune_point *tab,
+                         unsigned int *count, unsigned int blksize,
+                         unsigned int blocks, unsigned int max_lat_us);
+
+#endif //SDIO_PLAYBACK_H_
@@ -0,0 +1,701 @@
+/*
+ * Basic SDIO FPGA soundcard - transports
+ *
+ * Copyright (c) by Giuliano Gambacorta <ggambacora88@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <linux/kernel.h>
+#include <linux/delay.h>
+#include <linux/errno.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+
+#include <linux/mmc/card.h>
+#include <linux/mmc/core.h>
+#include <linux/mmc/host.h>
+#include <linux/mmc/sdio.h>
+#include <linux/mmc/sdio_func.h>
+
+#include "sdio_playback.h"
+
+// ================================== SDIO FUNCTION ===================================
+/* sdio_claim_host(), timed: another function on the card, or the controller, has it */
+static void sdio_func_claim(struct sdio_xport *xp)
+{
+    u64 t0 = ktime_get_ns(), dt;
+
+    sdio_claim_host(xp->func);
+    dt = ktime_get_ns() - t0;
+    xp->stats.claim_ns += dt;
+    xp->stats.claim_max_ns = max(xp->stats.claim_max_ns, dt);
+}
+
+/*
+ * The FIFO is one register: CMD53 with a fixed address. A block multiple goes
+ * out in block mode, as few commands as the host allows, the rest in byte mode.
+ */
+static int sdio_func_write(struct sdio_xport *xp, const void *buf, unsigned int bytes)
+{
+    int ret;
+
+    sdio_func_claim(xp);
+    ret = sdio_writesb(xp->func, SDIO_FIFO_ADDR, (void *)buf, bytes);
+    sdio_release_host(xp->func);
+    return ret;
+}
+
+static int sdio_func_read(struct sdio_xport *xp, void *buf, unsigned int bytes)
+{
+    int ret;
+
+    sdio_func_claim(xp);
+    ret = sdio_readsb(xp->func, buf, SDIO_FIFO_ADDR, bytes);
+    sdio_release_host(xp->func);
+    return ret;
+}
+
+/* the ADC block right behind the DAC one, with no other user of the bus in between */
+static int sdio_func_duplex(struct sdio_xport *xp, const void *out, unsigned int out_bytes,
+                            void *in, unsigned int in_bytes)
+{
+    int ret = 0;
+
+    sdio_func_claim(xp);
+    if (out_bytes)
+        ret = sdio_writesb(xp->func, SDIO_FIFO_ADDR, (void *)out, out_bytes);
+    if (!ret && in_bytes)
+        ret = sdio_readsb(xp->func, in, SDIO_ADC_FIFO_ADDR, in_bytes);
+    sdio_release_host(xp->func);
+    return ret;
+}
+
+/*
+ * One block-mode CMD53 to the FIFO straight from the scatterlist, as
+ * mmc_io_rw_extended() does it for sdio_writesb() with a single buffer.
+ */
+static int sdio_func_rw_sg(struct sdio_xport *xp, bool write, struct scatterlist *sg,
+                           unsigned int nents, unsigned int bytes)
+{
+    struct sdio_func *func = xp->func;
+    struct mmc_card *card = func->card;
+    struct mmc_request mrq = {};
+    struct mmc_command cmd = {};
+    struct mmc_data data = {};
+    unsigned int blocks = bytes / xp->blksize;
+
+    if (!card->cccr.multi_block || !blocks || bytes % xp->blksize ||
+        bytes > xp->max_bytes || nents > xp->max_segs)
+        return -EINVAL;
+
+    mrq.cmd = &cmd;
+    mrq.data = &data;
+
+    cmd.opcode = SD_IO_RW_EXTENDED;
+    cmd.arg = write ? 0x80000000 : 0x00000000;
+    cmd.arg |= func->num << 28;
+    cmd.arg |= 0x08000000 | blocks;	/* block mode, fixed address */
+    cmd.arg |= SDIO_FIFO_ADDR << 9;
+    cmd.flags = MMC_RSP_SPI_R5 | MMC_RSP_R5 | MMC_CMD_ADTC;
+
+    data.blksz = xp->blksize;
+    data.blocks = blocks;
+    data.flags = write ? MMC_DATA_WRITE : MMC_DATA_READ;
+    data.sg = sg;
+    data.sg_len = nents;
+
+    sdio_func_claim(xp);
+    mmc_set_data_timeout(&data, card);
+    mmc_wait_for_req(card->host, &mrq);
+    sdio_release_host(func);
+
+    if (cmd.error)
+        return cmd.error;
+    if (data.error)
+        return data.error;
+    if (!mmc_host_is_spi(card->host)) {
+        if (cmd.resp[0] & R5_ERROR)
+            return -EIO;
+        if (cmd.resp[0] & R5_FUNCTION_NUMBER)
+            return -EINVAL;
+        if (cmd.resp[0] & R5_OUT_OF_RANGE)
+            return -ERANGE;
+    }
+    return 0;
+}
+
+/* one CMD53, as the host can take it */
+static void sdio_func_limits(struct sdio_xport *xp)
+{
+    struct mmc_host *host = xp->func->card->host;
+    unsigned int blocks;
+
+    xp->blksize = xp->func->cur_blksize;
+    blocks = min3(host->max_blk_count, host->max_req_size / xp->blksize,
+                  (unsigned int)SDIO_MAX_BLOCKS);
+    xp->max_bytes = max(blocks, 1U) * xp->blksize;
+}
+
+static int sdio_func_set_blksize(struct sdio_xport *xp, unsigned int blksize)
+{
+    int ret;
+
+    sdio_claim_host(xp->func);
+    ret = sdio_set_block_size(xp->func, blksize);
+    sdio_release_host(xp->func);
+    if (!ret)
+        sdio_func_limits(xp);
+    return ret;
+}
+
+static int sdio_func_set_wire(struct sdio_xport *xp, unsigned int width, unsigned int slots)
+{
+    int ret = 0;
+
+    sdio_claim_host(xp->func);
+    if (xp->caps & SDIO_CAP_PACKED24)
+        sdio_writeb(xp->func, width, SDIO_WIRE_ADDR, &ret);
+    if (!ret && (xp->caps & SDIO_CAP_TDM))
+        sdio_writeb(xp->func, slots, SDIO_TDM_ADDR, &ret);
+    sdio_release_host(xp->func);
+    return ret;
+}
+
+/* a register until it reads as asked, with the host claimed */
+static int sdio_func_pollb(struct sdio_func *func, struct sdio_xport_cmd *cmd)
+{
+    // not jiffies: a tick may be longer than the whole budget
+    u64 timeout = ktime_get_ns() + (u64)cmd->len * NSEC_PER_USEC;
+    int ret;
+
+    for (;;) {
+        cmd->val = sdio_readb(func, cmd->addr, &ret);
+        if (ret || (cmd->val & cmd->mask) == cmd->want)
+            return ret;
+        if (ktime_get_ns() > timeout)
+            return -ETIMEDOUT;
+        usleep_range(20, 50);
+    }
+}
+
+/*
+ * One claim for the lot: no other function, or card of ours on the host,
+ * gets the bus between two commands.
+ */
+static int sdio_func_batch(struct sdio_xport *xp, struct sdio_xport_cmd *cmd,
+                           unsigned int count, bool stop)
+{
+    struct sdio_func *func = xp->func;
+    unsigned int i;
+
+    sdio_func_claim(xp);
+    for (i = 0; i < count; i++, cmd++) {
+        switch (cmd->op) {
+        case SDIO_OP_READB:
+            cmd->val = sdio_readb(func, cmd->addr, &cmd->result);
+            break;
+        case SDIO_OP_WRITEB:
+            sdio_writeb(func, cmd->val, cmd->addr, &cmd->result);
+            break;
+        case SDIO_OP_READSB:
+            cmd->result = sdio_readsb(func, cmd->buf, cmd->addr, cmd->len);
+            break;
+        case SDIO_OP_WRITESB:
+            cmd->result = sdio_writesb(func, cmd->addr, cmd->buf, cmd->len);
+            break;
+        case SDIO_OP_POLLB:
+            cmd->result = sdio_func_pollb(func, cmd);
+            break;
+        default:
+            cmd->result = -EINVAL;
+            break;
+        }
+        if (cmd->result && stop) {
+            i++;
+            break;
+        }
+    }
+    sdio_release_host(func);
+    return i;
+}
+
+/* what the bitstream can do; one that cannot say can do nothing new */
+static unsigned int sdio_func_caps(struct sdio_func *func)
+{
+    unsigned int caps;
+    int ret;
+
+    sdio_claim_host(func);
+    caps = sdio_readb(func, SDIO_CAPS_ADDR, &ret);
+    sdio_release_host(func);
+    return ret ? 0 : caps;
+}
+
+/*
+ * SDIO_CFG_START, then the bitstream into the config port as fast as the bus
+ * goes: whole blocks in block mode, through a bounce buffer since the image
+ * may be vmalloc'ed, the tail in byte mode. The host stays claimed until the
+ * FPGA says it is done.
+ */
+static int sdio_func_load(struct sdio_xport *xp, const u8 *data, size_t size)
+{
+    unsigned int chunk = min_t(unsigned int, xp->max_bytes, SDIO_CFG_CHUNK), n;
+    unsigned long timeout;
+    void *buf;
+    u8 ctrl;
+    int ret;
+
+    buf = kmalloc(chunk, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    sdio_claim_host(xp->func);
+    sdio_writeb(xp->func, SDIO_CFG_START, SDIO_CFG_CTRL_ADDR, &ret);
+    while (!ret && size) {
+        n = min_t(size_t, size, chunk);
+        memcpy(buf, data, n);
+        ret = sdio_writesb(xp->func, SDIO_CFG_FIFO_ADDR, buf, n);
+        data += n;
+        size -= n;
+    }
+    timeout = jiffies + msecs_to_jiffies(SDIO_CFG_TIMEOUT_MS);
+    while (!ret) {
+        ctrl = sdio_readb(xp->func, SDIO_CFG_CTRL_ADDR, &ret);
+        if (ret || (ctrl & SDIO_CFG_DONE))
+            break;
+        if (time_after(jiffies, timeout))
+            ret = -ETIMEDOUT;
+        else
+            usleep_range(100, 200);
+    }
+    sdio_release_host(xp->func);
+    kfree(buf);
+
+    // what the new bitstream can do
+    if (!ret)
+        xp->caps = sdio_func_caps(xp->func);
+    return ret;
+}
+
+/* in the SDIO irq thread, with the host claimed */
+static void sdio_func_irq(struct sdio_func *func)
+{
+    struct sdio_xport *xp = sdio_get_drvdata(func);
+    u8 uflow;
+    int ret;
+
+    sdio_writeb(func, 1, SDIO_IRQ_ACK_ADDR, &ret);
+    if (ret)
+        atomic64_inc(&xp->stats.errors);
+    // only with irq pacing, a read per transfer would cost a CMD52 each
+    if (xp->caps & SDIO_CAP_UFLOW) {
+        uflow = sdio_readb(func, SDIO_UFLOW_ADDR, &ret);
+        if (ret)
+            atomic64_inc(&xp->stats.errors);
+        else
+            atomic64_add(uflow, &xp->stats.underflows);
+    }
+    if (xp->irq_handler)
+        xp->irq_handler(xp->irq_data);
+}
+
+static int sdio_func_irq_enable(struct sdio_xport *xp)
+{
+    int ret;
+
+    sdio_claim_host(xp->func);
+    ret = sdio_claim_irq(xp->func, sdio_func_irq);
+    sdio_release_host(xp->func);
+    return ret;
+}
+
+static void sdio_func_irq_disable(struct sdio_xport *xp)
+{
+    sdio_claim_host(xp->func);
+    sdio_release_irq(xp->func);
+    sdio_release_host(xp->func);
+}
+
+static const struct sdio_xport_ops sdio_func_ops =
+{
+    .name        = "sdio",
+    .write       = sdio_func_write,
+    .read        = sdio_func_read,
+    .rw_sg       = sdio_func_rw_sg,
+    .duplex      = sdio_func_duplex,
+    .set_blksize = sdio_func_set_blksize,
+    .set_wire    = sdio_func_set_wire,
+    .load        = sdio_func_load,
+    .batch       = sdio_func_batch,
+    .irq_enable  = sdio_func_irq_enable,
+    .irq_disable = sdio_func_irq_disable,
+};
+
+/*
+ * The function is enabled and its block size set by the caller. Its drvdata
+ * is the transport from now on, the card hangs off xp->owner.
+ */
+struct sdio_xport *sdio_func_xport_new(struct sdio_func *func)
+{
+    struct sdio_xport *xp = kzalloc(sizeof(*xp), GFP_KERNEL);
+    struct mmc_host *host = func->card->host;
+
+    if (!xp)
+        return ERR_PTR(-ENOMEM);
+    xp->ops = &sdio_func_ops;
+    xp->func = func;
+    sdio_func_limits(xp);
+    xp->max_segs = host->max_segs;
+    // rw_sg is never given a segment over the host limit
+    xp->max_seg_size = rounddown(host->max_seg_size, PAGE_SIZE);
+    xp->fifo_bytes = SDIO_FIFO_BYTES;
+    xp->low_water = SDIO_FIFO_LOWWATER;
+    xp->caps = sdio_func_caps(func);
+    sdio_set_drvdata(func, xp);
+    mutex_init(&xp->lock);
+    return xp;
+}
+
+// ===================================== COMMON =======================================
+void sdio_xport_free(struct sdio_xport *xp)
+{
+    if (IS_ERR_OR_NULL(xp))
+        return;
+    if (xp->ops->release)
+        xp->ops->release(xp);
+    kfree(xp);
+}
+
+void sdio_xport_start(struct sdio_xport *xp, unsigned int bps)
+{
+    if (xp->ops->start)
+        xp->ops->start(xp, bps);
+}
+
+void sdio_xport_stop(struct sdio_xport *xp)
+{
+    if (xp->ops->stop)
+        xp->ops->stop(xp);
+}
+
+/* so that the histograms and the counters go back to zero together */
+void sdio_xport_clear_stats(struct sdio_xport *xp)
+{
+    mutex_lock(&xp->lock);
+    memset(&xp->stats, 0, offsetof(struct sdio_xport_stats, errors));
+    atomic64_set(&xp->stats.errors, 0);
+    atomic64_set(&xp->stats.underflows, 0);
+    mutex_unlock(&xp->lock);
+}
+
+/* our own queue for the bus: the tx thread, the char device, the autotuner */
+static u64 sdio_xport_lock(struct sdio_xport *xp)
+{
+    u64 t0 = ktime_get_ns(), t1;
+
+    mutex_lock(&xp->lock);
+    t1 = ktime_get_ns();
+    xp->stats.lock_ns += t1 - t0;
+    return t1;
+}
+
+static unsigned int sdio_hist_bucket(u64 v)
+{
+    return min_t(unsigned int, fls64(v), SDIO_HIST_BUCKETS - 1);
+}
+
+static void sdio_xport_account(struct sdio_xport *xp, int ret, u64 t0,
+                               unsigned int out, unsigned int in)
+{
+    u64 dt = ktime_get_ns() - t0;
+
+    xp->stats.transfers++;
+    if (out)
+        xp->stats.xfers_out++;
+    if (in)
+        xp->stats.xfers_in++;
+    if (ret < 0)
+        atomic64_inc(&xp->stats.errors);
+    if (ret == -EILSEQ)
+        xp->stats.err_crc++;
+    if (ret == -ETIMEDOUT)
+        xp->stats.err_timeout++;
+    xp->stats.busy_ns += dt;
+    xp->stats.lat_max_ns = max(xp->stats.lat_max_ns, dt);
+    xp->stats.size_hist[sdio_hist_bucket(out + in)]++;
+    xp->stats.lat_hist[sdio_hist_bucket(div_u64(dt, NSEC_PER_USEC))]++;
+}
+
+int sdio_xport_write(struct sdio_xport *xp, const void *buf, unsigned int bytes)
+{
+    u64 t0;
+    int ret;
+
+    t0 = sdio_xport_lock(xp);
+    ret = xp->ops->write(xp, buf, bytes);
+    sdio_xport_account(xp, ret, t0, bytes, 0);
+    if (!ret)
+        xp->stats.bytes_out += bytes;
+    mutex_unlock(&xp->lock);
+    return ret;
+}
+
+int sdio_xport_request_irq(struct sdio_xport *xp, void (*handler)(void *data),
+                           void *data)
+{
+    int ret;
+
+    if (!xp->ops->irq_enable)
+        return -EOPNOTSUPP;
+    xp->irq_data = data;
+    xp->irq_handler = handler;
+    ret = xp->ops->irq_enable(xp);
+    if (ret)
+        xp->irq_handler = NULL;
+    return ret;
+}
+
+void sdio_xport_free_irq(struct sdio_xport *xp)
+{
+    if (!xp->irq_handler)
+        return;
+    xp->ops->irq_disable(xp);
+    xp->irq_handler = NULL;
+}
+
+int sdio_xport_read(struct sdio_xport *xp, void *buf, unsigned int bytes)
+{
+    u64 t0;
+    int ret;
+
+    t0 = sdio_xport_lock(xp);
+    ret = xp->ops->read(xp, buf, bytes);
+    sdio_xport_account(xp, ret, t0, 0, bytes);
+    if (!ret)
+        xp->stats.bytes_in += bytes;
+    mutex_unlock(&xp->lock);
+    return ret;
+}
+
+int sdio_xport_rw_sg(struct sdio_xport *xp, bool write, struct scatterlist *sg,
+                     unsigned int nents, unsigned int bytes)
+{
+    u64 t0;
+    int ret;
+
+    if (!xp->ops->rw_sg)
+        return -EOPNOTSUPP;
+    t0 = sdio_xport_lock(xp);
+    ret = xp->ops->rw_sg(xp, write, sg, nents, bytes);
+    sdio_xport_account(xp, ret, t0, write ? bytes : 0, write ? 0 : bytes);
+    if (!ret) {
+        if (write)
+            xp->stats.bytes_out += bytes;
+        else
+            xp->stats.bytes_in += bytes;
+        xp->stats.sg_bytes += bytes;
+    }
+    mutex_unlock(&xp->lock);
+    return ret;
+}
+
+int sdio_xport_duplex(struct sdio_xport *xp, const void *out, unsigned int out_bytes,
+                      void *in, unsigned int in_bytes)
+{
+    u64 t0;
+    int ret;
+
+    t0 = sdio_xport_lock(xp);
+    if (xp->ops->duplex) {
+        ret = xp->ops->duplex(xp, out, out_bytes, in, in_bytes);
+    } else {
+        ret = out_bytes ? xp->ops->write(xp, out, out_bytes) : 0;
+        if (!ret && in_bytes)
+            ret = xp->ops->read(xp, in, in_bytes);
+    }
+    sdio_xport_account(xp, ret, t0, out_bytes, in_bytes);
+    if (!ret) {
+        xp->stats.bytes_out += out_bytes;
+        xp->stats.bytes_in += in_bytes;
+    }
+    mutex_unlock(&xp->lock);
+    return ret;
+}
+
+/*
+ * While nothing streams. A non-zero max_bytes caps the transfer to what the
+ * caller's buffers hold.
+ */
+int sdio_xport_set_blksize(struct sdio_xport *xp, unsigned int blksize,
+                           unsigned int max_bytes)
+{
+    int ret;
+
+    if (!xp->ops->set_blksize)
+        return -EOPNOTSUPP;
+    if (!blksize || blksize > SDIO_MAX_BLKSIZE || (max_bytes && blksize > max_bytes))
+        return -EINVAL;
+    mutex_lock(&xp->lock);
+    ret = xp->ops->set_blksize(xp, blksize);
+    if (!ret && max_bytes && xp->max_bytes > max_bytes)
+        xp->max_bytes = rounddown(max_bytes, xp->blksize);
+    mutex_unlock(&xp->lock);
+    return ret;
+}
+
+/*
+ * Before a run. Samples as wide as in the DMA area need nothing from a
+ * bitstream that cannot be told; 3 byte ones need one that unpacks them,
+ * and more than two slots one that drives a TDM frame.
+ */
+int sdio_xport_set_wire(struct sdio_xport *xp, unsigned int width, unsigned int slots)
+{
+    int ret;
+
+    if (width == 3 && !(xp->caps & SDIO_CAP_PACKED24))
+        return -EOPNOTSUPP;
+    if (slots > 2 && !(xp->caps & SDIO_CAP_TDM))
+        return -EOPNOTSUPP;
+    if (!(xp->caps & (SDIO_CAP_PACKED24 | SDIO_CAP_TDM)) || !xp->ops->set_wire)
+        return 0;
+    mutex_lock(&xp->lock);
+    ret = xp->ops->set_wire(xp, width, slots);
+    mutex_unlock(&xp->lock);
+    return ret;
+}
+
+/* before the card is set up, nothing else is on the transport */
+int sdio_xport_load(struct sdio_xport *xp, const u8 *data, size_t size)
+{
+    int ret;
+
+    if (!xp->ops->load)
+        return -EOPNOTSUPP;
+    mutex_lock(&xp->lock);
+    ret = xp->ops->load(xp, data, size);
+    mutex_unlock(&xp->lock);
+    return ret;
+}
+
+/* counted as one transfer, what it took on the bus included */
+int sdio_xport_batch(struct sdio_xport *xp, struct sdio_xport_cmd *cmd, unsigned int count,
+                     bool stop)
+{
+    unsigned int i, out = 0, in = 0;
+    u64 t0;
+    int ret;
+
+    if (!xp->ops->batch)
+        return -EOPNOTSUPP;
+    t0 = sdio_xport_lock(xp);
+    ret = xp->ops->batch(xp, cmd, count, stop);
+    for (i = 0; i < ret; i++) {
+        if (cmd[i].result)
+            continue;
+        if (cmd[i].op == SDIO_OP_WRITESB)
+            out += cmd[i].len;
+        else if (cmd[i].op == SDIO_OP_READSB)
+            in += cmd[i].len;
+    }
+    sdio_xport_account(xp, 0, t0, out, in);
+    xp->stats.bytes_out += out;
+    xp->stats.bytes_in += in;
+    mutex_unlock(&xp->lock);
+    return ret;
+}
+
+// =================================== CALIBRATION ====================================
+#define SDIO_TUNE_BYTES		(128 * 1024)	/* written at each point */
+#define SDIO_TUNE_MAX_XFER	(64 * 1024)	/* longest transfer tried */
+
+static bool sdio_tune_better(const struct sdio_tune_point *a,
+                             const struct sdio_tune_point *b, unsigned int max_lat_us)
+{
+    bool a_ok = a->lat_us <= max_lat_us, b_ok = b->lat_us <= max_lat_us;
+
+    if (a_ok != b_ok)
+        return a_ok;
+    return a_ok ? a->kBps > b->kBps : a->lat_us < b->lat_us;
+}
+
+/*
+ * Times writes of silence to the FIFO for block sizes from 64 bytes up and
+ * power of two batches up to 64 kB; a non-zero blksize or blocks pins that
+ * one instead. Returns the index in tab of the fastest point whose transfers
+ * take no longer than max_lat_us, or of the quickest if none does, and
+ * leaves the transport at its block size with the stats cleared.
+ * Not while streaming.
+ */
+int sdio_xport_calibrate(struct sdio_xport *xp, struct sdio_tune_point *tab,
+                         unsigned int *count, unsigned int blksize,
+                         unsigned int blocks, unsigned int max_lat_us)
+{
+    unsigned int bs_last = blksize ?: SDIO_MAX_BLKSIZE;
+    unsigned int nb_last = min(blocks ?: SDIO_MAX_BLOCKS, (unsigned int)SDIO_MAX_BLOCKS);
+    unsigned int bs, nb, bytes, xfers, done, n = 0, best = 0, i, size;
+    void *buf;
+    u64 t0, ns;
+    int ret = 0;
+
+    // the host maps it page by page with virt_to_page(), so not vmalloc'ed
+    size = blocks ? max(SDIO_TUNE_MAX_XFER, nb_last * bs_last) : SDIO_TUNE_MAX_XFER;
+    size = min_t(unsigned int, size, max_t(unsigned int, xp->max_bytes, SDIO_TUNE_MAX_XFER));
+    buf = kzalloc(size, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    for (bs = blksize ?: 64; bs <= bs_last && n < SDIO_TUNE_POINTS; bs <<= 1) {
+        if (sdio_xport_set_blksize(xp, bs, 0))
+            continue;
+        for (nb = blocks ?: 1; nb <= nb_last && n < SDIO_TUNE_POINTS; nb <<= 1) {
+            bytes = nb * bs;
+            if (bytes > xp->max_bytes || bytes > size)
+                break;
+
+            t0 = ktime_get_ns();
+            for (done = 0, xfers = 0; done < SDIO_TUNE_BYTES || xfers < 4; xfers++) {
+                ret = sdio_xport_write(xp, buf, bytes);
+                if (ret)
+                    break;
+                done += bytes;
+            }
+            ns = max_t(u64, ktime_get_ns() - t0, 1);
+            if (ret) {
+                printk(KERN_WARNING "SDIO: calibration at %u x %u failed: %d\n", nb, bs, ret);
+                continue;
+            }
+
+            tab[n].blksize = bs;
+            tab[n].blocks = nb;
+            tab[n].kBps = div64_u64((u64)done * USEC_PER_SEC, ns);
+            tab[n].lat_us = div_u64(ns, xfers * NSEC_PER_USEC);
+            n++;
+        }
+    }
+    kfree(buf);
+
+    *count = n;
+    if (!n)
+        return ret ?: -EIO;
+    for (i = 1; i < n; i++)
+        if (sdio_tune_better(&tab[i], &tab[best], max_lat_us))
+            best = i;
+    ret = sdio_xport_set_blksize(xp, tab[best].blksize, 0);
+
+    sdio_xport_clear_stats(xp);
+    return ret ?: best;
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# Run fifo_bench over a matrix of rates, formats, period sizes and stream
+# counts, one CSV line per configuration.
+#
+# Load the module with enough cards for the largest stream count first:
+#   insmod snd-fifo.ko enable=1,1,1,1,1,1,1,1
+#
+# Any of the lists below can be overridden from the environment, e.g.
+#   RATES="44100 48000" STREAMS=1 ./bench_matrix.sh > results.csv
+#
+# Exits non zero if any supported configuration had xruns, lost markers or
+# a throughput below MIN_RATIO of the nominal one.
+
+BENCH=${BENCH:-./fifo_bench}
+RATES=${RATES:-"8000 11025 16000 22050 32000 44100 48000 64000 88200 96000 176400 192000"}
+FORMATS=${FORMATS:-"S16_LE S16_BE S24_LE S24_BE S24_3LE S24_3BE S32_LE S32_BE FLOAT_LE FLOAT_BE"}
+PERIODS=${PERIODS:-"64 256 1024 4096 16384 65536 262144 1048576"}
+STREAMS=${STREAMS:-"1 2 4 8"}
+CHANNELS=${CHANNELS:-2}
+DURATION=${DURATION:-3}
+MIN_RATIO=${MIN_RATIO:-0.95}
+
+CARDS=$(sed -n 's/^ *\([0-9]*\) .* - snd_fifo$/\1/p' /proc/asound/cards)
+NR_CARDS=$(echo $CARDS | wc -w)
+if [ "$NR_CARDS" -eq 0 ]; then
+	echo "no snd-fifo card found" >&2
+	exit 1
+fi
+
+MAJOR=$(sed -n 's/^ *\([0-9]*\) fifo-soundcard$/\1/p' /proc/devices)
+if [ -z "$MAJOR" ]; then
+	echo "fifo-soundcard char device not registered" >&2
+	exit 1
+fi
+minor=0
+for card in $CARDS; do
+	[ -e /dev/fifo-soundcard$minor ] || mknod /dev/fifo-soundcard$minor c $MAJOR $minor
+	minor=$((minor + 1))
+done
+
+failed=0
+$BENCH -H
+for streams in $STREAMS; do
+	if [ "$streams" -gt "$NR_CARDS" ]; then
+		echo "skipping $streams streams, only $NR_CARDS cards" >&2
+		continue
+	fi
+	list=$(echo $CARDS | tr ' ' '\n' | head -n $streams | paste -s -d, -)
+	for rate in $RATES; do
+	for format in $FORMATS; do
+	for period in $PERIODS; do
+		line=$($BENCH -C $list -r $rate -f $format -c $CHANNELS -p $period \
+			-t $DURATION -o csv)
+		ret=$?
+		[ $ret -eq 2 ] && continue
+		echo "$line"
+		ok=$(echo "$line" | awk -F, -v min=$MIN_RATIO \
+			'{ print ($7 > 0 && $6 / $7 >= min) ? 1 : 0 }')
+		if [ $ret -ne 0 ] || [ "$ok" != 1 ]; then
+			echo "FAIL rate=$rate format=$format period=$period streams=$streams" >&2
+			failed=1
+		fi
+	done
+	done
+	done
+done
+
+exit $failed
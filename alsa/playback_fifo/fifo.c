@@ -25,19 +25,31 @@
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/platform_device.h>
-#include <linux/jiffies.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>    /* mul_u64_u32_div() */
 #include <linux/fs.h> 	     /* file stuff */
 #include <linux/kernel.h>    /* printk() */
 #include <linux/errno.h>     /* error codes */
 #include <linux/cdev.h>      /* char device stuff */
 #include <linux/uaccess.h>  /* copy_to_user() */
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
 
 #include <sound/core.h>
 #include <sound/control.h>
 #include <sound/pcm.h>
 #include <sound/initval.h>
 
+#include "fifo.h"
+#include "fifo_engine.h"
+
 MODULE_AUTHOR("Giuliano Gambacorta");
 MODULE_DESCRIPTION("FIFO sound card");
 MODULE_LICENSE("GPL");
@@ -45,75 +57,392 @@ MODULE_SUPPORTED_DEVICE("{{ALSA, FIFO PLAYBACK}}");
 
 #define SND_FIFO_DRIVER	"snd_fifo"
 
-#define byte_pos(x)	((x) / HZ)
-#define frac_pos(x)	((x) * HZ)
 #define MAX_PCM_SUBSTREAMS	8
+#define MAX_PCM_CHANNELS	32
+#define FIFO_RING_BUFFERS	2	/* ring size in alsa buffers, a power of 2 */
+#define FIFO_PRIME_NS		(500 * NSEC_PER_USEC)	/* first clock pass after start */
 
 static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;	/* Index 0-MAX */
 static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;	/* ID for this card */
 static int enable[SNDRV_CARDS] = {1, [1 ... (SNDRV_CARDS - 1)] = 0};
-
-static struct platform_device *device;
-
-struct fifo_snd_device
-{
-    spinlock_t lock;
-    unsigned int pcm_rate_shift;	/* rate shift value */
-    struct snd_card *card;
-    struct snd_pcm *pcm;
-    /* copied from struct loopback: */
-    struct mutex cable_lock;
-    /* copied from struct loopback_cable: */
-    /* PCM parameters */
-    unsigned int pcm_period_size;
-    unsigned int pcm_bps;		/* bytes per second */
-    unsigned int pcm_salign;	/* bytes per sample * channels */
-    /* flags */
-    unsigned int valid;
-    unsigned int running;
-    unsigned int period_update_pending :1;
-    /* timer stuff */
-    unsigned int irq_pos;		/* fractional IRQ position */
-    unsigned int period_size_frac;
-    unsigned long last_jiffies;
-    struct timer_list timer;
-    /* copied from struct loopback_pcm: */
-    struct snd_pcm_substream *substream;
-    unsigned int pcm_buffer_size;
-    unsigned int buf_pos;	/* position in buffer */
-    unsigned int silent_size;
-    /* added for waveform: */
+static bool planar;
+static bool direct;
+static unsigned int clock_slack_us = 250;
+static unsigned int pool_buffers = 4;
+static unsigned int pool_prealloc_kb = 64;
+
+module_param_array(index, int, NULL, 0444);
+MODULE_PARM_DESC(index, "Index value for fifo soundcard.");
+module_param_array(id, charp, NULL, 0444);
+MODULE_PARM_DESC(id, "ID string for fifo soundcard.");
+module_param_array(enable, int, NULL, 0444);
+MODULE_PARM_DESC(enable, "Enable this fifo soundcard.");
+module_param(planar, bool, 0444);
+MODULE_PARM_DESC(planar, "Store the char device ring one channel after the other.");
+module_param(direct, bool, 0444);
+MODULE_PARM_DESC(direct, "Write PCM data straight into the char device ring, without mmap support.");
+module_param(clock_slack_us, uint, 0644);
+MODULE_PARM_DESC(clock_slack_us, "Serve period ends this close to each other in one clock wakeup.");
+module_param(pool_buffers, uint, 0644);
+MODULE_PARM_DESC(pool_buffers, "PCM buffers kept per card after hw_free for the next streams.");
+module_param(pool_prealloc_kb, uint, 0444);
+MODULE_PARM_DESC(pool_prealloc_kb, "Size of the PCM buffer put in the pool at probe.");
+
+static struct platform_device *devices[SNDRV_CARDS];
+
+/* one clock paces every running stream of every card */
+static struct hrtimer fifo_clock;
+static LIST_HEAD(fifo_clock_list);
+static DEFINE_SPINLOCK(fifo_clock_lock);
+
+/* PCM buffer, parked in fifo_snd_device.pool when no stream uses it */
+struct fifo_pool_buf
+{
+    struct list_head list;
+    struct snd_dma_buffer dmab;
 };
 
 static int device_file_major_number = 0;
-static const char   g_s_Hello_World_string[] = "Hello, world, from kernel mode!\n\0";
-static char *memory_buffer;
-static const ssize_t g_s_Hello_World_size = sizeof(g_s_Hello_World_string);
+static struct fifo_snd_device *fifo_chardevs[SNDRV_CARDS];	/* by minor */
 
 
 //====================================== CHAR DEVICE ======================================
-//TODO check if possible to let dimension correspond to alsa buffer size
+/*
+ * Copy frames [tail, tail + frames) of the ring to userspace. In planar mode
+ * the output holds all the samples of channel 0, then those of channel 1...
+ */
+static int fifo_ring_copy_to_user(struct fifo_snd_device *dev,
+                                  char __user *buf,
+                                  unsigned long tail,
+                                  unsigned int frames)
+{
+    unsigned int width = dev->ring_width;
+    unsigned int frame_bytes = width * dev->ring_channels;
+    unsigned int pos = tail % dev->ring_frames;
+    unsigned int n1 = min(frames, dev->ring_frames - pos);
+    unsigned int n2 = frames - n1;
+    unsigned int c;
+
+    if (!dev->ring_planar) {
+        if (copy_to_user(buf, dev->ring + pos * frame_bytes, n1 * frame_bytes))
+            return -EFAULT;
+        if (n2 && copy_to_user(buf + n1 * frame_bytes, dev->ring, n2 * frame_bytes))
+            return -EFAULT;
+        return 0;
+    }
+
+    for (c = 0; c < dev->ring_channels; c++) {
+        char *region = dev->ring + c * dev->ring_frames * width;
+        char __user *dst = buf + c * frames * width;
+
+        if (copy_to_user(dst, region + pos * width, n1 * width))
+            return -EFAULT;
+        if (n2 && copy_to_user(dst + n1 * width, region, n2 * width))
+            return -EFAULT;
+    }
+    return 0;
+}
+
 static ssize_t device_file_read (struct file *file_ptr,
                                  char __user *user_buffer,
                                 size_t count,
                                 loff_t *position)
 {
-    int dimension = sizeof(memory_buffer);
+    struct fifo_snd_device *dev = file_ptr->private_data;
+    unsigned long flags, head, tail;
+    unsigned int frames;
+    ssize_t ret;
+
+    if (dev->ring_head == dev->ring_tail) {
+        if (file_ptr->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(dev->ring_wait,
+                                       dev->ring_head != dev->ring_tail);
+        if (ret)
+            return ret;
+    }
+
+    mutex_lock(&dev->cable_lock);
+    if (!dev->ring) {
+        mutex_unlock(&dev->cable_lock);
+        return 0;
+    }
+
+    spin_lock_irqsave(&dev->lock, flags);
+    head = dev->ring_head;
+    tail = dev->ring_tail;
+    /* the reader fell behind: drop what has been overwritten */
+    if (head - tail > dev->ring_window)
+        tail = head - dev->ring_window;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    frames = min_t(unsigned long, head - tail,
+                   count / (dev->ring_width * dev->ring_channels));
+    ret = fifo_ring_copy_to_user(dev, user_buffer, tail, frames);
+    if (!ret) {
+        spin_lock_irqsave(&dev->lock, flags);
+        dev->ring_tail = tail + frames;
+        spin_unlock_irqrestore(&dev->lock, flags);
+        ret = frames * dev->ring_width * dev->ring_channels;
+    }
+    mutex_unlock(&dev->cable_lock);
+
+    return ret;
+}
+
+// exported ring: the pages are referenced by the dma-buf, so they outlive a
+// reallocation of the ring; importers notice it from fifo_ctrl.generation
+struct fifo_dmabuf {
+    struct page **pages;
+    unsigned int nr_pages;
+};
+
+static struct sg_table *fifo_dmabuf_map(struct dma_buf_attachment *attach,
+                                        enum dma_data_direction dir)
+{
+    struct fifo_dmabuf *buf = attach->dmabuf->priv;
+    struct sg_table *sgt;
+    int ret;
+
+    sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+    if (!sgt)
+        return ERR_PTR(-ENOMEM);
+
+    ret = sg_alloc_table_from_pages(sgt, buf->pages, buf->nr_pages, 0,
+                                    (unsigned long)buf->nr_pages << PAGE_SHIFT,
+                                    GFP_KERNEL);
+    if (ret < 0)
+        goto __free;
+
+    if (!dma_map_sg(attach->dev, sgt->sgl, sgt->nents, dir)) {
+        ret = -ENOMEM;
+        sg_free_table(sgt);
+        goto __free;
+    }
+    return sgt;
+
+__free:
+    kfree(sgt);
+    return ERR_PTR(ret);
+}
+
+static void fifo_dmabuf_unmap(struct dma_buf_attachment *attach,
+                              struct sg_table *sgt,
+                              enum dma_data_direction dir)
+{
+    dma_unmap_sg(attach->dev, sgt->sgl, sgt->nents, dir);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static void fifo_dmabuf_free(struct fifo_dmabuf *buf)
+{
+    unsigned int i;
+
+    for (i = 0; i < buf->nr_pages; i++)
+        put_page(buf->pages[i]);
+    kfree(buf->pages);
+    kfree(buf);
+}
+
+static void fifo_dmabuf_release(struct dma_buf *dmabuf)
+{
+    fifo_dmabuf_free(dmabuf->priv);
+}
+
+static void *fifo_dmabuf_kmap(struct dma_buf *dmabuf, unsigned long page_num)
+{
+    struct fifo_dmabuf *buf = dmabuf->priv;
+
+    return kmap(buf->pages[page_num]);
+}
+
+static void fifo_dmabuf_kunmap(struct dma_buf *dmabuf, unsigned long page_num,
+                               void *addr)
+{
+    struct fifo_dmabuf *buf = dmabuf->priv;
+
+    kunmap(buf->pages[page_num]);
+}
+
+static void *fifo_dmabuf_vmap(struct dma_buf *dmabuf)
+{
+    struct fifo_dmabuf *buf = dmabuf->priv;
+
+    return vmap(buf->pages, buf->nr_pages, VM_MAP, PAGE_KERNEL);
+}
+
+static void fifo_dmabuf_vunmap(struct dma_buf *dmabuf, void *vaddr)
+{
+    vunmap(vaddr);
+}
+
+static int fifo_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    struct fifo_dmabuf *buf = dmabuf->priv;
+    unsigned long addr = vma->vm_start;
+    unsigned long i = vma->vm_pgoff;
+    int ret;
+
+    if (vma_pages(vma) + vma->vm_pgoff > buf->nr_pages)
+        return -EINVAL;
+
+    for (; addr < vma->vm_end; addr += PAGE_SIZE, i++) {
+        ret = vm_insert_page(vma, addr, buf->pages[i]);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+static const struct dma_buf_ops fifo_dmabuf_ops = {
+    .map_dma_buf   = fifo_dmabuf_map,
+    .unmap_dma_buf = fifo_dmabuf_unmap,
+    .release       = fifo_dmabuf_release,
+    .map           = fifo_dmabuf_kmap,
+    .unmap         = fifo_dmabuf_kunmap,
+    .vmap          = fifo_dmabuf_vmap,
+    .vunmap        = fifo_dmabuf_vunmap,
+    .mmap          = fifo_dmabuf_mmap,
+};
+
+static int fifo_export_dmabuf(struct fifo_snd_device *dev,
+                              struct fifo_export *exp)
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct fifo_dmabuf *buf;
+    struct dma_buf *dmabuf;
+    unsigned int i;
+    int ret;
+
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    mutex_lock(&dev->cable_lock);
+    if (!dev->ring) {
+        /* nothing to export before the stream is prepared */
+        ret = -EINVAL;
+        goto __unlock;
+    }
+
+    buf->nr_pages = 1 + PAGE_ALIGN(dev->ring_frames * dev->ring_width *
+                                   dev->ring_channels) / PAGE_SIZE;
+    buf->pages = kcalloc(buf->nr_pages, sizeof(*buf->pages), GFP_KERNEL);
+    if (!buf->pages) {
+        ret = -ENOMEM;
+        goto __unlock;
+    }
+
+    buf->pages[0] = dev->ctrl_page;
+    for (i = 1; i < buf->nr_pages; i++)
+        buf->pages[i] = vmalloc_to_page(dev->ring + (i - 1) * PAGE_SIZE);
+    for (i = 0; i < buf->nr_pages; i++)
+        get_page(buf->pages[i]);
+    mutex_unlock(&dev->cable_lock);
+
+    exp_info.ops = &fifo_dmabuf_ops;
+    exp_info.size = (size_t)buf->nr_pages << PAGE_SHIFT;
+    exp_info.flags = O_RDWR;
+    exp_info.priv = buf;
+
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf)) {
+        fifo_dmabuf_free(buf);
+        return PTR_ERR(dmabuf);
+    }
 
-    printk(KERN_NOTICE "fifo_sound: device file is read at offset = %i, read bytes count = %u",
-    (int)*position,
-    (unsigned int)count);
+    /* from now on the dma-buf owns buf */
+    ret = dma_buf_fd(dmabuf, exp->flags & O_CLOEXEC);
+    if (ret < 0) {
+        dma_buf_put(dmabuf);
+        return ret;
+    }
+
+    exp->fd = ret;
+    exp->size = exp_info.size;
+    exp->ring_offset = PAGE_SIZE;
+    return 0;
 
-    if (copy_to_user(user_buffer, memory_buffer, dimension) != 0)
-        return -EFAULT;
+__unlock:
+    mutex_unlock(&dev->cable_lock);
+    kfree(buf);
+    return ret;
+}
 
-    memset(memory_buffer, 0, dimension);
-    return count;
+static long device_file_ioctl(struct file *file_ptr,
+                              unsigned int cmd,
+                              unsigned long arg)
+{
+    struct fifo_snd_device *dev = file_ptr->private_data;
+    void __user *argp = (void __user *)arg;
+    struct fifo_export exp;
+    struct fifo_wait wait;
+    long ret;
+
+    switch (cmd) {
+        case FIFO_IOC_EXPORT:
+            if (copy_from_user(&exp, argp, sizeof(exp)))
+                return -EFAULT;
+            ret = fifo_export_dmabuf(dev, &exp);
+            if (ret < 0)
+                return ret;
+            if (copy_to_user(argp, &exp, sizeof(exp)))
+                return -EFAULT;
+            return 0;
+        case FIFO_IOC_WAIT:
+            if (copy_from_user(&wait, argp, sizeof(wait)))
+                return -EFAULT;
+            if (wait.timeout_ms) {
+                ret = wait_event_interruptible_timeout(dev->ring_wait,
+                        READ_ONCE(dev->ctrl->seq) != wait.seq,
+                        msecs_to_jiffies(wait.timeout_ms));
+                if (!ret)
+                    return -ETIMEDOUT;
+            } else {
+                ret = wait_event_interruptible(dev->ring_wait,
+                        READ_ONCE(dev->ctrl->seq) != wait.seq);
+            }
+            if (ret < 0)
+                return ret;
+            wait.seq = READ_ONCE(dev->ctrl->seq);
+            if (copy_to_user(argp, &wait, sizeof(wait)))
+                return -EFAULT;
+            return 0;
+        default:
+            return -ENOTTY;
+    }
+}
+
+static __poll_t device_file_poll(struct file *file_ptr, poll_table *wait)
+{
+    struct fifo_snd_device *dev = file_ptr->private_data;
+
+    poll_wait(file_ptr, &dev->ring_wait, wait);
+    if (READ_ONCE(dev->ring_head) != READ_ONCE(dev->ring_tail))
+        return EPOLLIN | EPOLLRDNORM;
+    return 0;
+}
+
+// the minor number is the index of the card
+static int device_file_open(struct inode *inode, struct file *file_ptr)
+{
+    unsigned int minor = iminor(inode);
+
+    if (minor >= SNDRV_CARDS || !fifo_chardevs[minor])
+        return -ENODEV;
+
+    file_ptr->private_data = fifo_chardevs[minor];
+    return 0;
 }
 
 static struct file_operations simple_driver_fops = {
         .owner = THIS_MODULE,
+        .open = device_file_open,
         .read = device_file_read,
+        .poll = device_file_poll,
+        .unlocked_ioctl = device_file_ioctl,
+        .compat_ioctl = device_file_ioctl,
 };
 
 // ============================ FUNCTION DECLARATIONS =================================
@@ -123,9 +452,18 @@ static int fifo_pcm_close(struct snd_pcm_substream *ss);
 static int fifo_pcm_prepare(struct snd_pcm_substream *ss);
 static int fifo_trigger(struct snd_pcm_substream *substream, int cmd);
 static snd_pcm_uframes_t fifo_pointer(struct snd_pcm_substream *substream);
-static void copy_play_buf(struct fifo_snd_device *play, unsigned int bytes);
-static void fifo_xfer_buf(struct fifo_snd_device *dev, unsigned int count);
-static unsigned fifo_pos_update(struct fifo_snd_device *cable);
+static int fifo_get_time_info(struct snd_pcm_substream *substream,
+                              struct timespec *system_ts, struct timespec *audio_ts,
+                              struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+                              struct snd_pcm_audio_tstamp_report *audio_tstamp_report);
+static int fifo_copy_user(struct snd_pcm_substream *ss, int channel,
+                          unsigned long pos, void __user *buf,
+                          unsigned long bytes);
+static int fifo_copy_kernel(struct snd_pcm_substream *ss, int channel,
+                            unsigned long pos, void *buf,
+                            unsigned long bytes);
+static int fifo_fill_silence(struct snd_pcm_substream *ss, int channel,
+                             unsigned long pos, unsigned long bytes);
 
 static int fifo_hw_params(struct snd_pcm_substream *ss,
                           struct snd_pcm_hw_params *hw_params);
@@ -142,8 +480,8 @@ static void __exit alsa_card_fifo_exit(void);
 static int fifo_probe(struct platform_device *devptr);
 static int fifo_remove(struct platform_device *devptr);
 
-static void fifo_timer_function(struct timer_list *t);
-static void fifo_timer_start(struct fifo_snd_device *dpcm);
+static enum hrtimer_restart fifo_clock_function(struct hrtimer *t);
+static void fifo_timer_start(struct fifo_snd_device *dpcm, u64 next_ns);
 static inline void fifo_timer_stop(struct fifo_snd_device *dpcm);
 static inline void fifo_timer_stop_sync(struct fifo_snd_device *dpcm);
 
@@ -152,8 +490,10 @@ static struct snd_pcm_hardware fifo_pcm_hw =
 {
 	.info = (SNDRV_PCM_INFO_MMAP |
 			 SNDRV_PCM_INFO_INTERLEAVED |
+			 SNDRV_PCM_INFO_NONINTERLEAVED |
 			 SNDRV_PCM_INFO_BLOCK_TRANSFER |
-			 SNDRV_PCM_INFO_MMAP_VALID),
+			 SNDRV_PCM_INFO_MMAP_VALID |
+			 SNDRV_PCM_INFO_HAS_LINK_ATIME),
 	.formats          = (SNDRV_PCM_FMTBIT_S16_LE | SNDRV_PCM_FMTBIT_S16_BE |
 	                     SNDRV_PCM_FMTBIT_S24_LE | SNDRV_PCM_FMTBIT_S24_BE |
                          SNDRV_PCM_FMTBIT_S24_3LE | SNDRV_PCM_FMTBIT_S24_3BE |
@@ -163,7 +503,7 @@ static struct snd_pcm_hardware fifo_pcm_hw =
 	.rate_min         = 8000,
 	.rate_max         = 192000,
 	.channels_min     = 1,
-	.channels_max     = 2,
+	.channels_max     = MAX_PCM_CHANNELS,
 	.buffer_bytes_max =	2 * 1024 * 1024,
 	.period_bytes_min =	64,
 	.period_bytes_max =	1024 * 1024,
@@ -182,6 +522,38 @@ static struct snd_pcm_ops fifo_pcm_playback_ops =
 	.prepare   = fifo_pcm_prepare,
 	.trigger   = fifo_trigger,
 	.pointer   = fifo_pointer,
+	.get_time_info = fifo_get_time_info,
+};
+
+// same, with the writes going to the ring instead of a DMA area
+static struct snd_pcm_ops fifo_pcm_direct_ops =
+{
+	.open         = fifo_pcm_open,
+	.close        = fifo_pcm_close,
+	.ioctl        = snd_pcm_lib_ioctl,
+	.hw_params    = fifo_hw_params,
+	.hw_free      = fifo_hw_free,
+	.prepare      = fifo_pcm_prepare,
+	.trigger      = fifo_trigger,
+	.pointer      = fifo_pointer,
+	.get_time_info = fifo_get_time_info,
+	.copy_user    = fifo_copy_user,
+	.copy_kernel  = fifo_copy_kernel,
+	.fill_silence = fifo_fill_silence,
+};
+
+// monitor tap, the clock copies the playback to it
+static struct snd_pcm_ops fifo_pcm_capture_ops =
+{
+	.open      = fifo_pcm_open,
+	.close     = fifo_pcm_close,
+	.ioctl     = snd_pcm_lib_ioctl,
+	.hw_params = fifo_hw_params,
+	.hw_free   = fifo_hw_free,
+	.prepare   = fifo_pcm_prepare,
+	.trigger   = fifo_trigger,
+	.pointer   = fifo_pointer,
+	.get_time_info = fifo_get_time_info,
 };
 
 // specifies what func is called @ snd_card_free
@@ -204,70 +576,158 @@ static struct platform_driver fifo_driver =
 };
 
 // ======================= PCM PLAYBACK OPERATIONS ====================================
-static void fifo_timer_function(struct timer_list *t)
+/*
+ * Wake up at the first period end, delayed up to clock_slack_us to catch the
+ * other period ends that follow closely. Called with fifo_clock_lock held.
+ */
+static void fifo_clock_program(void)
 {
-    struct fifo_snd_device *dpcm = from_timer(dpcm, t, timer);
-    unsigned long flags;
+    struct fifo_snd_device *dpcm;
+    u64 first = U64_MAX, target;
 
-    spin_lock_irqsave(&dpcm->lock, flags);
-    if (fifo_pos_update(dpcm) & (1 << dpcm->substream->stream)) {
-        fifo_timer_start(dpcm);
-        if (dpcm->period_update_pending) {
+    list_for_each_entry(dpcm, &fifo_clock_list, clock_list)
+        first = min(first, dpcm->next_ns);
+    if (first == U64_MAX)
+        return;
+
+    target = first;
+    list_for_each_entry(dpcm, &fifo_clock_list, clock_list)
+        if (dpcm->next_ns > target &&
+            dpcm->next_ns - first <= (u64)clock_slack_us * NSEC_PER_USEC)
+            target = dpcm->next_ns;
+
+    hrtimer_start(&fifo_clock, ns_to_ktime(target), HRTIMER_MODE_ABS_SOFT);
+}
+
+static enum hrtimer_restart fifo_clock_function(struct hrtimer *t)
+{
+    struct fifo_snd_device *dpcm, *tmp;
+    u64 now = ktime_get_ns();
+    LIST_HEAD(elapsed);
+
+    spin_lock(&fifo_clock_lock);
+    list_for_each_entry(dpcm, &fifo_clock_list, clock_list) {
+        unsigned int running;
+
+        spin_lock(&dpcm->lock);
+        running = fifo_pos_update(dpcm, now);
+        dpcm->elapsed = 0;
+        if ((running & CABLE_PLAYBACK) && dpcm->period_update_pending) {
             dpcm->period_update_pending = 0;
-            spin_unlock_irqrestore(&dpcm->lock, flags);
-            /* need to unlock before calling below */
-            snd_pcm_period_elapsed(dpcm->substream);
-            return;
+            dpcm->elapsed |= CABLE_PLAYBACK;
+        }
+        if ((running & CABLE_CAPTURE) && dpcm->tap.period_update_pending) {
+            dpcm->tap.period_update_pending = 0;
+            dpcm->elapsed |= CABLE_CAPTURE;
         }
+        if (dpcm->elapsed)
+            list_add_tail(&dpcm->elapsed_list, &elapsed);
+        dpcm->next_ns = fifo_next_period_ns(dpcm);
+        spin_unlock(&dpcm->lock);
     }
-    spin_unlock_irqrestore(&dpcm->lock, flags);
+    fifo_clock_program();
+    spin_unlock(&fifo_clock_lock);
+
+    /* need to unlock before calling below */
+    list_for_each_entry_safe(dpcm, tmp, &elapsed, elapsed_list) {
+        list_del(&dpcm->elapsed_list);
+        if (dpcm->elapsed & CABLE_PLAYBACK)
+            snd_pcm_period_elapsed(dpcm->substream);
+        if (dpcm->elapsed & CABLE_CAPTURE)
+            snd_pcm_period_elapsed(dpcm->tap.substream);
+    }
+    return HRTIMER_NORESTART;
 }
 
-static void fifo_timer_start(struct fifo_snd_device *dpcm)
+/*
+ * Put the device on the clock, or bring its next wakeup forward when a
+ * second stream joins it.
+ */
+static void fifo_timer_start(struct fifo_snd_device *dpcm, u64 next_ns)
 {
-    unsigned long tick;
-    unsigned int rate_shift = dpcm->pcm_rate_shift;//get_rate_shift(dpcm);
+    unsigned long flags;
 
-    if (rate_shift != dpcm->pcm_rate_shift) {
-        dpcm->pcm_rate_shift = rate_shift;
-        dpcm->period_size_frac = frac_pos(dpcm->pcm_period_size);
-    }
-    if (dpcm->period_size_frac <= dpcm->irq_pos) {
-        dpcm->irq_pos %= dpcm->period_size_frac;
-        dpcm->period_update_pending = 1;
+    spin_lock_irqsave(&fifo_clock_lock, flags);
+    if (list_empty(&dpcm->clock_list)) {
+        dpcm->next_ns = next_ns;
+        list_add_tail(&dpcm->clock_list, &fifo_clock_list);
+    } else {
+        dpcm->next_ns = min(dpcm->next_ns, next_ns);
     }
-    tick = dpcm->period_size_frac - dpcm->irq_pos;
-    tick = (tick + dpcm->pcm_bps - 1) / dpcm->pcm_bps;
-    mod_timer(&dpcm->timer, jiffies + tick);
+    fifo_clock_program();
+    spin_unlock_irqrestore(&fifo_clock_lock, flags);
 }
 
 static inline void fifo_timer_stop(struct fifo_snd_device *dpcm)
 {
-    del_timer(&dpcm->timer);
-    dpcm->timer.expires = 0;
+    unsigned long flags;
+
+    spin_lock_irqsave(&fifo_clock_lock, flags);
+    list_del_init(&dpcm->clock_list);
+    spin_unlock_irqrestore(&fifo_clock_lock, flags);
 }
 
+/*
+ * Also wait for a clock pass that may still be using dpcm, periods elapsed
+ * included. The clock is shared, so it is re-armed for the streams that keep
+ * running; dpcm stays on it while its other stream runs.
+ */
 static inline void fifo_timer_stop_sync(struct fifo_snd_device *dpcm)
 {
-    del_timer_sync(&dpcm->timer);
+    unsigned long flags;
+
+    spin_lock_irqsave(&fifo_clock_lock, flags);
+    spin_lock(&dpcm->lock);
+    if (!dpcm->running)
+        list_del_init(&dpcm->clock_list);
+    spin_unlock(&dpcm->lock);
+    spin_unlock_irqrestore(&fifo_clock_lock, flags);
+    hrtimer_cancel(&fifo_clock);
+
+    spin_lock_irqsave(&fifo_clock_lock, flags);
+    fifo_clock_program();
+    spin_unlock_irqrestore(&fifo_clock_lock, flags);
 }
 
 static int fifo_trigger(struct snd_pcm_substream *substream, int cmd)
 {
     struct fifo_snd_device *dev = substream->private_data;
+    unsigned int stream = 1 << substream->stream;
+    unsigned int running;
+    u64 next_ns, prime;
+
     switch (cmd)
     {
         case SNDRV_PCM_TRIGGER_START:
+            spin_lock(&dev->lock);
             if (!dev->running)
             {
-                dev->last_jiffies = jiffies;
-                fifo_timer_start(dev);
+                dev->start_ns = ktime_get_ns();
+                dev->played = 0;
+                /* a first pass soon after start gets the first frames to
+                 * the ring without waiting for the end of the first period */
+                prime = dev->start_ns + FIFO_PRIME_NS;
+            } else {
+                /* the other stream runs, join its clock where it is now */
+                fifo_pos_update(dev, ktime_get_ns());
+                prime = U64_MAX;
             }
-            dev->running |= (1 << substream->stream);
+            /* in phase with played, so both streams complete the same frames */
+            if (stream == CABLE_CAPTURE)
+                dev->tap.buf_pos = dev->tap.irq_pos = dev->played % dev->pcm_salign;
+            else
+                dev->buf_pos = dev->irq_pos = dev->played % dev->pcm_salign;
+            dev->running |= stream;
+            next_ns = min(fifo_next_period_ns(dev), prime);
+            spin_unlock(&dev->lock);
+            fifo_timer_start(dev, next_ns);
             break;
         case SNDRV_PCM_TRIGGER_STOP:
-            dev->running &= ~(1 << substream->stream);
-            if (!dev->running)
+            spin_lock(&dev->lock);
+            dev->running &= ~stream;
+            running = dev->running;
+            spin_unlock(&dev->lock);
+            if (!running)
                 fifo_timer_stop(dev);
             break;
         default:
@@ -276,121 +736,276 @@ static int fifo_trigger(struct snd_pcm_substream *substream, int cmd)
     return 0;
 }
 
+static int fifo_ring_alloc(struct fifo_snd_device *dev,
+                           struct snd_pcm_runtime *runtime)
+{
+    unsigned int width = snd_pcm_format_physical_width(runtime->format) / 8;
+    unsigned int frames = runtime->buffer_size * FIFO_RING_BUFFERS;
+    size_t bytes = PAGE_ALIGN(frames * width * runtime->channels);
+    unsigned long flags;
+    char *ring = dev->ring;
+
+    /* keep what the reader has not consumed yet if the layout is unchanged */
+    if (ring && dev->ring_frames == frames && dev->ring_width == width &&
+        dev->ring_channels == runtime->channels && dev->ring_planar == planar &&
+        dev->ring_direct == direct)
+        return 0;
+
+    /* the ring stays allocated between streams, grow it only when needed */
+    if (!ring || dev->ring_capacity < bytes) {
+        /* page aligned, so that the ring can be exported page by page */
+        ring = vzalloc(bytes);
+        if (!ring)
+            return -ENOMEM;
+        vfree(dev->ring);
+        dev->ring_capacity = bytes;
+    }
+
+    spin_lock_irqsave(&dev->lock, flags);
+    dev->ring = ring;
+    dev->ring_frames = frames;
+    dev->ring_width = width;
+    dev->ring_channels = runtime->channels;
+    dev->ring_planar = planar;
+    dev->ring_direct = direct;
+    /*
+     * direct writes land up to a buffer ahead of ring_head, copies a period;
+     * the reader keeps off the slots being written
+     */
+    dev->ring_window = frames - (direct ? runtime->buffer_size : runtime->period_size);
+    dev->ring_head = dev->ring_tail = 0;
+    fifo_ctrl_update(dev, true);
+    spin_unlock_irqrestore(&dev->lock, flags);
+    return 0;
+}
+
+static void fifo_ring_free(struct fifo_snd_device *dev)
+{
+    unsigned long flags;
+    char *ring;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    ring = dev->ring;
+    dev->ring = NULL;
+    dev->ring_capacity = 0;
+    dev->ring_head = dev->ring_tail = 0;
+    spin_unlock_irqrestore(&dev->lock, flags);
+    vfree(ring);
+}
+
 /*
- * TODO set proper copy algorithm checking update in buffer on aloop and minivosc
+ * The position is interpolated from the clock on every call, not stepped by
+ * the clock passes, so the core sees it move between two period ends.
  */
-static void copy_play_buf(struct fifo_snd_device *play,
-                          unsigned int bytes)
-{
-    struct snd_pcm_runtime *runtime = play->substream->runtime;
-    char *src = runtime->dma_area;
-    unsigned int src_off = play->buf_pos;
-
-    memory_buffer = kmalloc(play->pcm_buffer_size, GFP_KERNEL);
-
-    if (runtime->status->state == SNDRV_PCM_STATE_DRAINING &&
-        snd_pcm_playback_hw_avail(runtime) < runtime->buffer_size) {
-        snd_pcm_uframes_t appl_ptr, appl_ptr1, diff;
-        appl_ptr = appl_ptr1 = runtime->control->appl_ptr;
-        appl_ptr1 -= appl_ptr1 % runtime->buffer_size;
-        appl_ptr1 += play->buf_pos / play->pcm_salign;
-        if (appl_ptr < appl_ptr1)
-            appl_ptr1 -= runtime->buffer_size;
-        diff = (appl_ptr - appl_ptr1) * play->pcm_salign;
-        if (diff < bytes) {
-            bytes = diff;
-        }
-    }
+static snd_pcm_uframes_t fifo_pointer(struct snd_pcm_substream *substream)
+{
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    struct fifo_snd_device *dpcm = runtime->private_data;
+    unsigned long flags;
+    unsigned int pos;
 
-    printk(KERN_WARNING "copy_play_buf");
-    for (;;) {
-        unsigned int size = bytes;
-        if (src_off + size > play->pcm_buffer_size)
-        {
-            size = play->pcm_buffer_size - src_off;
-        }
+    spin_lock_irqsave(&dpcm->lock, flags);
+    fifo_pos_update(dpcm, ktime_get_ns());
+    if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+        pos = dpcm->tap.buf_pos;
+    else
+        pos = dpcm->buf_pos;
+    spin_unlock_irqrestore(&dpcm->lock, flags);
+    return bytes_to_frames(runtime, pos);
+}
 
-        memcpy(memory_buffer, src + src_off, size);
-        printk(KERN_WARNING "copy done");
-        bytes -= size;
-        if (!bytes)
-            break;
+/*
+ * Link audio time: the clock is the link, so the audio time is the time it
+ * took to consume the reported position, read at the same instant as the
+ * system time. It is accurate to a byte of the stream.
+ */
+static int fifo_get_time_info(struct snd_pcm_substream *substream,
+                              struct timespec *system_ts, struct timespec *audio_ts,
+                              struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+                              struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    struct fifo_snd_device *dpcm = runtime->private_data;
+    unsigned long flags;
+    u64 now, played;
 
-        src_off = (src_off + size) % play->pcm_buffer_size;
+    if (audio_tstamp_config->type_requested != SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK ||
+        !dpcm->pcm_bps) {
+        audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+        return 0;
     }
+
+    spin_lock_irqsave(&dpcm->lock, flags);
+    now = ktime_get_ns();
+    fifo_pos_update(dpcm, now);
+    played = dpcm->played;
+    spin_unlock_irqrestore(&dpcm->lock, flags);
+
+    *audio_ts = ns_to_timespec(mul_u64_u32_div(played, NSEC_PER_SEC, dpcm->pcm_bps));
+    if (runtime->tstamp_type == SNDRV_PCM_TSTAMP_TYPE_MONOTONIC)
+        *system_ts = ns_to_timespec(now);
+    else
+        snd_pcm_gettime(runtime, system_ts);
+
+    audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK;
+    audio_tstamp_report->accuracy_report = 1;
+    audio_tstamp_report->accuracy = DIV_ROUND_UP(NSEC_PER_SEC, dpcm->pcm_bps);
+    return 0;
+}
+
+static int fifo_copy_user(struct snd_pcm_substream *ss, int channel,
+                          unsigned long pos, void __user *buf,
+                          unsigned long bytes)
+{
+    return fifo_ring_write(ss->runtime->private_data, channel, pos,
+                           (const char __force *)buf, bytes, FIFO_SRC_USER);
 }
 
-#define CABLE_PLAYBACK	(1 << SNDRV_PCM_STREAM_PLAYBACK)
+static int fifo_copy_kernel(struct snd_pcm_substream *ss, int channel,
+                            unsigned long pos, void *buf,
+                            unsigned long bytes)
+{
+    return fifo_ring_write(ss->runtime->private_data, channel, pos,
+                           buf, bytes, FIFO_SRC_KERNEL);
+}
 
-static void fifo_xfer_buf(struct fifo_snd_device *dev, unsigned int count)
+static int fifo_fill_silence(struct snd_pcm_substream *ss, int channel,
+                             unsigned long pos, unsigned long bytes)
 {
-    printk(KERN_WARNING "fifo_xfer_buf");
+    return fifo_ring_write(ss->runtime->private_data, channel, pos,
+                           NULL, bytes, FIFO_SRC_SILENCE);
+}
 
-    switch (dev->running){
-        case CABLE_PLAYBACK:
-            copy_play_buf(dev, count);
-            break;
+/*
+ * Take the smallest warm buffer that fits, allocate one only if none does.
+ * Called with cable_lock held.
+ */
+static struct fifo_pool_buf *fifo_pool_get(struct fifo_snd_device *dev,
+                                           size_t size)
+{
+    struct fifo_pool_buf *buf, *best = NULL;
+    int ret;
+
+    list_for_each_entry(buf, &dev->pool, list)
+        if (buf->dmab.bytes >= size &&
+            (!best || buf->dmab.bytes < best->dmab.bytes))
+            best = buf;
+    if (best) {
+        list_del(&best->list);
+        dev->pool_count--;
+        return best;
     }
-    if (dev->running) {
-        dev->buf_pos += count;
-        dev->buf_pos %= dev->pcm_buffer_size;
+
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (!buf)
+        return ERR_PTR(-ENOMEM);
+    ret = snd_dma_alloc_pages(SNDRV_DMA_TYPE_CONTINUOUS,
+                              snd_dma_continuous_data(GFP_KERNEL),
+                              PAGE_ALIGN(size), &buf->dmab);
+    if (ret < 0) {
+        kfree(buf);
+        return ERR_PTR(ret);
     }
+    return buf;
 }
 
-static unsigned fifo_pos_update(struct fifo_snd_device *cable)
+/*
+ * Park a buffer for the next stream, dropping the least recently used one
+ * when the pool is full. Called with cable_lock held.
+ */
+static void fifo_pool_put(struct fifo_snd_device *dev,
+                          struct fifo_pool_buf *buf)
 {
-    unsigned int last_pos, count;
-    unsigned long delta;
+    list_add(&buf->list, &dev->pool);
+    if (++dev->pool_count <= pool_buffers)
+        return;
+
+    buf = list_last_entry(&dev->pool, struct fifo_pool_buf, list);
+    list_del(&buf->list);
+    dev->pool_count--;
+    snd_dma_free_pages(&buf->dmab);
+    kfree(buf);
+}
 
-    printk(KERN_WARNING "fifo_pos_update");
-    if (!cable->running)
-        return 0;
+static void fifo_pool_free(struct fifo_snd_device *dev)
+{
+    struct fifo_pool_buf *buf, *tmp;
 
-    delta = jiffies - cable->last_jiffies;
-    if (!delta)
-        goto unlock;
-
-    cable->last_jiffies += delta;
-    last_pos = byte_pos(cable->irq_pos);
-    cable->irq_pos += delta * cable->pcm_bps;
-    count = byte_pos(cable->irq_pos) - last_pos;
-    if (!count)
-        goto unlock;
-
-    fifo_xfer_buf(cable, count);
-    if (cable->irq_pos >= cable->period_size_frac) {
-        cable->irq_pos %= cable->period_size_frac;
-        cable->period_update_pending = 1;
+    list_for_each_entry_safe(buf, tmp, &dev->pool, list) {
+        list_del(&buf->list);
+        snd_dma_free_pages(&buf->dmab);
+        kfree(buf);
     }
-
-    unlock:
-    return cable->running;
+    dev->pool_count = 0;
 }
 
-static snd_pcm_uframes_t fifo_pointer(struct snd_pcm_substream *substream)
+/* pool buffer used by the playback or by the capture tap */
+static struct fifo_pool_buf **fifo_dma_slot(struct fifo_snd_device *dev,
+                                           struct snd_pcm_substream *ss)
 {
-    struct snd_pcm_runtime *runtime = substream->runtime;
-    struct fifo_snd_device *dpcm = runtime->private_data;
-
-    printk(KERN_WARNING "fifo_pointer");
-    printk(KERN_WARNING "rate: %i", runtime->rate);
-    printk(KERN_WARNING "format: %d", runtime->format);
-    fifo_pos_update(dpcm);
-    return bytes_to_frames(runtime, dpcm->buf_pos);
+    if (ss->stream == SNDRV_PCM_STREAM_CAPTURE)
+        return &dev->tap.dma_buf;
+    return &dev->dma_buf;
 }
 
 static int fifo_hw_params(struct snd_pcm_substream *ss,
                         struct snd_pcm_hw_params *hw_params)
 {
+    struct fifo_snd_device *mydev = ss->runtime->private_data;
+    size_t size = params_buffer_bytes(hw_params);
+    struct fifo_pool_buf **slot = fifo_dma_slot(mydev, ss);
+    struct fifo_pool_buf *buf;
+
     printk(KERN_WARNING "fifo_hw_params");
-	return snd_pcm_lib_malloc_pages(ss,
-	                                params_buffer_bytes(hw_params));
+
+    /* no DMA area, the copy callbacks write to the ring */
+    if (direct && ss->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+        ss->runtime->dma_bytes = size;
+        return 0;
+    }
+
+    mutex_lock(&mydev->cable_lock);
+    buf = *slot;
+    if (!buf || buf->dmab.bytes < size) {
+        /* hw_params can be called again without hw_free in between */
+        if (buf)
+            fifo_pool_put(mydev, buf);
+        buf = fifo_pool_get(mydev, size);
+        if (IS_ERR(buf)) {
+            *slot = NULL;
+            mutex_unlock(&mydev->cable_lock);
+            return PTR_ERR(buf);
+        }
+        *slot = buf;
+    }
+    mutex_unlock(&mydev->cable_lock);
+
+    snd_pcm_set_runtime_buffer(ss, &buf->dmab);
+    ss->runtime->dma_bytes = size;
+    return 0;
 }
 
 static int fifo_hw_free(struct snd_pcm_substream *ss)
 {
+    struct fifo_snd_device *mydev = ss->runtime->private_data;
+    struct fifo_pool_buf **slot = fifo_dma_slot(mydev, ss);
     printk(KERN_WARNING "fifo_hw_free");
-	return snd_pcm_lib_free_pages(ss);
+
+    mutex_lock(&mydev->cable_lock);
+    spin_lock_irq(&mydev->lock);
+    mydev->valid &= ~(1 << ss->stream);
+    spin_unlock_irq(&mydev->lock);
+    /* a pass may still report a period of this stream, after dropping the locks */
+    fifo_timer_stop_sync(mydev);
+    /* the ring is kept for the next stream, the buffer goes back to the pool */
+    if (*slot) {
+        fifo_pool_put(mydev, *slot);
+        *slot = NULL;
+    }
+    mutex_unlock(&mydev->cable_lock);
+
+    snd_pcm_set_runtime_buffer(ss, NULL);
+	return 0;
 }
 
 static int fifo_pcm_open(struct snd_pcm_substream *ss)
@@ -401,13 +1016,23 @@ static int fifo_pcm_open(struct snd_pcm_substream *ss)
     mutex_lock(&mydev->cable_lock);
 
 	ss->runtime->hw = fifo_pcm_hw;
+	/* the tap is copied byte for byte, both streams use the same format */
+	if (mydev->valid & ~(1 << ss->stream)) {
+		ss->runtime->hw.formats = pcm_format_to_bits(mydev->pcm_format);
+		ss->runtime->hw.rate_min = ss->runtime->hw.rate_max = mydev->pcm_rate;
+		ss->runtime->hw.channels_min = ss->runtime->hw.channels_max = mydev->pcm_channels;
+	}
 
-    mydev->substream = ss;
+	if (ss->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		mydev->tap.substream = ss;
+	} else {
+		if (direct)
+			ss->runtime->hw.info &= ~(SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID);
+		mydev->substream = ss;
+	}
 
 	ss->runtime->private_data = mydev;
 
-    timer_setup(&mydev->timer, fifo_timer_function, 0);
-
     mutex_unlock(&mydev->cable_lock);
 
 	return 0;
@@ -420,6 +1045,12 @@ static int fifo_pcm_close(struct snd_pcm_substream *ss)
 
     mutex_lock(&mydev->cable_lock);
 
+    spin_lock_irq(&mydev->lock);
+    if (ss->stream == SNDRV_PCM_STREAM_CAPTURE)
+        mydev->tap.substream = NULL;
+    else
+        mydev->substream = NULL;
+    spin_unlock_irq(&mydev->lock);
 	ss->private_data = NULL;
 
     mutex_unlock(&mydev->cable_lock);
@@ -432,30 +1063,59 @@ static int fifo_pcm_prepare(struct snd_pcm_substream *ss)
 {
 	struct snd_pcm_runtime *runtime = ss->runtime;
 	struct fifo_snd_device *mydev = runtime->private_data;
+	unsigned int other = mydev->valid & ~(1 << ss->stream);
 	unsigned int bps;
+	int ret;
 
-    mydev->buf_pos = 0;
-
-	bps = runtime->rate * runtime->channels; // params requested by user app (arecord, audacity)
-	bps *= snd_pcm_format_width(runtime->format);
+	// params requested by user app (arecord, audacity), in buffer bytes:
+	// S24_LE takes 4 bytes per sample in the buffer, not 3
+	bps = runtime->rate * runtime->channels;
+	bps *= snd_pcm_format_physical_width(runtime->format);
 	bps /= 8;
 	if (bps <= 0)
 		return -EINVAL;
 
-	mydev->pcm_buffer_size = frames_to_bytes(runtime, runtime->buffer_size);
-    if (!mydev->running) {
-        mydev->irq_pos = 0;
-        mydev->period_update_pending = 0;
+    mutex_lock(&mydev->cable_lock);
+    /* opened before the other stream was set up, see fifo_pcm_open() */
+    if (other && (runtime->format != mydev->pcm_format ||
+                  runtime->rate != mydev->pcm_rate ||
+                  runtime->channels != mydev->pcm_channels)) {
+        mutex_unlock(&mydev->cable_lock);
+        return -EINVAL;
+    }
+    if (ss->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+        ret = fifo_ring_alloc(mydev, runtime);
+        if (ret < 0) {
+            mutex_unlock(&mydev->cable_lock);
+            return ret;
+        }
     }
 
-    mutex_lock(&mydev->cable_lock);
-    if (!(mydev->valid & ~(1 << ss->stream))) {
+    spin_lock_irq(&mydev->lock);
+    if (!other) {
         mydev->pcm_bps = bps;
+        mydev->pcm_salign = frames_to_bytes(runtime, 1);
+        mydev->pcm_format = runtime->format;
+        mydev->pcm_rate = runtime->rate;
+        mydev->pcm_channels = runtime->channels;
+    }
+    if (ss->stream == SNDRV_PCM_STREAM_CAPTURE) {
+        mydev->tap.buffer_size = frames_to_bytes(runtime, runtime->buffer_size);
+        mydev->tap.period_size = frames_to_bytes(runtime, runtime->period_size);
+        mydev->tap.buf_pos = 0;
+        mydev->tap.irq_pos = 0;
+        mydev->tap.silent_size = 0;
+        mydev->tap.period_update_pending = 0;
+    } else {
+        mydev->pcm_buffer_size = frames_to_bytes(runtime, runtime->buffer_size);
         mydev->pcm_period_size = frames_to_bytes(runtime, runtime->period_size);
-        mydev->period_size_frac = frac_pos(mydev->pcm_period_size);
+        mydev->buf_pos = 0;
+        mydev->irq_pos = 0;
+        mydev->period_update_pending = 0;
+        mydev->ring_base = mydev->ring_head;
     }
-
     mydev->valid |= 1 << ss->stream;
+    spin_unlock_irq(&mydev->lock);
     mutex_unlock(&mydev->cable_lock);
 
 	return 0;
@@ -464,6 +1124,10 @@ static int fifo_pcm_prepare(struct snd_pcm_substream *ss)
 static int fifo_pcm_free(struct fifo_snd_device *chip)
 {
     printk(KERN_WARNING "fifo_pcm_free");
+    if (chip->ctrl_page)
+        __free_page(chip->ctrl_page);
+    fifo_ring_free(chip);
+    fifo_pool_free(chip);
 	return 0;
 }
 
@@ -481,9 +1145,9 @@ static int fifo_probe(struct platform_device *devptr)
 	int dev = devptr->id;
 
 	int ret;
-    int result = 0;
 
 	int nr_subdevs = 1; // how many playback substreams we want
+	int nr_taps = 1; // and capture substreams mirroring them
 
     printk(KERN_WARNING "fifo_probe");
 
@@ -499,6 +1163,17 @@ static int fifo_probe(struct platform_device *devptr)
 	mydev->card = card;
 
     mutex_init(&mydev->cable_lock);
+    spin_lock_init(&mydev->lock);
+    init_waitqueue_head(&mydev->ring_wait);
+    INIT_LIST_HEAD(&mydev->clock_list);
+    INIT_LIST_HEAD(&mydev->pool);
+
+    mydev->ctrl_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!mydev->ctrl_page) {
+        ret = -ENOMEM;
+        goto __nodev;
+    }
+    mydev->ctrl = page_address(mydev->ctrl_page);
 
 	strcpy(card->driver, "virtual device");
 	sprintf(card->longname, "MySoundCard Audio %s", SND_FIFO_DRIVER);
@@ -510,13 +1185,15 @@ static int fifo_probe(struct platform_device *devptr)
 	if (ret < 0)
 		goto __nodev;
 
-	// * we want 1 playback, and 0 capture substreams (4th and 5th arg) ..
-	ret = snd_pcm_new(card, card->driver, 0, nr_subdevs, 0, &pcm);
+	// * we want 1 playback, and 1 capture substreams (4th and 5th arg) ..
+	ret = snd_pcm_new(card, card->driver, 0, nr_subdevs, nr_taps, &pcm);
 
 	if (ret < 0)
 		goto __nodev;
 
-	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &fifo_pcm_playback_ops);
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK,
+	                direct ? &fifo_pcm_direct_ops : &fifo_pcm_playback_ops);
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &fifo_pcm_capture_ops);
 	pcm->private_data = mydev;
 
     printk(KERN_WARNING "New device");
@@ -525,35 +1202,25 @@ static int fifo_probe(struct platform_device *devptr)
 
 	strcpy(pcm->name, SND_FIFO_DRIVER);
 
-	ret = snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_CONTINUOUS,
-										  snd_dma_continuous_data(GFP_KERNEL),
-										  32*48, 32*48);
+	// warm the pool, hw_params then takes buffers from it
+	if (!direct && pool_buffers && pool_prealloc_kb) {
+		struct fifo_pool_buf *buf = fifo_pool_get(mydev, pool_prealloc_kb * 1024);
 
-	if (ret < 0)
-		goto __nodev;
+		if (IS_ERR(buf)) {
+			ret = PTR_ERR(buf);
+			goto __nodev;
+		}
+		fifo_pool_put(mydev, buf);
+	}
 
 	ret = snd_card_register(card);
 
     printk(KERN_WARNING "REGISTERED CARD");
 
-    printk(KERN_NOTICE "fifo-soundcard: register_device() is called.");
-
-    result = register_chrdev(0, "fifo-soundcard", &simple_driver_fops);
-
-    device_file_major_number = result;
-
-    memory_buffer = kmalloc(1, GFP_KERNEL);
-    memset(memory_buffer, 0, 1);
-
-    if (result < 0)
-    {
-        printk(KERN_WARNING "Fifo-soundcard: can\'t register character device with errorcode = %i", result);
-        return result;
-    }
-
 	if (ret == 0)   // or... (!ret)
 	{
 		platform_set_drvdata(devptr, card);
+		fifo_chardevs[dev] = mydev;
 		return 0; // success
 	}
 
@@ -564,8 +1231,8 @@ __nodev: // as in aloop/dummy...
 
 static int fifo_remove(struct platform_device *devptr)
 {
+    fifo_chardevs[devptr->id] = NULL;
 	snd_card_free(platform_get_drvdata(devptr));
-    unregister_chrdev(device_file_major_number, "fifo-soundcard");
 	platform_set_drvdata(devptr, NULL);
 	return 0;
 }
@@ -573,9 +1240,15 @@ static int fifo_remove(struct platform_device *devptr)
 // INIT FUNCTIONS
 static void fifo_unregister_all(void)
 {
-    platform_device_unregister(device);
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(devices); i++)
+        platform_device_unregister(devices[i]);
 
     platform_driver_unregister(&fifo_driver);
+
+    if (device_file_major_number > 0)
+        unregister_chrdev(device_file_major_number, "fifo-soundcard");
 }
 
 static int __init alsa_card_fifo_init(void)
@@ -583,15 +1256,30 @@ static int __init alsa_card_fifo_init(void)
 	int i, err, cards;
     printk(KERN_WARNING "alsa_card_fifo_init");
 
+	hrtimer_init(&fifo_clock, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	fifo_clock.function = fifo_clock_function;
+
 	err = platform_driver_register(&fifo_driver);
 	if (err < 0)
 		return err;
 
+    printk(KERN_NOTICE "fifo-soundcard: register_device() is called.");
+
+    // one char device for all the cards, /dev/fifo-soundcardN is minor N
+    err = register_chrdev(0, "fifo-soundcard", &simple_driver_fops);
+    if (err < 0)
+    {
+        printk(KERN_WARNING "Fifo-soundcard: can\'t register character device with errorcode = %i", err);
+        platform_driver_unregister(&fifo_driver);
+        return err;
+    }
+    device_file_major_number = err;
+
 	cards = 0;
 
 	for (i = 0; i < SNDRV_CARDS; i++)
 	{
-		//struct platform_device *device;
+		struct platform_device *device;
 
 		if (!enable[i])
 			continue;
@@ -607,7 +1295,7 @@ static int __init alsa_card_fifo_init(void)
 			continue;
 		}
 
-		//device = device;
+		devices[i] = device;
 		cards++;
 	}
 
@@ -625,6 +1313,7 @@ static int __init alsa_card_fifo_init(void)
 static void __exit alsa_card_fifo_exit(void)
 {
 	fifo_unregister_all();
+	hrtimer_cancel(&fifo_clock);
 }
 
 
@@ -0,0 +1,45 @@
+#ifndef FIFO_H_
+#define FIFO_H_
+/*
+ * Interface of the snd-fifo char device, shared with userspace
+ */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define FIFO_CTRL_PLANAR	(1 << 0)	/* one ring region per channel */
+
+/*
+ * First page of the exported dma-buf, the ring starts on the next page.
+ * seq is odd while the driver updates the page: read it, read the fields,
+ * and retry if seq was odd or has changed meanwhile.
+ */
+struct fifo_ctrl {
+    __u32 seq;
+    __u32 generation;	/* bumped when the ring is reallocated */
+    __u64 head;		/* frames written since the ring was allocated */
+    __u64 time_ns;	/* CLOCK_MONOTONIC time of the last write */
+    __u32 ring_frames;
+    __u32 channels;
+    __u32 width;	/* bytes per sample */
+    __u32 flags;
+    __u32 window;	/* frames behind head that are not overwritten yet */
+    __u32 reserved;
+};
+
+struct fifo_export {
+    __s32 fd;		/* out: dma-buf fd */
+    __u32 flags;	/* in: O_CLOEXEC */
+    __u64 size;		/* out: control page + ring, in bytes */
+    __u64 ring_offset;	/* out: offset of the ring in the dma-buf */
+};
+
+struct fifo_wait {
+    __u32 seq;		/* in: last seen fifo_ctrl.seq, out: current one */
+    __u32 timeout_ms;	/* in: 0 waits forever */
+};
+
+#define FIFO_IOC_MAGIC		'F'
+#define FIFO_IOC_EXPORT		_IOWR(FIFO_IOC_MAGIC, 0x01, struct fifo_export)
+#define FIFO_IOC_WAIT		_IOWR(FIFO_IOC_MAGIC, 0x02, struct fifo_wait)
+
+#endif //FIFO_H_
@@ -0,0 +1,544 @@
+/*
+ * snd-fifo throughput and latency benchmark
+ *
+ * Plays a noise signal carrying sequence markers on one or more snd-fifo
+ * cards with alsa-lib, reads it back from /dev/fifo-soundcardN and reports
+ * throughput, end-to-end latency of the markers, xruns and CPU per stream.
+ * No audio hardware is needed, only the snd-fifo module.
+ *
+ * build: make bench
+ * usage: fifo_bench -C 1,2 -r 48000 -f S16_LE -c 2 -p 4096 -t 5
+ *
+ * Exit status: 0 ok, 1 xruns, lost markers or I/O errors, 2 configuration
+ * not supported by the card.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_STREAMS	8
+#define MAX_CHANNELS	32
+#define BUFFER_BYTES_MAX	(2 * 1024 * 1024)	/* fifo_pcm_hw.buffer_bytes_max */
+#define MARKER_MAGIC	"FIFOBNCH"
+#define MARKERS_PER_SEC	100
+#define READ_BYTES	(256 * 1024)
+
+/* written in the channel 0 samples, one sample after the other */
+struct marker {
+    char magic[8];
+    uint32_t stream;
+    uint32_t seq;
+    uint64_t sent_ns;
+};
+
+struct stream {
+    int index;
+    int card;
+    int minor;
+    snd_pcm_t *pcm;
+    int fd;
+    snd_pcm_uframes_t period_frames;
+    snd_pcm_uframes_t buffer_frames;
+    unsigned int width;		/* bytes per sample */
+    unsigned int frame_bytes;
+    unsigned int marker_interval;	/* frames */
+    /* writer */
+    uint64_t frames_written;
+    unsigned int xruns;
+    uint32_t seq;
+    struct marker mk;
+    unsigned int mk_off;
+    uint32_t noise;
+    double cpu_writer;
+    /* reader */
+    uint64_t bytes_read;
+    unsigned int markers;
+    unsigned int lost;
+    uint32_t last_seq;
+    int have_seq;
+    uint64_t *lat_ns;
+    size_t lat_count, lat_cap;
+    double cpu_reader;
+    int error;
+    pthread_t writer, reader;
+};
+
+static unsigned int rate = 48000;
+static snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
+static unsigned int channels = 2;
+static unsigned int period_bytes = 4096;
+static double duration = 5.0;
+static int planar;
+static int csv;
+static const char *chardev = "/dev/fifo-soundcard%d";
+
+static volatile int writers_done;
+static volatile int readers_stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double thread_cpu(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ================================== WRITER ==========================================
+static uint32_t noise_next(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/*
+ * Fill frames of noise, with a marker every marker_interval frames spread
+ * over the channel 0 samples of the following frames
+ */
+static void fill_chunk(struct stream *st, char *buf, snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t f;
+    unsigned int i;
+    uint64_t t = now_ns();
+
+    for (i = 0; i + 4 <= frames * st->frame_bytes; i += 4) {
+        uint32_t v = noise_next(&st->noise);
+        memcpy(buf + i, &v, 4);
+    }
+
+    for (f = 0; f < frames; f++) {
+        char *frame = buf + f * st->frame_bytes;
+
+        if ((st->frames_written + f) % st->marker_interval == 0) {
+            memcpy(st->mk.magic, MARKER_MAGIC, sizeof(st->mk.magic));
+            st->mk.stream = st->index;
+            st->mk.seq = st->seq++;
+            st->mk.sent_ns = t;
+            st->mk_off = 0;
+        }
+        if (st->mk_off < sizeof(st->mk)) {
+            unsigned int n = sizeof(st->mk) - st->mk_off;
+
+            if (n > st->width)
+                n = st->width;
+            memcpy(frame, (char *)&st->mk + st->mk_off, n);
+            st->mk_off += n;
+        }
+    }
+}
+
+static void *writer_thread(void *arg)
+{
+    struct stream *st = arg;
+    uint64_t end = now_ns() + (uint64_t)(duration * 1e9);
+    char *buf = malloc(st->period_frames * st->frame_bytes);
+
+    if (!buf) {
+        st->error = -ENOMEM;
+        return NULL;
+    }
+
+    while (now_ns() < end) {
+        snd_pcm_sframes_t done = 0, ret;
+
+        fill_chunk(st, buf, st->period_frames);
+        while (done < (snd_pcm_sframes_t)st->period_frames) {
+            ret = snd_pcm_writei(st->pcm, buf + done * st->frame_bytes,
+                                 st->period_frames - done);
+            if (ret == -EPIPE) {
+                st->xruns++;
+                ret = snd_pcm_recover(st->pcm, ret, 1);
+            }
+            if (ret < 0) {
+                fprintf(stderr, "stream %d: write: %s\n", st->index, snd_strerror(ret));
+                st->error = ret;
+                goto out;
+            }
+            done += ret;
+        }
+        st->frames_written += st->period_frames;
+    }
+
+out:
+    snd_pcm_drop(st->pcm);
+    st->cpu_writer = thread_cpu();
+    free(buf);
+    return NULL;
+}
+
+// ================================== READER ==========================================
+static void add_latency(struct stream *st, uint64_t ns)
+{
+    if (st->lat_count == st->lat_cap) {
+        size_t cap = st->lat_cap ? st->lat_cap * 2 : 1024;
+        uint64_t *lat = realloc(st->lat_ns, cap * sizeof(*lat));
+
+        if (!lat)
+            return;
+        st->lat_ns = lat;
+        st->lat_cap = cap;
+    }
+    st->lat_ns[st->lat_count++] = ns;
+}
+
+/* look for markers in the channel 0 byte stream, keep an incomplete tail */
+static size_t scan_markers(struct stream *st, char *scan, size_t len, uint64_t t)
+{
+    size_t off = 0;
+
+    for (;;) {
+        char *p = memmem(scan + off, len - off, MARKER_MAGIC, 8);
+        struct marker mk;
+
+        if (!p)
+            break;
+        if ((size_t)(p - scan) + sizeof(mk) > len) {
+            off = p - scan;
+            goto keep;
+        }
+        memcpy(&mk, p, sizeof(mk));
+        off = p - scan + sizeof(mk);
+        if (mk.stream != (uint32_t)st->index)
+            continue;
+
+        if (st->have_seq && mk.seq != st->last_seq + 1)
+            st->lost += mk.seq - st->last_seq - 1;
+        st->last_seq = mk.seq;
+        st->have_seq = 1;
+        st->markers++;
+        add_latency(st, t - mk.sent_ns);
+    }
+    /* the magic may start in the last 7 bytes */
+    off = len > 7 ? len - 7 : 0;
+keep:
+    memmove(scan, scan + off, len - off);
+    return len - off;
+}
+
+static void *reader_thread(void *arg)
+{
+    struct stream *st = arg;
+    size_t chunk = READ_BYTES - READ_BYTES % st->frame_bytes;
+    char *buf = malloc(chunk);
+    char *scan = malloc(chunk / channels + sizeof(struct marker));
+    size_t kept = 0;
+    struct pollfd pfd = { .fd = st->fd, .events = POLLIN };
+
+    if (!buf || !scan) {
+        st->error = -ENOMEM;
+        goto out;
+    }
+
+    while (!readers_stop) {
+        ssize_t ret;
+        size_t frames, f;
+        uint64_t t;
+
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        ret = read(st->fd, buf, chunk);
+        t = now_ns();
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            fprintf(stderr, "stream %d: read: %s\n", st->index, strerror(errno));
+            st->error = -errno;
+            break;
+        }
+        st->bytes_read += ret;
+
+        frames = ret / st->frame_bytes;
+        if (planar) {
+            memcpy(scan + kept, buf, frames * st->width);
+            kept += frames * st->width;
+        } else {
+            for (f = 0; f < frames; f++, kept += st->width)
+                memcpy(scan + kept, buf + f * st->frame_bytes, st->width);
+        }
+        kept = scan_markers(st, scan, kept, t);
+    }
+
+out:
+    st->cpu_reader = thread_cpu();
+    free(buf);
+    free(scan);
+    return NULL;
+}
+
+// =================================== SETUP ==========================================
+static int setup_pcm(struct stream *st)
+{
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_sw_params_t *sw;
+    snd_pcm_uframes_t period, buffer;
+    unsigned int periods;
+    char name[32];
+    int ret;
+
+    snprintf(name, sizeof(name), "hw:%d,0", st->card);
+    ret = snd_pcm_open(&st->pcm, name, SND_PCM_STREAM_PLAYBACK, 0);
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", name, snd_strerror(ret));
+        return 1;
+    }
+
+    st->width = snd_pcm_format_physical_width(format) / 8;
+    st->frame_bytes = st->width * channels;
+    period = period_bytes / st->frame_bytes;
+    periods = BUFFER_BYTES_MAX / period_bytes;
+    if (periods > 4)
+        periods = 4;
+    if (periods < 2)
+        periods = 2;
+    buffer = period * periods;
+    if (!period)
+        return 2;
+
+    snd_pcm_hw_params_alloca(&hw);
+    snd_pcm_hw_params_any(st->pcm, hw);
+    if (snd_pcm_hw_params_set_access(st->pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED) < 0 ||
+        snd_pcm_hw_params_set_format(st->pcm, hw, format) < 0 ||
+        snd_pcm_hw_params_set_channels(st->pcm, hw, channels) < 0 ||
+        snd_pcm_hw_params_set_rate(st->pcm, hw, rate, 0) < 0 ||
+        snd_pcm_hw_params_set_period_size(st->pcm, hw, period, 0) < 0 ||
+        snd_pcm_hw_params_set_buffer_size_near(st->pcm, hw, &buffer) < 0 ||
+        snd_pcm_hw_params(st->pcm, hw) < 0)
+        return 2;
+
+    snd_pcm_hw_params_get_period_size(hw, &st->period_frames, NULL);
+    snd_pcm_hw_params_get_buffer_size(hw, &st->buffer_frames);
+
+    snd_pcm_sw_params_alloca(&sw);
+    snd_pcm_sw_params_current(st->pcm, sw);
+    snd_pcm_sw_params_set_start_threshold(st->pcm, sw, st->buffer_frames);
+    snd_pcm_sw_params_set_avail_min(st->pcm, sw, st->period_frames);
+    ret = snd_pcm_sw_params(st->pcm, sw);
+    if (ret < 0) {
+        fprintf(stderr, "%s: sw params: %s\n", name, snd_strerror(ret));
+        return 1;
+    }
+
+    st->marker_interval = rate / MARKERS_PER_SEC;
+    if (st->marker_interval < 2 * sizeof(struct marker))
+        st->marker_interval = 2 * sizeof(struct marker);
+    st->mk_off = sizeof(st->mk);
+    st->noise = 0x9e3779b9u ^ st->index;
+    return 0;
+}
+
+static int open_chardev(struct stream *st)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), chardev, st->minor);
+    st->fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (st->fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    /* drop what a previous run left in the ring */
+    while (read(st->fd, (char[4096]){ 0 }, 4096) > 0)
+        ;
+    return 0;
+}
+
+static int parse_list(const char *arg, int *out)
+{
+    int n = 0;
+    char *end;
+
+    while (*arg && n < MAX_STREAMS) {
+        out[n++] = strtol(arg, &end, 10);
+        if (*end != ',')
+            break;
+        arg = end + 1;
+    }
+    return n;
+}
+
+// ================================== REPORT ==========================================
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(struct stream *st, double p)
+{
+    size_t i;
+
+    if (!st->lat_count)
+        return 0;
+    i = (size_t)(p * (st->lat_count - 1));
+    return st->lat_ns[i] / 1e3;
+}
+
+static void report(struct stream *st, unsigned int nr, double wall)
+{
+    double expected = (double)rate * channels * snd_pcm_format_physical_width(format) / 8;
+    uint64_t total_bytes = 0;
+    unsigned int total_xruns = 0, total_lost = 0;
+    double worst_p99 = 0, total_cpu = 0;
+    unsigned int i;
+
+    for (i = 0; i < nr; i++, st++) {
+        double cpu = (st->cpu_writer + st->cpu_reader) / wall * 100;
+
+        qsort(st->lat_ns, st->lat_count, sizeof(*st->lat_ns), cmp_u64);
+        total_bytes += st->bytes_read;
+        total_xruns += st->xruns;
+        total_lost += st->lost;
+        total_cpu += cpu;
+        if (percentile_us(st, 0.99) > worst_p99)
+            worst_p99 = percentile_us(st, 0.99);
+        if (csv)
+            continue;
+
+        printf("stream=%u card=%d period_frames=%lu buffer_frames=%lu "
+               "written=%llu read=%llu throughput_Bps=%.0f expected_Bps=%.0f "
+               "xruns=%u markers=%u lost=%u "
+               "lat_min_us=%.0f lat_p50_us=%.0f lat_p90_us=%.0f lat_p99_us=%.0f lat_max_us=%.0f "
+               "cpu_pct=%.2f\n",
+               i, st->card, st->period_frames, st->buffer_frames,
+               (unsigned long long)(st->frames_written * st->frame_bytes),
+               (unsigned long long)st->bytes_read, st->bytes_read / wall, expected,
+               st->xruns, st->markers, st->lost,
+               percentile_us(st, 0), percentile_us(st, 0.5), percentile_us(st, 0.9),
+               percentile_us(st, 0.99), percentile_us(st, 1), cpu);
+    }
+
+    if (csv)
+        printf("%u,%s,%u,%u,%u,%.0f,%.0f,%u,%u,%.0f,%.2f\n",
+               rate, snd_pcm_format_name(format), channels, period_bytes, nr,
+               total_bytes / wall, expected * nr, total_xruns, total_lost,
+               worst_p99, total_cpu);
+    else
+        printf("total streams=%u throughput_Bps=%.0f xruns=%u lost=%u "
+               "worst_lat_p99_us=%.0f cpu_pct=%.2f\n",
+               nr, total_bytes / wall, total_xruns, total_lost, worst_p99, total_cpu);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -C cards [options]\n"
+            "  -C n,n,...  ALSA card numbers of the snd-fifo cards, one stream each\n"
+            "  -m n,n,...  char device minors (default 0,1,... in -C order)\n"
+            "  -d path     char device pattern (default %s)\n"
+            "  -r rate     sample rate (default %u)\n"
+            "  -f format   sample format name (default %s)\n"
+            "  -c count    channels (default %u)\n"
+            "  -p bytes    period size in bytes (default %u)\n"
+            "  -t seconds  duration (default %.1f)\n"
+            "  -P          module loaded with planar=1\n"
+            "  -H          print the CSV header and exit\n"
+            "  -o csv      one CSV line for the whole run\n",
+            prog, chardev, rate, snd_pcm_format_name(format), channels,
+            period_bytes, duration);
+}
+
+int main(int argc, char **argv)
+{
+    static struct stream streams[MAX_STREAMS];
+    int cards[MAX_STREAMS], minors[MAX_STREAMS];
+    int nr = 0, nr_minors = 0, opt, ret = 0, i;
+    uint64_t start;
+    double wall;
+
+    while ((opt = getopt(argc, argv, "C:m:d:r:f:c:p:t:PHo:h")) != -1) {
+        switch (opt) {
+            case 'C': nr = parse_list(optarg, cards); break;
+            case 'm': nr_minors = parse_list(optarg, minors); break;
+            case 'd': chardev = optarg; break;
+            case 'r': rate = atoi(optarg); break;
+            case 'f':
+                format = snd_pcm_format_value(optarg);
+                if (format == SND_PCM_FORMAT_UNKNOWN) {
+                    fprintf(stderr, "unknown format %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'c': channels = atoi(optarg); break;
+            case 'p': period_bytes = atoi(optarg); break;
+            case 't': duration = atof(optarg); break;
+            case 'P': planar = 1; break;
+            case 'H':
+                printf("rate,format,channels,period_bytes,streams,throughput_Bps,"
+                       "expected_Bps,xruns,lost,worst_lat_p99_us,cpu_pct\n");
+                return 0;
+            case 'o': csv = !strcmp(optarg, "csv"); break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (!nr || !channels || channels > MAX_CHANNELS) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    for (i = 0; i < nr; i++) {
+        streams[i].index = i;
+        streams[i].card = cards[i];
+        streams[i].minor = i < nr_minors ? minors[i] : i;
+        ret = setup_pcm(&streams[i]);
+        if (!ret)
+            ret = open_chardev(&streams[i]);
+        if (ret)
+            return ret;
+    }
+
+    start = now_ns();
+    for (i = 0; i < nr; i++) {
+        pthread_create(&streams[i].reader, NULL, reader_thread, &streams[i]);
+        pthread_create(&streams[i].writer, NULL, writer_thread, &streams[i]);
+    }
+    for (i = 0; i < nr; i++)
+        pthread_join(streams[i].writer, NULL);
+    wall = (now_ns() - start) / 1e9;
+
+    /* let the readers catch the tail of the ring */
+    usleep(200000);
+    readers_stop = 1;
+    for (i = 0; i < nr; i++)
+        pthread_join(streams[i].reader, NULL);
+
+    report(streams, nr, wall);
+
+    for (i = 0; i < nr; i++) {
+        struct stream *st = &streams[i];
+
+        if (st->xruns || st->lost || st->error || !st->markers)
+            ret = 1;
+        snd_pcm_close(st->pcm);
+        close(st->fd);
+        free(st->lat_ns);
+    }
+    return ret;
+}
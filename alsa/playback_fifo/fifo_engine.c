@@ -0,0 +1,522 @@
+/*
+ * Basic FIFO playback soundcard - pacing and copy engine
+ *
+ * Copyright (c) by Giuliano Gambacorta <ggambacora88@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <linux/kernel.h>    /* printk() */
+#include <linux/errno.h>     /* error codes */
+#include <linux/ktime.h>
+#include <linux/math64.h>    /* mul_u64_u32_div() */
+#include <linux/string.h>
+#include <linux/uaccess.h>  /* copy_from_user() */
+#include <linux/wait.h>
+
+#include <sound/core.h>
+#include <sound/pcm.h>
+
+#include "fifo_engine.h"
+
+static void copy_play_buf(struct fifo_snd_device *play, unsigned int bytes);
+static void fifo_tap_silence(struct fifo_snd_device *dev, unsigned int dst_frame,
+                             unsigned int frames);
+static void fifo_xfer_buf(struct fifo_snd_device *dev, unsigned int count);
+
+// =================================== POSITION =======================================
+/*
+ * Bytes are consumed at pcm_bps from start_ns: the position is computed from
+ * the clock time and not from the number of wakeups, so it stays exact
+ * whenever the shared clock fires.
+ */
+u64 fifo_next_period_ns(struct fifo_snd_device *dpcm)
+{
+    u64 end = U64_MAX;
+
+    if (dpcm->running & CABLE_PLAYBACK)
+        end = dpcm->played + dpcm->pcm_period_size - dpcm->irq_pos;
+    if (dpcm->running & CABLE_CAPTURE)
+        end = min(end, dpcm->played + dpcm->tap.period_size - dpcm->tap.irq_pos);
+    if (end == U64_MAX)
+        return U64_MAX;
+
+    return dpcm->start_ns + mul_u64_u32_div(end, NSEC_PER_SEC, dpcm->pcm_bps) + 1;
+}
+
+/* frames of the capture buffer completed by the next bytes of the clock */
+static unsigned int fifo_tap_frames(struct fifo_snd_device *dev, unsigned int bytes)
+{
+    unsigned int pos = dev->tap.buf_pos;
+
+    return (pos + bytes) / dev->pcm_salign - pos / dev->pcm_salign;
+}
+
+static void fifo_xfer_buf(struct fifo_snd_device *dev, unsigned int count)
+{
+    switch (dev->running){
+        case CABLE_PLAYBACK:
+        case CABLE_BOTH:
+            copy_play_buf(dev, count);
+            break;
+        case CABLE_CAPTURE:
+            fifo_tap_silence(dev, dev->tap.buf_pos / dev->pcm_salign,
+                             fifo_tap_frames(dev, count));
+            break;
+    }
+    if (dev->running & CABLE_PLAYBACK) {
+        dev->buf_pos += count;
+        dev->buf_pos %= dev->pcm_buffer_size;
+    }
+    if (dev->running & CABLE_CAPTURE) {
+        dev->tap.buf_pos += count;
+        dev->tap.buf_pos %= dev->tap.buffer_size;
+    }
+}
+
+unsigned fifo_pos_update(struct fifo_snd_device *cable, u64 now)
+{
+    struct fifo_tap *tap = &cable->tap;
+    unsigned int count;
+    u64 played;
+
+    if (!cable->running)
+        return 0;
+
+    played = mul_u64_u32_div(now - cable->start_ns, cable->pcm_bps, NSEC_PER_SEC);
+    count = played - cable->played;
+    if (!count)
+        goto unlock;
+
+    cable->played = played;
+    fifo_xfer_buf(cable, count);
+    if (cable->running & CABLE_PLAYBACK) {
+        cable->irq_pos += count;
+        if (cable->irq_pos >= cable->pcm_period_size) {
+            cable->irq_pos %= cable->pcm_period_size;
+            cable->period_update_pending = 1;
+        }
+    }
+    if (cable->running & CABLE_CAPTURE) {
+        tap->irq_pos += count;
+        if (tap->irq_pos >= tap->period_size) {
+            tap->irq_pos %= tap->period_size;
+            tap->period_update_pending = 1;
+        }
+    }
+
+    unlock:
+    return cable->running;
+}
+
+// ================================== RING COPY =======================================
+/*
+ * Copy one channel between two strided layouts. Fixed width word copies
+ * are used for the usual sample sizes instead of a byte memcpy per sample.
+ */
+static void fifo_xpose_channel(char *dst, unsigned int dst_step,
+                               const char *src, unsigned int src_step,
+                               unsigned int frames, unsigned int width)
+{
+    unsigned int i;
+
+    switch (width) {
+        case 2:
+            for (i = 0; i < frames; i++, dst += dst_step, src += src_step)
+                *(u16 *)dst = *(const u16 *)src;
+            break;
+        case 4:
+            for (i = 0; i < frames; i++, dst += dst_step, src += src_step)
+                *(u32 *)dst = *(const u32 *)src;
+            break;
+        default:
+            for (i = 0; i < frames; i++, dst += dst_step, src += src_step)
+                memcpy(dst, src, width);
+            break;
+    }
+}
+
+/*
+ * Copy frames between interleaved and/or planar layouts: fstep is the
+ * distance between two frames of a channel, cstep between two channels.
+ */
+void fifo_copy_frames(char *dst, unsigned int dst_fstep, unsigned int dst_cstep,
+                      const char *src, unsigned int src_fstep, unsigned int src_cstep,
+                      unsigned int frames, unsigned int channels,
+                      unsigned int width)
+{
+    unsigned int c, f, n;
+
+    if (src_cstep == width && dst_cstep == width) {
+        memcpy(dst, src, frames * src_fstep);
+        return;
+    }
+    if (src_fstep == width && dst_fstep == width) {
+        for (c = 0; c < channels; c++)
+            memcpy(dst + c * dst_cstep, src + c * src_cstep, frames * width);
+        return;
+    }
+
+    /* transpose in blocks small enough for the interleaved side to stay in cache */
+    for (f = 0; f < frames; f += n) {
+        n = min_t(unsigned int, frames - f, FIFO_XPOSE_BLOCK);
+        for (c = 0; c < channels; c++)
+            fifo_xpose_channel(dst + c * dst_cstep + f * dst_fstep, dst_fstep,
+                               src + c * src_cstep + f * src_fstep, src_fstep,
+                               n, width);
+    }
+}
+
+/*
+ * Frame of a PCM buffer, with the steps of fifo_copy_frames()
+ */
+static char *fifo_buf_frame(struct snd_pcm_runtime *runtime, unsigned int frame,
+                            unsigned int width,
+                            unsigned int *fstep, unsigned int *cstep)
+{
+    if (runtime->access == SNDRV_PCM_ACCESS_MMAP_NONINTERLEAVED ||
+        runtime->access == SNDRV_PCM_ACCESS_RW_NONINTERLEAVED) {
+        *fstep = width;
+        *cstep = runtime->dma_bytes / runtime->channels;
+        return runtime->dma_area + frame * width;
+    }
+    *fstep = width * runtime->channels;
+    *cstep = width;
+    return runtime->dma_area + frame * *fstep;
+}
+
+/* same, for a slot of the ring */
+static char *fifo_ring_frame(struct fifo_snd_device *dev, unsigned int slot,
+                             unsigned int *fstep, unsigned int *cstep)
+{
+    unsigned int width = dev->ring_width;
+
+    if (dev->ring_planar) {
+        *fstep = width;
+        *cstep = dev->ring_frames * width;
+        return dev->ring + slot * width;
+    }
+    *fstep = width * dev->ring_channels;
+    *cstep = width;
+    return dev->ring + slot * *fstep;
+}
+
+/*
+ * Append frames of the playback buffer, starting at src_frame, to the ring
+ */
+static void fifo_ring_put(struct fifo_snd_device *dev,
+                          struct snd_pcm_runtime *runtime,
+                          unsigned int src_frame,
+                          unsigned int frames)
+{
+    unsigned long head = dev->ring_head;
+
+    while (frames) {
+        unsigned int dst_frame = head % dev->ring_frames;
+        unsigned int n = frames;
+        const char *src;
+        char *dst;
+        unsigned int src_fstep, src_cstep, dst_fstep, dst_cstep;
+
+        n = min_t(unsigned int, n, runtime->buffer_size - src_frame);
+        n = min_t(unsigned int, n, dev->ring_frames - dst_frame);
+
+        src = fifo_buf_frame(runtime, src_frame, dev->ring_width, &src_fstep, &src_cstep);
+        dst = fifo_ring_frame(dev, dst_frame, &dst_fstep, &dst_cstep);
+        fifo_copy_frames(dst, dst_fstep, dst_cstep, src, src_fstep, src_cstep,
+                         n, dev->ring_channels, dev->ring_width);
+
+        frames -= n;
+        head += n;
+        src_frame = (src_frame + n) % runtime->buffer_size;
+    }
+    dev->ring_head = head;
+}
+
+/*
+ * Fill frames of the capture buffer with silence, skipped once the whole
+ * buffer is silent already
+ */
+static void fifo_tap_silence(struct fifo_snd_device *dev, unsigned int dst_frame,
+                             unsigned int frames)
+{
+    struct fifo_tap *tap = &dev->tap;
+    struct snd_pcm_runtime *runtime = tap->substream->runtime;
+    unsigned int width = dev->pcm_salign / runtime->channels;
+    unsigned int c;
+
+    if (tap->silent_size >= tap->buffer_size)
+        return;
+    tap->silent_size = min(tap->silent_size + frames * dev->pcm_salign,
+                           tap->buffer_size);
+
+    while (frames) {
+        unsigned int n = min_t(unsigned int, frames, runtime->buffer_size - dst_frame);
+        unsigned int fstep, cstep;
+        char *dst = fifo_buf_frame(runtime, dst_frame, width, &fstep, &cstep);
+
+        if (fstep == width)
+            for (c = 0; c < runtime->channels; c++)
+                snd_pcm_format_set_silence(runtime->format, dst + c * cstep, n);
+        else
+            snd_pcm_format_set_silence(runtime->format, dst, n * runtime->channels);
+
+        frames -= n;
+        dst_frame = (dst_frame + n) % runtime->buffer_size;
+    }
+}
+
+/*
+ * Mirror the frames the clock plays to the capture buffer, straight from
+ * where the playback keeps them: its DMA area, or the ring in direct mode,
+ * where the frames sit at ring_head until copy_play_buf() publishes them.
+ * Of the total frames the capture completes, those past the end of a drain
+ * are silence.
+ */
+static void fifo_tap_feed(struct fifo_snd_device *dev, unsigned int src_frame,
+                          unsigned int frames, unsigned int total)
+{
+    struct fifo_tap *tap = &dev->tap;
+    struct snd_pcm_runtime *play = dev->substream->runtime;
+    struct snd_pcm_runtime *capt = tap->substream->runtime;
+    unsigned int width = dev->pcm_salign / capt->channels;
+    unsigned int dst_frame = tap->buf_pos / dev->pcm_salign;
+    unsigned long head = dev->ring_head;
+
+    if (dev->ring_direct && !dev->ring)
+        frames = 0;
+    if (frames)
+        tap->silent_size = 0;
+
+    while (frames) {
+        unsigned int n = min_t(unsigned int, frames, capt->buffer_size - dst_frame);
+        unsigned int src_fstep, src_cstep, dst_fstep, dst_cstep;
+        const char *src;
+        char *dst;
+
+        if (dev->ring_direct) {
+            unsigned int slot = head % dev->ring_frames;
+
+            n = min_t(unsigned int, n, dev->ring_frames - slot);
+            src = fifo_ring_frame(dev, slot, &src_fstep, &src_cstep);
+        } else {
+            n = min_t(unsigned int, n, play->buffer_size - src_frame);
+            src = fifo_buf_frame(play, src_frame, width, &src_fstep, &src_cstep);
+        }
+        dst = fifo_buf_frame(capt, dst_frame, width, &dst_fstep, &dst_cstep);
+        fifo_copy_frames(dst, dst_fstep, dst_cstep, src, src_fstep, src_cstep,
+                         n, capt->channels, width);
+
+        frames -= n;
+        total -= n;
+        head += n;
+        src_frame = (src_frame + n) % play->buffer_size;
+        dst_frame = (dst_frame + n) % capt->buffer_size;
+    }
+    if (total)
+        fifo_tap_silence(dev, dst_frame, total);
+}
+
+static void copy_play_buf(struct fifo_snd_device *play,
+                          unsigned int bytes)
+{
+    struct snd_pcm_runtime *runtime = play->substream->runtime;
+    unsigned int count = bytes;
+    unsigned int src_frame, frames;
+
+    if (runtime->status->state == SNDRV_PCM_STATE_DRAINING &&
+        snd_pcm_playback_hw_avail(runtime) < runtime->buffer_size) {
+        snd_pcm_uframes_t appl_ptr, appl_ptr1, diff;
+        appl_ptr = appl_ptr1 = runtime->control->appl_ptr;
+        appl_ptr1 -= appl_ptr1 % runtime->buffer_size;
+        appl_ptr1 += play->buf_pos / play->pcm_salign;
+        if (appl_ptr < appl_ptr1)
+            appl_ptr1 -= runtime->buffer_size;
+        diff = (appl_ptr - appl_ptr1) * play->pcm_salign;
+        if (diff < bytes) {
+            bytes = diff;
+        }
+    }
+
+    /* buf_pos may sit inside a frame, only push the frames it completes */
+    src_frame = play->buf_pos / play->pcm_salign;
+    frames = (play->buf_pos + bytes) / play->pcm_salign - src_frame;
+
+    /* the capture is triggered in phase, it completes the same frames */
+    if (play->running & CABLE_CAPTURE)
+        fifo_tap_feed(play, src_frame, frames,
+                      (play->buf_pos + count) / play->pcm_salign - src_frame);
+
+    if (!play->ring || !frames)
+        return;
+
+    /* direct writes are already in the ring, they only become visible now */
+    if (play->ring_direct)
+        play->ring_head += frames;
+    else
+        fifo_ring_put(play, runtime, src_frame, frames);
+    fifo_ctrl_update(play, false);
+    wake_up_interruptible(&play->ring_wait);
+}
+
+/*
+ * Publish the ring state in the control page. Called with dev->lock held.
+ */
+void fifo_ctrl_update(struct fifo_snd_device *dev, bool realloc)
+{
+    struct fifo_ctrl *ctrl = dev->ctrl;
+
+    WRITE_ONCE(ctrl->seq, ctrl->seq + 1);
+    smp_wmb();
+    if (realloc) {
+        ctrl->generation++;
+        ctrl->ring_frames = dev->ring_frames;
+        ctrl->channels = dev->ring_channels;
+        ctrl->width = dev->ring_width;
+        ctrl->flags = dev->ring_planar ? FIFO_CTRL_PLANAR : 0;
+        ctrl->window = dev->ring_window;
+    }
+    ctrl->head = dev->ring_head;
+    ctrl->time_ns = ktime_get_ns();
+    smp_wmb();
+    WRITE_ONCE(ctrl->seq, ctrl->seq + 1);
+}
+
+// ================================= DIRECT WRITES ====================================
+/*
+ * Ring slot of a buffer frame. The core only lets the application and the
+ * silence fill write between hw_ptr and hw_ptr + buffer_size, which tells
+ * which lap of the buffer the frame belongs to. The boundary is a multiple
+ * of the ring size, so hw_ptr wrapping at it does not move the slots.
+ */
+static unsigned int fifo_ring_slot(struct fifo_snd_device *dev,
+                                   struct snd_pcm_runtime *runtime,
+                                   unsigned int frame)
+{
+    snd_pcm_uframes_t hw = runtime->status->hw_ptr;
+    snd_pcm_uframes_t ofs = (frame + runtime->buffer_size - hw % runtime->buffer_size) %
+                            runtime->buffer_size;
+
+    return (dev->ring_base + hw + ofs) % dev->ring_frames;
+}
+
+static int fifo_fetch(struct fifo_snd_device *dev, char *dst, const char *src,
+                      unsigned int bytes, enum fifo_src from)
+{
+    switch (from) {
+        case FIFO_SRC_USER:
+            if (copy_from_user(dst, (const void __user *)src, bytes))
+                return -EFAULT;
+            return 0;
+        case FIFO_SRC_KERNEL:
+            memcpy(dst, src, bytes);
+            return 0;
+        default:
+            return snd_pcm_format_set_silence(dev->substream->runtime->format,
+                                              dst, bytes / dev->ring_width);
+    }
+}
+
+/*
+ * Silence straight into the ring, a channel at a time: fill_silence comes from
+ * the clock's softirq, while the PCM writer may be using the bounce.
+ */
+static void fifo_ring_silence(struct fifo_snd_device *dev, char *dst, unsigned int fstep,
+                              unsigned int cstep, unsigned int frames, unsigned int channels)
+{
+    snd_pcm_format_t format = dev->substream->runtime->format;
+    unsigned int c, f;
+
+    for (c = 0; c < channels; c++) {
+        if (fstep == dev->ring_width) {
+            snd_pcm_format_set_silence(format, dst + c * cstep, frames);
+            continue;
+        }
+        for (f = 0; f < frames; f++)
+            snd_pcm_format_set_silence(format, dst + c * cstep + f * fstep, 1);
+    }
+}
+
+/*
+ * Store the data of a copy_user/copy_kernel/fill_silence callback in the
+ * ring, in place of the DMA area. pos and bytes are whole frames of the
+ * buffer with interleaved access, samples of the given channel otherwise.
+ * The frames are published by copy_play_buf() when the clock plays them.
+ */
+int fifo_ring_write(struct fifo_snd_device *dev, int channel,
+                    unsigned long pos, const char *src, unsigned long bytes,
+                    enum fifo_src from)
+{
+    struct snd_pcm_runtime *runtime = dev->substream->runtime;
+    unsigned int width = dev->ring_width;
+    unsigned int frame_bytes = width * dev->ring_channels;
+    bool interleaved = runtime->access == SNDRV_PCM_ACCESS_RW_INTERLEAVED ||
+                       runtime->access == SNDRV_PCM_ACCESS_MMAP_INTERLEAVED;
+    unsigned int src_step = interleaved ? frame_bytes : width;
+    unsigned int channels = interleaved ? dev->ring_channels : 1;
+    unsigned int frames = bytes / src_step;
+    unsigned int slot;
+    int ret;
+
+    if (!dev->ring)
+        return -EBADFD;
+    if (interleaved)
+        channel = 0;
+    slot = fifo_ring_slot(dev, runtime, pos / src_step);
+
+    while (frames) {
+        unsigned int n = min(frames, dev->ring_frames - slot);
+        unsigned int dst_fstep, dst_cstep, done, k;
+        char *dst;
+
+        if (dev->ring_planar) {
+            dst = dev->ring + (channel * dev->ring_frames + slot) * width;
+            dst_fstep = width;
+            dst_cstep = dev->ring_frames * width;
+        } else {
+            dst = dev->ring + slot * frame_bytes + channel * width;
+            dst_fstep = frame_bytes;
+            dst_cstep = width;
+        }
+
+        if (dst_fstep == src_step) {
+            /* same layout on both sides */
+            ret = fifo_fetch(dev, dst, src, n * src_step, from);
+            if (ret < 0)
+                return ret;
+        } else if (from == FIFO_SRC_SILENCE) {
+            fifo_ring_silence(dev, dst, dst_fstep, dst_cstep, n, channels);
+        } else {
+            /* interleaved into planar or the other way round */
+            for (done = 0; done < n; done += k) {
+                k = min(n - done, FIFO_BOUNCE_BYTES / src_step);
+                ret = fifo_fetch(dev, dev->bounce,
+                                 src ? src + done * src_step : NULL,
+                                 k * src_step, from);
+                if (ret < 0)
+                    return ret;
+                fifo_copy_frames(dst + done * dst_fstep, dst_fstep, dst_cstep,
+                                 dev->bounce, src_step, interleaved ? width : 0,
+                                 k, channels, width);
+            }
+        }
+
+        frames -= n;
+        if (src)
+            src += n * src_step;
+        slot = 0;
+    }
+    return 0;
+}
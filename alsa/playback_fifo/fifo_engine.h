@@ -0,0 +1,117 @@
+#ifndef FIFO_ENGINE_H_
+#define FIFO_ENGINE_H_
+/*
+ * Pacing and copy engine of snd-fifo: no timer, file or ALSA registration
+ * here, only the position arithmetic and the copies to the ring, so that it
+ * also builds in userspace against the mocks in sim/.
+ */
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <sound/pcm.h>
+
+#include "fifo.h"
+
+#define FIFO_XPOSE_BLOCK	64	/* frames per transposition block */
+#define FIFO_BOUNCE_BYTES	2048	/* layout conversion of direct writes */
+
+#define CABLE_PLAYBACK	(1 << SNDRV_PCM_STREAM_PLAYBACK)
+#define CABLE_CAPTURE	(1 << SNDRV_PCM_STREAM_CAPTURE)
+#define CABLE_BOTH	(CABLE_PLAYBACK | CABLE_CAPTURE)
+
+/* where fifo_ring_write() takes the samples from */
+enum fifo_src {
+    FIFO_SRC_USER,
+    FIFO_SRC_KERNEL,
+    FIFO_SRC_SILENCE,
+};
+
+struct snd_card;
+struct snd_pcm;
+struct snd_pcm_substream;
+struct page;
+struct fifo_pool_buf;
+
+/* capture substream mirroring the playback, paced by the same clock */
+struct fifo_tap
+{
+    struct snd_pcm_substream *substream;
+    unsigned int buffer_size;	/* bytes */
+    unsigned int period_size;	/* bytes */
+    unsigned int buf_pos;	/* position in buffer */
+    unsigned int irq_pos;	/* bytes into the current period */
+    unsigned int silent_size;	/* bytes of silence already in the buffer */
+    unsigned int period_update_pending :1;
+    struct fifo_pool_buf *dma_buf;
+};
+
+struct fifo_snd_device
+{
+    spinlock_t lock;
+    struct snd_card *card;
+    struct snd_pcm *pcm;
+    /* copied from struct loopback: */
+    struct mutex cable_lock;
+    /* copied from struct loopback_cable: */
+    /* PCM parameters */
+    unsigned int pcm_period_size;
+    unsigned int pcm_bps;		/* bytes per second */
+    unsigned int pcm_salign;	/* bytes per sample * channels */
+    snd_pcm_format_t pcm_format;	/* of the first stream set up */
+    unsigned int pcm_rate;
+    unsigned int pcm_channels;
+    /* flags */
+    unsigned int valid;
+    unsigned int running;
+    unsigned int period_update_pending :1;
+    /* timer stuff */
+    unsigned int irq_pos;		/* bytes into the current period */
+    u64 start_ns;		/* clock time of the trigger */
+    u64 played;		/* bytes consumed since start_ns */
+    u64 next_ns;		/* next period end, under fifo_clock_lock */
+    struct list_head clock_list;	/* on fifo_clock_list while running */
+    struct list_head elapsed_list;	/* private to fifo_clock_function() */
+    unsigned int elapsed;		/* streams to notify, same */
+    /* copied from struct loopback_pcm: */
+    struct snd_pcm_substream *substream;
+    unsigned int pcm_buffer_size;
+    unsigned int buf_pos;	/* position in buffer */
+    unsigned int silent_size;
+    struct fifo_pool_buf *dma_buf;	/* pool buffer used by the runtime */
+    struct fifo_tap tap;
+    /* warm buffers, most recently used first, under cable_lock */
+    struct list_head pool;
+    unsigned int pool_count;
+    /* char device ring, filled by the timer copy */
+    char *ring;
+    size_t ring_capacity;	/* allocated bytes, kept across streams */
+    unsigned int ring_frames;	/* ring size in frames */
+    unsigned int ring_channels;
+    unsigned int ring_width;	/* bytes per sample */
+    unsigned int ring_planar :1;	/* one region per channel */
+    unsigned int ring_direct :1;	/* filled by the copy callbacks */
+    unsigned int ring_window;	/* frames behind ring_head still readable */
+    unsigned long ring_head;	/* frames written */
+    unsigned long ring_tail;	/* frames read */
+    unsigned long ring_base;	/* ring frame of the first frame of the stream */
+    char bounce[FIFO_BOUNCE_BYTES];	/* copy_user/copy_kernel only, direct mode */
+    wait_queue_head_t ring_wait;
+    /* control page, exported with the ring */
+    struct page *ctrl_page;
+    struct fifo_ctrl *ctrl;
+};
+
+u64 fifo_next_period_ns(struct fifo_snd_device *dpcm);
+unsigned fifo_pos_update(struct fifo_snd_device *cable, u64 now);
+void fifo_ctrl_update(struct fifo_snd_device *dev, bool realloc);
+int fifo_ring_write(struct fifo_snd_device *dev, int channel,
+                    unsigned long pos, const char *src, unsigned long bytes,
+                    enum fifo_src from);
+void fifo_copy_frames(char *dst, unsigned int dst_fstep, unsigned int dst_cstep,
+                      const char *src, unsigned int src_fstep, unsigned int src_cstep,
+                      unsigned int frames, unsigned int channels,
+                      unsigned int width);
+
+#endif //FIFO_ENGINE_H_
@@ -0,0 +1,600 @@
+/*
+ * snd-fifo pacing and copy engine simulator
+ *
+ * Runs fifo_engine.c in userspace against a virtual clock: the shared
+ * hrtimer is replaced by a loop that jumps to the next period end (plus a
+ * random wakeup latency, at most half a period), pointer callbacks are issued at random times in
+ * between, and a fake application keeps the buffer full with a known
+ * pattern. Hours of playback take seconds.
+ *
+ * For every rate/period pair it checks, and reports:
+ *  - pos_err: position in bytes against the exact one at the same time
+ *  - drift: distance between the programmed wakeup and the exact period
+ *    end, it must stay within a couple of ns however long the stream runs
+ *  - periods: elapsed periods signalled against the periods played
+ *  - ring: every frame pushed to the ring against the pattern written
+ *  - drain: frames pushed after DRAINING against the frames written
+ *  - tap: with -m, every frame of the capture tap against the pattern
+ *    played, or silence past the end of the drain
+ *  - copy throughput of the engine, in real time
+ *
+ * and then measures fifo_copy_frames() alone for the ring layouts.
+ *
+ * build: make -C sim
+ * usage: fifo_sim [-t hours] [-r rates] [-p period_bytes] [-c channels]
+ *                 [-w width] [-a i|n] [-P] [-d] [-m] [-j jitter_us] [-n] [-s seed]
+ *
+ * -d writes through fifo_ring_write() as the copy callbacks of the direct
+ * mode do, and silences the free part of the buffer now and then.
+ *
+ * -m triggers the capture tap at a random pass, with the other access type
+ * and 1.5 times the period of the playback.
+ *
+ * Exit status is 1 if any check failed.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sound/pcm.h>
+
+#include "../fifo_engine.h"
+
+#define MAX_LIST	16
+#define SIM_PERIODS	4	/* periods per buffer */
+#define SIM_PRIME_NS	(500 * NSEC_PER_USEC)	/* FIFO_PRIME_NS in fifo.c */
+
+u64 sim_clock_ns;
+
+static double hours = 1.0;
+static unsigned int rates[MAX_LIST] = { 8000, 44100, 48000, 96000, 192000 };
+static unsigned int nr_rates = 5;
+static unsigned int periods[MAX_LIST] = { 256, 4096, 65536 };
+static unsigned int nr_periods = 3;
+static unsigned int channels = 2;
+static unsigned int width = 2;
+static int access_planar;
+static int ring_planar;
+static int direct;
+static int monitor;
+static unsigned char *app_buf;	/* what the application passes to write() */
+static unsigned int jitter_us = 250;	/* default clock_slack_us */
+static int verify = 1;
+static u64 seed = 0x2545f4914f6cdd1dULL;
+
+struct sim_result {
+    u64 passes;
+    u64 pointer_calls;
+    u64 bytes;
+    s64 pos_err_max;	/* bytes */
+    s64 ring_lag_max;	/* frames */
+    s64 drift_min, drift_max;	/* ns */
+    u64 periods;
+    u64 period_errors;
+    u64 ring_errors;
+    u64 tap_errors;
+    s64 drain_err;	/* frames */
+    double copy_s;
+};
+
+static u64 rnd(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static double real_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* sample c of frame f of the stream, as the application writes it */
+static inline u32 pattern(u64 f, unsigned int c)
+{
+    return (u32)((f * 64 + c) * 2654435761ULL);
+}
+
+/* memcpy() of a constant size is inlined, of width it is a call per sample */
+static inline void sample_put(void *dst, u32 v)
+{
+    switch (width) {
+        case 2: memcpy(dst, &v, 2); break;
+        case 4: memcpy(dst, &v, 4); break;
+        default: memcpy(dst, &v, width); break;
+    }
+}
+
+static inline u32 sample_get(const void *src)
+{
+    u32 v = 0;
+
+    switch (width) {
+        case 2: memcpy(&v, src, 2); break;
+        case 4: memcpy(&v, src, 4); break;
+        default: memcpy(&v, src, width); break;
+    }
+    return v;
+}
+
+// ================================== APPLICATION =====================================
+/*
+ * Write frames up to appl_ptr + count, split at the end of the buffer like
+ * the core does: into the DMA area, or through the copy callback in direct
+ * mode, from an application buffer of the same access type
+ */
+static void app_write(struct fifo_snd_device *dev, struct snd_pcm_runtime *rt,
+                      snd_pcm_uframes_t count)
+{
+    unsigned int frame_bytes = width * channels;
+    unsigned char *area = direct ? app_buf : rt->dma_area;
+    unsigned int ofs, n, f, c, stride, base;
+    u64 appl;
+
+    while (count) {
+        appl = rt->control->appl_ptr;
+        ofs = appl % rt->buffer_size;
+        n = min(count, rt->buffer_size - ofs);
+        /* frames per channel region and first frame, in area */
+        stride = direct ? n : rt->buffer_size;
+        base = direct ? 0 : ofs;
+
+        for (f = 0; f < n; f++)
+            for (c = 0; c < channels; c++)
+                sample_put(access_planar ?
+                           area + (c * stride + base + f) * width :
+                           area + (base + f) * frame_bytes + c * width,
+                           pattern(appl + f, c));
+
+        if (direct && !access_planar)
+            fifo_ring_write(dev, 0, ofs * frame_bytes, (char *)app_buf,
+                            n * frame_bytes, FIFO_SRC_KERNEL);
+        for (c = 0; direct && access_planar && c < channels; c++)
+            fifo_ring_write(dev, c, ofs * width, (char *)app_buf + c * n * width,
+                            n * width, FIFO_SRC_KERNEL);
+
+        rt->control->appl_ptr += n;
+        count -= n;
+    }
+}
+
+/* silence the free part of the buffer, as the core does with silence_size */
+static void app_silence(struct fifo_snd_device *dev, struct snd_pcm_runtime *rt)
+{
+    unsigned int frame_bytes = width * channels;
+    snd_pcm_uframes_t avail = snd_pcm_playback_avail(rt);
+    u64 appl = rt->control->appl_ptr;
+    unsigned int ofs, n, c;
+
+    while (avail) {
+        ofs = appl % rt->buffer_size;
+        n = min(avail, rt->buffer_size - ofs);
+        if (!access_planar)
+            fifo_ring_write(dev, 0, ofs * frame_bytes, NULL, n * frame_bytes,
+                            FIFO_SRC_SILENCE);
+        for (c = 0; access_planar && c < channels; c++)
+            fifo_ring_write(dev, c, ofs * width, NULL, n * width, FIFO_SRC_SILENCE);
+        appl += n;
+        avail -= n;
+    }
+}
+
+/* check and consume what the engine appended to the ring */
+static void ring_check(struct fifo_snd_device *dev, struct sim_result *res)
+{
+    unsigned int frame_bytes = width * channels;
+    unsigned int slot = dev->ring_tail % dev->ring_frames;
+    unsigned long f;
+    unsigned int c;
+
+    for (f = dev->ring_tail; verify && f < dev->ring_head; f++) {
+        for (c = 0; c < channels; c++) {
+            u32 v = pattern(f, c);
+            u32 got = sample_get(dev->ring_planar ?
+                                 dev->ring + (c * dev->ring_frames + slot) * width :
+                                 dev->ring + slot * frame_bytes + c * width);
+
+            if (width < 4)
+                v &= (1U << (width * 8)) - 1;
+            if (got != v && res->ring_errors++ < 4)
+                fprintf(stderr, "ring frame %lu channel %u: %08x != %08x\n",
+                        f, c, got, v);
+        }
+        if (++slot == dev->ring_frames)
+            slot = 0;
+    }
+    dev->ring_tail = dev->ring_head;
+}
+
+/* capture tap state of the harness, set when the tap is triggered */
+static struct {
+    u64 start_frame;	/* playback frame captured first */
+    u64 start_played;	/* dev->played at the trigger */
+    u64 read;	/* capture frames checked */
+} tap_sim;
+
+/* bytes the capture has consumed since its trigger */
+static u64 tap_bytes(struct fifo_snd_device *dev)
+{
+    return dev->played - tap_sim.start_played + tap_sim.start_played % dev->pcm_salign;
+}
+
+/* check what the engine copied to the capture buffer, as arecord would read it */
+static void tap_check(struct fifo_snd_device *dev, struct sim_result *res)
+{
+    struct snd_pcm_runtime *rt = dev->tap.substream->runtime;
+    struct snd_pcm_runtime *prt = dev->substream->runtime;
+    int planar = rt->access == SNDRV_PCM_ACCESS_RW_NONINTERLEAVED;
+    u64 hw = tap_bytes(dev) / dev->pcm_salign;
+    unsigned int c;
+
+    for (; verify && tap_sim.read < hw; tap_sim.read++) {
+        u64 f = tap_sim.start_frame + tap_sim.read;
+        unsigned int slot = tap_sim.read % rt->buffer_size;
+
+        for (c = 0; c < channels; c++) {
+            u32 v = f < prt->control->appl_ptr ? pattern(f, c) : 0;
+            u32 got = sample_get(planar ?
+                                 rt->dma_area + (c * rt->buffer_size + slot) * width :
+                                 rt->dma_area + (slot * channels + c) * width);
+
+            if (width < 4)
+                v &= (1U << (width * 8)) - 1;
+            if (got != v && res->tap_errors++ < 4)
+                fprintf(stderr, "tap frame %llu channel %u: %08x != %08x\n",
+                        (unsigned long long)f, c, got, v);
+        }
+    }
+    tap_sim.read = hw;
+}
+
+/* trigger start of the tap on the running clock, as fifo_trigger() */
+static void tap_start(struct fifo_snd_device *dev, u64 now)
+{
+    fifo_pos_update(dev, now);
+    dev->tap.buf_pos = dev->tap.irq_pos = dev->played % dev->pcm_salign;
+    dev->running |= CABLE_CAPTURE;
+    tap_sim.start_frame = dev->played / dev->pcm_salign;
+    tap_sim.start_played = dev->played;
+    tap_sim.read = 0;
+}
+
+// =================================== SIMULATION =====================================
+static s64 exact_played(struct fifo_snd_device *dev, u64 now)
+{
+    return (unsigned __int128)(now - dev->start_ns) * dev->pcm_bps / NSEC_PER_SEC;
+}
+
+/* one engine pass at now, as fifo_clock_function() or fifo_pointer() */
+static void sim_pass(struct fifo_snd_device *dev, u64 now, struct sim_result *res)
+{
+    struct snd_pcm_runtime *rt = dev->substream->runtime;
+    u64 before = dev->played;
+    double t0 = real_s();
+    s64 err;
+
+    sim_clock_ns = now;
+    fifo_pos_update(dev, now);
+    res->copy_s += real_s() - t0;
+    res->bytes += dev->played - before;
+
+    err = dev->played - exact_played(dev, now);
+    res->pos_err_max = max(res->pos_err_max, err < 0 ? -err : err);
+    if (rt->status->state != SNDRV_PCM_STATE_DRAINING)
+        res->ring_lag_max = max(res->ring_lag_max,
+                                (s64)(dev->played / dev->pcm_salign - dev->ring_head));
+
+    rt->status->hw_ptr = (dev->played / dev->pcm_salign) % rt->boundary;
+    ring_check(dev, res);
+    if (dev->running & CABLE_CAPTURE)
+        tap_check(dev, res);
+}
+
+/* the core stops a draining stream once hw_ptr reaches appl_ptr */
+static int drain_done(struct fifo_snd_device *dev)
+{
+    struct snd_pcm_runtime *rt = dev->substream->runtime;
+
+    return rt->status->state == SNDRV_PCM_STATE_DRAINING &&
+           dev->played / dev->pcm_salign >= rt->control->appl_ptr;
+}
+
+static int simulate(unsigned int rate, unsigned int period_bytes,
+                    struct sim_result *res)
+{
+    struct snd_pcm_mmap_status status = { .state = SNDRV_PCM_STATE_RUNNING };
+    struct snd_pcm_mmap_control control = { 0 };
+    struct snd_pcm_runtime rt = { 0 };
+    struct snd_pcm_substream ss = { .stream = SNDRV_PCM_STREAM_PLAYBACK };
+    struct snd_pcm_runtime crt = { 0 };
+    struct snd_pcm_substream css = { .stream = SNDRV_PCM_STREAM_CAPTURE };
+    struct fifo_snd_device dev = { 0 };
+    struct fifo_ctrl ctrl = { 0 };
+    unsigned int frame_bytes = width * channels;
+    u64 end, next, jitter_ns, clock_played = 0, tap_played = 0;
+    int primed = 0;
+
+    memset(res, 0, sizeof(*res));
+    res->drift_min = INT64_MAX;
+    res->drift_max = INT64_MIN;
+
+    /* hw_params */
+    rt.access = access_planar ? SNDRV_PCM_ACCESS_RW_NONINTERLEAVED :
+                                SNDRV_PCM_ACCESS_RW_INTERLEAVED;
+    rt.rate = rate;
+    rt.channels = channels;
+    rt.period_size = period_bytes / frame_bytes;
+    if (!rt.period_size)
+        return -1;
+    rt.buffer_size = rt.period_size * SIM_PERIODS;
+    rt.boundary = rt.buffer_size;
+    while (rt.boundary * 2 <= LONG_MAX - rt.buffer_size)
+        rt.boundary *= 2;
+    rt.dma_bytes = rt.buffer_size * frame_bytes;
+    rt.dma_area = calloc(1, rt.dma_bytes);
+    rt.format = width;
+    rt.status = &status;
+    rt.control = &control;
+    rt.private_data = &dev;
+    ss.runtime = &rt;
+
+    /* prepare, as fifo_pcm_prepare() and fifo_ring_alloc() */
+    dev.substream = &ss;
+    dev.ctrl = &ctrl;
+    dev.pcm_bps = rate * frame_bytes;
+    dev.pcm_buffer_size = rt.dma_bytes;
+    dev.pcm_salign = frame_bytes;
+    dev.pcm_period_size = rt.period_size * frame_bytes;
+    dev.ring_frames = rt.buffer_size * 2;
+    dev.ring_channels = channels;
+    dev.ring_width = width;
+    dev.ring_planar = ring_planar;
+    dev.ring_direct = direct;
+    dev.ring_window = direct ? dev.ring_frames - rt.buffer_size : dev.ring_frames;
+    dev.ring = calloc(1, (size_t)dev.ring_frames * frame_bytes);
+    app_buf = calloc(1, rt.dma_bytes);
+
+    /* the capture tap, with its own buffer geometry */
+    crt = rt;
+    crt.access = access_planar ? SNDRV_PCM_ACCESS_RW_INTERLEAVED :
+                                 SNDRV_PCM_ACCESS_RW_NONINTERLEAVED;
+    crt.period_size = rt.period_size + rt.period_size / 2;
+    crt.buffer_size = crt.period_size * 3;
+    crt.dma_bytes = crt.buffer_size * frame_bytes;
+    crt.dma_area = monitor ? calloc(1, crt.dma_bytes) : NULL;
+    css.runtime = &crt;
+    dev.tap.substream = &css;
+    dev.tap.buffer_size = crt.dma_bytes;
+    dev.tap.period_size = crt.period_size * frame_bytes;
+
+    if (!rt.dma_area || !dev.ring || !app_buf || (monitor && !crt.dma_area)) {
+        free(rt.dma_area);
+        free(crt.dma_area);
+        free(dev.ring);
+        free(app_buf);
+        return -1;
+    }
+    fifo_ctrl_update(&dev, true);
+    app_write(&dev, &rt, rt.buffer_size);
+
+    /* trigger start, the start time is arbitrary */
+    dev.start_ns = 1000 * NSEC_PER_SEC + rnd() % NSEC_PER_SEC;
+    sim_clock_ns = dev.start_ns;
+    dev.running = 1 << SNDRV_PCM_STREAM_PLAYBACK;
+    end = dev.start_ns + (u64)(hours * 3600 * NSEC_PER_SEC);
+    next = min(fifo_next_period_ns(&dev), dev.start_ns + SIM_PRIME_NS);
+    /* later than half a period the fake application would underrun */
+    jitter_ns = min((u64)jitter_us * NSEC_PER_USEC,
+                    (u64)dev.pcm_period_size * NSEC_PER_SEC / dev.pcm_bps / 2);
+
+    for (;;) {
+        u64 now = next + (jitter_ns ? rnd() % jitter_ns : 0);
+        u64 period_size = dev.pcm_period_size, tap_period = dev.tap.period_size, exact;
+        s64 drift;
+        int crossed, tap_crossed = 0;
+
+        /* pointer calls from the application between two clock passes */
+        if (rnd() % 4 == 0) {
+            sim_pass(&dev, sim_clock_ns + rnd() % (now - sim_clock_ns + 1), res);
+            res->pointer_calls++;
+            if (drain_done(&dev))
+                break;
+        }
+
+        /* the clock pass signals a period iff one ended since the last one,
+         * it never wakes up for nothing after the first pass */
+        sim_pass(&dev, now, res);
+        crossed = dev.played / period_size > clock_played / period_size;
+        if (crossed != dev.period_update_pending)
+            res->period_errors++;
+        if (dev.running & CABLE_CAPTURE) {
+            tap_crossed = tap_bytes(&dev) / tap_period > tap_played / tap_period;
+            if (tap_crossed != dev.tap.period_update_pending)
+                res->period_errors++;
+            dev.tap.period_update_pending = 0;
+            tap_played = tap_bytes(&dev);
+        }
+        if (primed && !crossed && !tap_crossed)
+            res->period_errors++;
+        res->periods += dev.played / period_size - clock_played / period_size;
+        dev.period_update_pending = 0;
+        clock_played = dev.played;
+        primed = 1;
+        res->passes++;
+
+        if (monitor && !(dev.running & CABLE_CAPTURE) && rnd() % 16 == 0) {
+            tap_start(&dev, now);
+            tap_played = tap_bytes(&dev);
+        }
+
+        if (status.state == SNDRV_PCM_STATE_DRAINING) {
+            if (drain_done(&dev))
+                break;
+        } else if (now >= end) {
+            status.state = SNDRV_PCM_STATE_DRAINING;
+        } else {
+            /* refill what was played, a partial period sometimes */
+            snd_pcm_uframes_t avail = snd_pcm_playback_avail(&rt);
+
+            if (avail >= rt.period_size)
+                app_write(&dev, &rt, rnd() % 8 ? avail : avail - rnd() % rt.period_size);
+            if (direct && rnd() % 4 == 0)
+                app_silence(&dev, &rt);
+        }
+
+        /* distance of the wakeup from the exact end of the next period */
+        next = fifo_next_period_ns(&dev);
+        exact = (unsigned __int128)(dev.played / period_size + 1) * period_size *
+                NSEC_PER_SEC / dev.pcm_bps;
+        if (dev.running & CABLE_CAPTURE)
+            exact = min(exact, (u64)((unsigned __int128)
+                        (dev.played - tap_bytes(&dev) % tap_period + tap_period) *
+                        NSEC_PER_SEC / dev.pcm_bps));
+        drift = next - dev.start_ns - exact;
+        res->drift_min = min(res->drift_min, drift);
+        res->drift_max = max(res->drift_max, drift);
+    }
+
+    res->drain_err = (s64)dev.ring_head - (s64)control.appl_ptr;
+    if (ctrl.head != dev.ring_head || ctrl.seq & 1)
+        res->ring_errors++;
+
+    free(rt.dma_area);
+    free(crt.dma_area);
+    free(dev.ring);
+    free(app_buf);
+    return 0;
+}
+
+// ================================= COPY BENCHMARK ===================================
+static void copy_bench(void)
+{
+    static const unsigned int chans[] = { 2, 8, 32 };
+    static const unsigned int widths[] = { 2, 3, 4 };
+    static const char *names[] = { "i->i", "i->p", "p->i", "p->p" };
+    const unsigned int frames = 4096;
+    unsigned int ci, wi, l;
+
+    for (ci = 0; ci < 3; ci++) {
+        for (wi = 0; wi < 3; wi++) {
+            unsigned int c = chans[ci], w = widths[wi];
+            size_t bytes = (size_t)frames * c * w;
+            char *src = calloc(1, bytes), *dst = calloc(1, bytes);
+
+            if (!src || !dst)
+                return;
+            printf("copy channels=%u width=%u", c, w);
+            for (l = 0; l < 4; l++) {
+                int sp = l >= 2, dp = l & 1;
+                unsigned int iter = 0;
+                double t0 = real_s(), t;
+
+                do {
+                    fifo_copy_frames(dst, dp ? w : c * w, dp ? frames * w : w,
+                                     src, sp ? w : c * w, sp ? frames * w : w,
+                                     frames, c, w);
+                    iter++;
+                    t = real_s() - t0;
+                } while (t < 0.05);
+                printf(" %s=%.0fMB/s", names[l], bytes * (double)iter / t / 1e6);
+            }
+            printf("\n");
+            free(src);
+            free(dst);
+        }
+    }
+}
+
+static unsigned int parse_list(const char *arg, unsigned int *out)
+{
+    unsigned int n = 0;
+    char *end;
+
+    while (*arg && n < MAX_LIST) {
+        out[n++] = strtoul(arg, &end, 10);
+        if (*end != ',')
+            break;
+        arg = end + 1;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int r, p;
+    int opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "t:r:p:c:w:a:Pdmj:ns:")) != -1) {
+        switch (opt) {
+            case 't': hours = atof(optarg); break;
+            case 'r': nr_rates = parse_list(optarg, rates); break;
+            case 'p': nr_periods = parse_list(optarg, periods); break;
+            case 'c': channels = atoi(optarg); break;
+            case 'w': width = atoi(optarg); break;
+            case 'a': access_planar = optarg[0] == 'n'; break;
+            case 'P': ring_planar = 1; break;
+            case 'd': direct = 1; break;
+            case 'm': monitor = 1; break;
+            case 'j': jitter_us = atoi(optarg); break;
+            case 'n': verify = 0; break;
+            case 's': seed = strtoull(optarg, NULL, 0) | 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-t hours] [-r rates] [-p period_bytes] "
+                        "[-c channels] [-w width] [-a i|n] [-P] [-d] [-m] [-j jitter_us] "
+                        "[-n] [-s seed]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (!channels || width < 1 || width > 4)
+        return 2;
+
+    for (r = 0; r < nr_rates; r++) {
+        for (p = 0; p < nr_periods; p++) {
+            struct sim_result res;
+            double t0 = real_s(), wall;
+            int bad;
+
+            if (simulate(rates[r], periods[p], &res) < 0) {
+                printf("rate=%u period_bytes=%u skipped\n", rates[r], periods[p]);
+                continue;
+            }
+            wall = real_s() - t0;
+            bad = res.pos_err_max || res.ring_lag_max || res.drift_min < 0 ||
+                  res.drift_max > 2 || res.period_errors || res.ring_errors ||
+                  res.tap_errors || res.drain_err;
+            failed |= bad;
+
+            printf("rate=%u period_bytes=%u hours=%.2f speedup=%.0fx passes=%llu "
+                   "pointer_calls=%llu periods=%llu pos_err=%lld ring_lag=%lld "
+                   "drift_ns=%lld..%lld period_errors=%llu ring_errors=%llu "
+                   "tap_errors=%llu drain_err=%lld copy_MBps=%.0f %s\n",
+                   rates[r], periods[p], hours, hours * 3600 / wall,
+                   (unsigned long long)res.passes,
+                   (unsigned long long)res.pointer_calls,
+                   (unsigned long long)res.periods,
+                   (long long)res.pos_err_max, (long long)res.ring_lag_max,
+                   (long long)res.drift_min, (long long)res.drift_max,
+                   (unsigned long long)res.period_errors,
+                   (unsigned long long)res.ring_errors,
+                   (unsigned long long)res.tap_errors,
+                   (long long)res.drain_err,
+                   res.copy_s > 0 ? res.bytes / res.copy_s / 1e6 : 0,
+                   bad ? "FAIL" : "ok");
+        }
+    }
+
+    copy_bench();
+    return failed;
+}
@@ -0,0 +1,61 @@
+#ifndef KMOCK_H_
+#define KMOCK_H_
+/*
+ * Just enough of the kernel API to build fifo_engine.c in userspace.
+ * Locks are empty, the clock is sim_clock_ns, set by the harness.
+ */
+#include <asm/types.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+
+#define NSEC_PER_USEC	1000ULL
+#define NSEC_PER_SEC	1000000000ULL
+#define U64_MAX		UINT64_MAX
+
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define max(a, b)	((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)	((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+
+#define __user
+#define __force
+
+static inline unsigned long copy_from_user(void *to, const void __user *from,
+                                           unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+#define WRITE_ONCE(x, v)	(*(volatile typeof(x) *)&(x) = (v))
+#define smp_wmb()	__atomic_thread_fence(__ATOMIC_RELEASE)
+
+static inline u64 mul_u64_u32_div(u64 a, u32 mul, u32 div)
+{
+    return (u64)((unsigned __int128)a * mul / div);
+}
+
+extern u64 sim_clock_ns;
+
+static inline u64 ktime_get_ns(void)
+{
+    return sim_clock_ns;
+}
+
+typedef struct { int unused; } spinlock_t;
+struct mutex { int unused; };
+struct list_head { struct list_head *next, *prev; };
+
+/* counts the wakeups instead of waking anyone */
+typedef struct { unsigned long wakeups; } wait_queue_head_t;
+#define wake_up_interruptible(wq)	((wq)->wakeups++)
+
+#endif //KMOCK_H_
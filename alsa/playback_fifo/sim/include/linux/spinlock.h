@@ -0,0 +1 @@
+#include "../kmock.h"
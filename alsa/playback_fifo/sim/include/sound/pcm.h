@@ -0,0 +1,80 @@
+#ifndef KMOCK_PCM_H_
+#define KMOCK_PCM_H_
+/*
+ * The part of snd_pcm_runtime read by fifo_engine.c, filled by the harness
+ */
+#include "../kmock.h"
+
+typedef unsigned long snd_pcm_uframes_t;
+typedef long snd_pcm_sframes_t;
+typedef int snd_pcm_format_t;	/* here the physical width in bytes */
+
+#define SNDRV_PCM_STREAM_PLAYBACK	0
+#define SNDRV_PCM_STREAM_CAPTURE	1
+
+#define SNDRV_PCM_ACCESS_MMAP_INTERLEAVED	0
+#define SNDRV_PCM_ACCESS_MMAP_NONINTERLEAVED	1
+#define SNDRV_PCM_ACCESS_RW_INTERLEAVED	3
+#define SNDRV_PCM_ACCESS_RW_NONINTERLEAVED	4
+
+#define SNDRV_PCM_STATE_PREPARED	2
+#define SNDRV_PCM_STATE_RUNNING	3
+#define SNDRV_PCM_STATE_DRAINING	5
+
+struct snd_pcm_mmap_status {
+    int state;
+    snd_pcm_uframes_t hw_ptr;
+};
+
+struct snd_pcm_mmap_control {
+    snd_pcm_uframes_t appl_ptr;
+};
+
+struct snd_pcm_runtime {
+    int access;
+    snd_pcm_format_t format;
+    unsigned int rate;
+    unsigned int channels;
+    snd_pcm_uframes_t period_size;
+    snd_pcm_uframes_t buffer_size;
+    snd_pcm_uframes_t boundary;
+    struct snd_pcm_mmap_status *status;
+    struct snd_pcm_mmap_control *control;
+    void *private_data;
+    unsigned char *dma_area;
+    size_t dma_bytes;
+};
+
+struct snd_pcm_substream {
+    int stream;
+    struct snd_pcm_runtime *runtime;
+    void *private_data;
+};
+
+/* signed formats only */
+static inline int snd_pcm_format_set_silence(snd_pcm_format_t format, void *data,
+                                             unsigned int samples)
+{
+    memset(data, 0, samples * format);
+    return 0;
+}
+
+/* same as the kernel, appl_ptr and hw_ptr wrap at boundary */
+static inline snd_pcm_uframes_t snd_pcm_playback_avail(struct snd_pcm_runtime *runtime)
+{
+    snd_pcm_sframes_t avail = runtime->status->hw_ptr + runtime->buffer_size -
+                              runtime->control->appl_ptr;
+
+    if (avail < 0)
+        avail += runtime->boundary;
+    else if ((snd_pcm_uframes_t)avail >= runtime->boundary)
+        avail -= runtime->boundary;
+    return avail;
+}
+
+static inline snd_pcm_sframes_t snd_pcm_playback_hw_avail(struct snd_pcm_runtime *runtime)
+{
+    return runtime->buffer_size - snd_pcm_playback_avail(runtime);
+}
+
+#endif //KMOCK_PCM_H_
@@ -10,23 +10,42 @@
 #include <linux/fcntl.h>
 //#include <linux/system.h>
 #include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/uio.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+
+#include "memory.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 
 // declaration of memory functions
 static int memory_open(struct inode *inode, struct file *filp);
 static int memory_release(struct inode *inode, struct file *filp);
-static ssize_t memory_read(struct file *filp, char *buf, size_t count, loff_t *f_pos);
-static ssize_t memory_write(struct file *filp, char *buf, size_t count, loff_t *f_pos);
+static ssize_t memory_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t memory_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static loff_t memory_llseek(struct file *filp, loff_t offset, int whence);
+static long memory_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+static int memory_truncate(loff_t len);
+static void memory_free_pages(unsigned long first);
 
 void memory_exit(void);
 int memory_init(void);
 
 // structure that declares the usual file
+// read() and write() go through the iter functions
 
 static struct file_operations memory_fops = {
-    read: memory_read,
-    write: memory_write,
+    owner: THIS_MODULE,
+    llseek: memory_llseek,
+    read_iter: memory_read_iter,
+    write_iter: memory_write_iter,
+    unlocked_ioctl: memory_ioctl,
+    compat_ioctl: memory_ioctl,
     open: memory_open,
     release: memory_release
 };
@@ -39,7 +58,19 @@ module_exit(memory_exit);
 // Global variables
 static int memory_major = 60;
 
-static char *memory_buffer;
+static unsigned long memory_size;
+module_param(memory_size, ulong, 0444);
+MODULE_PARM_DESC(memory_size, "Size of the device in bytes, 0 grows it on demand");
+
+// the contents, one page per index, allocated on first write; holes read as zeros
+static DEFINE_XARRAY(memory_pages);
+
+// read and write share it, truncate takes it alone so no page goes away under a copy
+static DECLARE_RWSEM(memory_sem);
+
+// bytes in the device, memory_size when fixed
+static loff_t memory_len;
+static DEFINE_SPINLOCK(memory_len_lock);
 
 int memory_init(void)
 {
@@ -52,20 +83,16 @@ int memory_init(void)
         return result;
     }
 
-    memory_major = result;
+    if (result > 0)
+        memory_major = result;
     printk(KERN_NOTICE "memory: device registered with major number %i and minor number 0...255", memory_major);
 
-    memory_buffer = kmalloc(1, GFP_KERNEL);
-    if(!memory_buffer)
-    {
-        result = -ENOMEM;
-        memory_exit();
-        return result;
-    }
-
-    memset(memory_buffer, 0, 1);
+    memory_len = memory_size;
 
-    printk(KERN_NOTICE "Inserting memory module\n");
+    if (memory_size)
+        printk(KERN_NOTICE "Inserting memory module, %lu bytes\n", memory_size);
+    else
+        printk(KERN_NOTICE "Inserting memory module, grows on demand\n");
     return 0;
 }
 
@@ -74,17 +101,18 @@ void memory_exit(void)
     //freeing major number
     unregister_chrdev(memory_major, "memory");
 
-    //freeing buffer memory
-    if(memory_buffer)
-    {
-        kfree(memory_buffer);
-    }
+    //freeing the pages
+    memory_free_pages(0);
+    xa_destroy(&memory_pages);
 
     printk(KERN_NOTICE "Removing memory module\n");
 }
 
 static int memory_open(struct inode *inode, struct file *filp)
 {
+    if ((filp->f_flags & O_TRUNC) && (filp->f_mode & FMODE_WRITE))
+        return memory_truncate(0);
+
     return 0;
 }
 
@@ -93,26 +121,218 @@ static int memory_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-static ssize_t memory_read(struct file *filp, char *buf, size_t count, loff_t *f_pos)
+// ====== STORE ======
+
+static loff_t memory_limit(void)
+{
+    return memory_size ? (loff_t)memory_size : MAX_LFS_FILESIZE;
+}
+
+static loff_t memory_length(void)
+{
+    loff_t len;
+
+    spin_lock(&memory_len_lock);
+    len = memory_len;
+    spin_unlock(&memory_len_lock);
+
+    return len;
+}
+
+// frees every page from index first on; the caller holds memory_sem for writing, or is exit
+static void memory_free_pages(unsigned long first)
 {
-    copy_to_user(buf, memory_buffer, 1);
+    struct page *page;
+    unsigned long index = first;
 
-    if (*f_pos == 0)
+    while ((page = xa_find(&memory_pages, &index, ULONG_MAX, XA_PRESENT)) != NULL)
     {
-        *f_pos += 1;
-        return 1;
+        xa_erase(&memory_pages, index);
+        __free_page(page);
+        cond_resched();
     }
-    else
+}
+
+// a page where there was a hole: it is filled and the rest zeroed before it goes in
+// the xarray, so nobody sees what the allocator left in it. If another writer got
+// there first, this one writes into that page instead.
+static ssize_t memory_fill_new(unsigned long index, size_t off, size_t n, struct iov_iter *from)
+{
+    struct page *page, *old;
+    size_t copied;
+
+    // a whole page is overwritten, no need to clear it first
+    page = alloc_page(n == PAGE_SIZE ? GFP_HIGHUSER : GFP_HIGHUSER | __GFP_ZERO);
+    if (!page)
+        return -ENOMEM;
+
+    copied = copy_page_from_iter(page, off, n, from);
+    if (copied < n && n == PAGE_SIZE)
+        zero_user_segment(page, copied, PAGE_SIZE);
+
+    old = xa_cmpxchg(&memory_pages, index, NULL, page, GFP_KERNEL);
+    if (!old)
+        return copied;
+
+    __free_page(page);
+    iov_iter_revert(from, copied);
+    if (xa_is_err(old))
+        return xa_err(old);
+
+    return copy_page_from_iter(old, off, n, from);
+}
+
+// drops what lies past len; a fixed size device keeps its size, the other one takes len
+static int memory_truncate(loff_t len)
+{
+    struct page *page;
+    size_t off = len & ~PAGE_MASK;
+
+    if (len < 0 || len > memory_limit())
+        return -EINVAL;
+
+    down_write(&memory_sem);
+
+    if (off)
     {
+        page = xa_load(&memory_pages, len >> PAGE_SHIFT);
+        if (page)
+            zero_user_segment(page, off, PAGE_SIZE);
+    }
+    memory_free_pages((len + PAGE_SIZE - 1) >> PAGE_SHIFT);
+
+    if (!memory_size)
+    {
+        spin_lock(&memory_len_lock);
+        memory_len = len;
+        spin_unlock(&memory_len_lock);
+    }
+
+    up_write(&memory_sem);
+
+    return 0;
+}
+
+// ====== FILE ======
+
+static ssize_t memory_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct page *page;
+    loff_t pos = iocb->ki_pos, len;
+    size_t off, n, copied, done = 0;
+
+    down_read(&memory_sem);
+
+    len = memory_length();
+    while (iov_iter_count(to) && pos < len)
+    {
+        off = pos & ~PAGE_MASK;
+        n = min_t(loff_t, min_t(size_t, PAGE_SIZE - off, iov_iter_count(to)), len - pos);
+
+        page = xa_load(&memory_pages, pos >> PAGE_SHIFT);
+        if (page)
+            copied = copy_page_to_iter(page, off, n, to);
+        else
+            copied = iov_iter_zero(n, to);
+
+        pos += copied;
+        done += copied;
+        if (copied < n)
+            break;
+
+        cond_resched();
+    }
+
+    up_read(&memory_sem);
+
+    if (!done && iov_iter_count(to) && pos < len)
+        return -EFAULT;
+
+    iocb->ki_pos = pos;
+    return done;
+}
+
+static ssize_t memory_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct page *page;
+    loff_t pos, limit = memory_limit();
+    size_t off, n, done = 0;
+    ssize_t copied, result = 0;
+
+    if (!iov_iter_count(from))
         return 0;
+
+    down_read(&memory_sem);
+
+    pos = (iocb->ki_flags & IOCB_APPEND) ? memory_length() : iocb->ki_pos;
+    if (pos >= limit)
+    {
+        up_read(&memory_sem);
+        return -ENOSPC;
+    }
+
+    while (iov_iter_count(from) && pos < limit)
+    {
+        off = pos & ~PAGE_MASK;
+        n = min_t(loff_t, min_t(size_t, PAGE_SIZE - off, iov_iter_count(from)), limit - pos);
+
+        page = xa_load(&memory_pages, pos >> PAGE_SHIFT);
+        if (page)
+            copied = copy_page_from_iter(page, off, n, from);
+        else
+            copied = memory_fill_new(pos >> PAGE_SHIFT, off, n, from);
+
+        if (copied < 0)
+        {
+            result = copied;
+            break;
+        }
+
+        pos += copied;
+        done += copied;
+        if (copied < n)
+        {
+            result = -EFAULT;
+            break;
+        }
+
+        cond_resched();
     }
+
+    spin_lock(&memory_len_lock);
+    if (pos > memory_len)
+        memory_len = pos;
+    spin_unlock(&memory_len_lock);
+
+    up_read(&memory_sem);
+
+    if (!done)
+        return result;
+
+    iocb->ki_pos = pos;
+    return done;
+}
+
+static loff_t memory_llseek(struct file *filp, loff_t offset, int whence)
+{
+    return generic_file_llseek_size(filp, offset, whence, memory_limit(), memory_length());
 }
 
-static ssize_t memory_write(struct file *filp, char *buf, size_t count, loff_t *f_pos)
+static long memory_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    char *tmp;
+    u64 len;
 
-    tmp = buf+count-1;
-    copy_from_user(memory_buffer, tmp, 1);
-    return 1;
-}
\ No newline at end of file
+    switch (cmd)
+    {
+    case MEMORY_IOC_TRUNCATE:
+        if (!(filp->f_mode & FMODE_WRITE))
+            return -EBADF;
+        if (get_user(len, (u64 __user *)arg))
+            return -EFAULT;
+        if (len > (u64)memory_limit())
+            return -EINVAL;
+        return memory_truncate(len);
+    default:
+        return -ENOTTY;
+    }
+}
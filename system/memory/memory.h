@@ -0,0 +1,12 @@
+#ifndef MEMORY_H_
+#define MEMORY_H_
+/*
+ * ioctls of the memory device, major 60. Shared with userspace.
+ */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// drops what lies past the given length; sets the length unless memory_size is fixed
+#define MEMORY_IOC_TRUNCATE	_IOW('m', 1, __u64)
+
+#endif //MEMORY_H_
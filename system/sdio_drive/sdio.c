@@ -2,6 +2,7 @@
 #include <linux/mmc/card.h>
 #include <linux/mmc/core.h>
 #include <linux/mmc/host.h>
+#include <linux/cdev.h>
 
 static const struct sdio_device_id sdio_ids[] = {
         { SDIO_DEVICE(0x0213, 0x1002) },
@@ -20,6 +21,15 @@ static int __init sdio_init(void)
     ret = sdio_register_driver(&sdio_driver);
 }
 
+static DECLARE_BITMAP(sdio_card_slots, SDIO_MAX_CARDS);
+static DEFINE_MUTEX(sdio_card_lock);	/* sdio_card_slots, only at probe and remove */
+
+static int sdio_open(struct inode *inode, struct file *file)
+{
+    file->private_data = container_of(inode->i_cdev, struct sdio_card, cdev);
+    return 0;
+}
+
 static int __probe(struct sdio_func *func)
 {
     struct sdio_card *card;
@@ -36,34 +46,67 @@ static int __probe(struct sdio_func *func)
     sdio_claim_host(func);
     ret = sdio_enable_func(func);
     sdio_set_block_size(func, 512);
+    sdio_release_host(func);
     if (ret) {
         printk(" couldn't register device number   %d\n",ret);
         goto release;
     }
 
-    card->major = 	 major;
-    res = register_chrdev(major, MODULE_NAME, &fops_test);
-    major ++;
-    list_add_tail(&card->list, &sdio_card_list);
+    // a free slot, taken again by the next probe once this card is removed
+    mutex_lock(&sdio_card_lock);
+    card->slot = find_first_zero_bit(sdio_card_slots, SDIO_MAX_CARDS);
+    if (card->slot >= SDIO_MAX_CARDS) {
+        mutex_unlock(&sdio_card_lock);
+        ret = -ENODEV;
+        goto disable;
+    }
+    set_bit(card->slot, sdio_card_slots);
+    mutex_unlock(&sdio_card_lock);
+
+    // every card has its own bounce buffer, not only the first one
+    mutex_init(&card->kbuf_lock);
+    card->kbuf = kmalloc(MAX_SDIO_BYTES, GFP_KERNEL);
+    if (!card->kbuf) {
+        ret = -ENOMEM;
+        goto noslot;
+    }
+
+    card->major = SDIO_MAJOR + card->slot;
+    card->devid = MKDEV(card->major, 0);
+    res = register_chrdev_region(card->devid, 1, MODULE_NAME);
+    if (res < 0) {
+        ret = res;
+        goto nobuf;
+    }
+    // open() finds the card from the cdev, no list to walk
+    cdev_init(&card->cdev, &fops_test);
+    card->cdev.owner = THIS_MODULE;
+    ret = cdev_add(&card->cdev, card->devid, 1);
+    if (ret < 0)
+        goto noregion;
     printk("card->major   %d  \n",card->major);
 
-    sdio_release_host(func);
     sdio_set_drvdata(func, card);
     printk("SDIO data module probe:%d .\n", card->major);
-    BlockAddress = 0;
-
-    if (card->major==SDIO_MAJOR)
-    {
-        kbuf=kmalloc(MAX_SDIO_BYTES, GFP_KERNEL);
-        if (!kbuf)	pr_err("SDIO kmalloc failed .");
-        SampleRate=SampleBits=0;
-
-        //ret = request_irq(/*irq_number*/, (irq_handler_t)sdio_callback, IRQ_SHARE, "mmc-sdio", func);
-    }
-
-    return ret;
-    release:
+    card->block_address = 0;
+    card->sample_rate = card->sample_bits = 0;
+
+    //ret = request_irq(/*irq_number*/, (irq_handler_t)sdio_callback, IRQ_SHARE, "mmc-sdio", card);
+
+    return 0;
+    noregion:
+    unregister_chrdev_region(card->devid, 1);
+    nobuf:
+    kfree(card->kbuf);
+    noslot:
+    mutex_lock(&sdio_card_lock);
+    clear_bit(card->slot, sdio_card_slots);
+    mutex_unlock(&sdio_card_lock);
+    disable:
+    sdio_claim_host(func);
+    sdio_disable_func(func);
     sdio_release_host(func);
+    release:
     kfree(card);
     return ret;
 }
@@ -71,7 +114,6 @@ static int __probe(struct sdio_func *func)
 static int sdio_probe(struct sdio_func *func, const struct sdio_device_id *id)
 {
     pr_err("SDIO driver probe ...\n");
-    isResume ++;
     return __probe(func);
 }
 
@@ -79,32 +121,29 @@ static void __remove(struct sdio_func *func)
 {
     struct sdio_card *card;
 
-    if (major == SDIO_MAJOR) return;
-    pr_err("SDIO major=%d func = %p ... \n", major, func);
     card = sdio_get_drvdata(func);
     pr_err("SDIO card = %p ... \n", card);
 
     pr_err("card->major   %d  \n",card->major);
-    unregister_chrdev(card->major,"sdio_test");
-    list_del(&card->list);
-    major --;
+    cdev_del(&card->cdev);
+    unregister_chrdev_region(card->devid, 1);
     sdio_claim_host(func);
     sdio_disable_func(func);
     sdio_set_drvdata(func, NULL);
     sdio_release_host(func);
     pr_err("SDIO data module removed\n");
-    if (kbuf)
-    {
-        kfree(kbuf);
-        kbuf=NULL;
+    kfree(card->kbuf);
 
-        //free_irq(/*irq_num*/, void *dev_id);
-    }
+    //free_irq(/*irq_num*/, card);
+
+    mutex_lock(&sdio_card_lock);
+    clear_bit(card->slot, sdio_card_slots);
+    mutex_unlock(&sdio_card_lock);
+    kfree(card);
 }
 
 static void sdio_remove(struct sdio_func *func)
 {
     pr_err("SDIO driver exit ...\n");
-    isExit ++;
     __remove(func);
 }
\ No newline at end of file